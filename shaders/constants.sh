@@ -2,3 +2,5 @@
 // License: https://github.com/PetrPPetrov/gkm-local/blob/main/LICENSE
 
 #define TEXTURE_SIZE 512
+// Size of the material to texture array layer table, it is the count of all possible materials
+#define MATERIAL_LAYER_TABLE_SIZE 256
@@ -5,9 +5,9 @@ $input v_texcoord0
 
 #include <bgfx_shader.sh>
 
-SAMPLER2D(s_texColor, 0);
+SAMPLER2DARRAY(s_texColor, 0);
 
 void main()
 {
-    gl_FragColor = vec4(texture2D(s_texColor, v_texcoord0).xyz, 1.0);
+    gl_FragColor = vec4(texture2DArray(s_texColor, v_texcoord0).xyz, 1.0);
 }
@@ -1,6 +1,7 @@
 vec3 a_position   : POSITION;
 ivec2 a_texcoord0  : TEXCOORD0;
 ivec2 a_texcoord1  : TEXCOORD1;
+ivec2 a_texcoord2  : TEXCOORD2;
 vec4 i_data0      : TEXCOORD7;
 
-vec2 v_texcoord0  : TEXCOORD0;
+vec3 v_texcoord0  : TEXCOORD0;
@@ -1,12 +1,14 @@
 // Copyright 2023 Petr Petrov. All rights reserved.
 // License: https://github.com/PetrPPetrov/gkm-local/blob/main/LICENSE
 
-$input a_position, a_texcoord0, a_texcoord1, i_data0
+$input a_position, a_texcoord0, a_texcoord1, a_texcoord2, i_data0
 $output v_texcoord0
 
 #include <bgfx_shader.sh>
 #include "constants.sh"
 
+SAMPLER2D(s_materialLayers, 1);
+
 void main()
 {
     vec4 world_pos = vec4(a_position, 0.0) + i_data0;
@@ -14,5 +16,8 @@ void main()
     ivec3 offsets = mod(i_data0, 64) * 8;
     ivec2 uv_modes = abs(a_texcoord1) - ivec2(1, 1);
     ivec2 uv_signs = sign(a_texcoord1);
-    v_texcoord0 = (a_texcoord0 + ivec2(offsets[uv_modes.x] * uv_signs.x, offsets[uv_modes.y] * uv_signs.y)) / (float)TEXTURE_SIZE;
+    vec2 uv = (a_texcoord0 + ivec2(offsets[uv_modes.x] * uv_signs.x, offsets[uv_modes.y] * uv_signs.y)) / (float)TEXTURE_SIZE;
+    vec2 table_uv = vec2((a_texcoord2.x + 0.5) / (float)MATERIAL_LAYER_TABLE_SIZE, 0.5);
+    float layer = floor(texture2DLod(s_materialLayers, table_uv, 0.0).x * 255.0 + 0.5);
+    v_texcoord0 = vec3(uv, layer);
 }
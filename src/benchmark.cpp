@@ -0,0 +1,339 @@
+// Copyright 2023 Petr Petrov. All rights reserved.
+// License: https://github.com/PetrPPetrov/gkm-local/blob/main/LICENSE
+
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <algorithm>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include "main.h"
+#include "world.h"
+#include "world_streaming.h"
+#include "frame_pacer.h"
+#include "renderer.h"
+#include "profiler.h"
+#include "memory_statistics.h"
+#include "queue_statistics.h"
+#include "benchmark.h"
+
+struct BenchmarkReport {
+    float initialization_ms = 0.0f;
+    bool fully_meshed = false;
+    float time_to_fully_meshed_ms = 0.0f;
+    std::uint32_t meshing_frames = 0;
+    std::uint32_t frames = 0;
+    float playback_ms = 0.0f;
+    double cpu_frame_ms_sum = 0.0;
+    FrameTimeHistogram cpu_frame_times;
+    std::uint64_t instances_sum = 0;
+    std::uint32_t max_instances = 0;
+    std::uint64_t draw_calls_sum = 0;
+    std::uint32_t max_draw_calls = 0;
+    std::uint32_t max_truncated_instances = 0;
+    // Frames of the playback which had visible blocks waiting for tessellation.
+    std::uint32_t incomplete_frames = 0;
+    std::uint32_t posted_edits = 0;
+    bool memory_statistics_failed = false;
+};
+
+typedef std::chrono::steady_clock BenchmarkClock;
+
+BenchmarkScript makeDefaultBenchmarkScript() {
+    BenchmarkScript script;
+    script.frame_count = 1200;
+
+    // Fly 8 top-level blocks to the East looking slightly down, turn to the North and fly 8 blocks more.
+    constexpr double DISTANCE = 8.0 * TopLevelBlock::SIZE;
+    script.camera_path.push_back({ 0, { 0.0, 0.0, 90.0, -10.0 } });
+    script.camera_path.push_back({ 500, { DISTANCE, 0.0, 90.0, -10.0 } });
+    script.camera_path.push_back({ 600, { DISTANCE, 0.0, 0.0, 0.0 } });
+    script.camera_path.push_back({ 1200, { DISTANCE, DISTANCE, 0.0, 0.0 } });
+
+    // Build a wall in front of the player and break a hole in it later.
+    constexpr BlockIndex WALL_WIDTH = 32;
+    constexpr BlockIndex WALL_HEIGHT = 8;
+    constexpr BlockIndex HOLE_SIZE = 4;
+    for (BlockIndex z = 0; z < WALL_HEIGHT; ++z) {
+        for (BlockIndex x = 0; x < WALL_WIDTH; ++x) {
+            ScriptedEdit edit;
+            edit.frame = 60;
+            edit.operation.use_level = true;
+            edit.operation.level = 0;
+            edit.operation.material = 2;
+            edit.operation.x = Block<1>::SIZE * 4 + x * Block<0>::SIZE;
+            edit.operation.y = Block<1>::SIZE;
+            edit.operation.z = TopLevelBlock::SIZE + z * Block<0>::SIZE;
+            script.edits.push_back(edit);
+            const bool hole = std::abs(x - WALL_WIDTH / 2) < HOLE_SIZE / 2 && z < HOLE_SIZE;
+            if (hole) {
+                edit.frame = 300;
+                edit.operation.material = 0;
+                script.edits.push_back(edit);
+            }
+        }
+    }
+    std::stable_sort(script.edits.begin(), script.edits.end(), [](const ScriptedEdit& left, const ScriptedEdit& right) {
+        return left.frame < right.frame;
+    });
+    return script;
+}
+
+bool loadBenchmarkScript(const std::string& file_name, BenchmarkScript& script) {
+    std::ifstream input_file(file_name);
+    if (!input_file) {
+        return false;
+    }
+    script = BenchmarkScript();
+    std::string line;
+    while (std::getline(input_file, line)) {
+        const std::size_t comment = line.find('#');
+        if (comment != std::string::npos) {
+            line.erase(comment);
+        }
+        std::istringstream line_stream(line);
+        std::string command;
+        if (!(line_stream >> command)) {
+            continue;
+        }
+        if (command == "frames") {
+            if (!(line_stream >> script.frame_count)) {
+                return false;
+            }
+        } else if (command == "camera") {
+            CameraKey key;
+            if (!(line_stream >> key.frame >> key.coordinates.x >> key.coordinates.y >> key.coordinates.direction >> key.coordinates.pitch)) {
+                return false;
+            }
+            normalizeDirection(key.coordinates.direction);
+            normalizePitch(key.coordinates.pitch);
+            script.camera_path.push_back(key);
+        } else if (command == "edit") {
+            ScriptedEdit edit;
+            unsigned material = 0;
+            if (!(line_stream >> edit.frame >> edit.operation.x >> edit.operation.y >> edit.operation.z >> material) || material >= MATERIAL_MAX) {
+                return false;
+            }
+            edit.operation.material = static_cast<BlockMaterial>(material);
+            unsigned level = 0;
+            if (line_stream >> level) {
+                if (level > TOP_LEVEL) {
+                    return false;
+                }
+                edit.operation.use_level = true;
+                edit.operation.level = static_cast<std::uint8_t>(level);
+            }
+            script.edits.push_back(edit);
+        } else {
+            return false;
+        }
+    }
+    std::stable_sort(script.camera_path.begin(), script.camera_path.end(), [](const CameraKey& left, const CameraKey& right) {
+        return left.frame < right.frame;
+    });
+    std::stable_sort(script.edits.begin(), script.edits.end(), [](const ScriptedEdit& left, const ScriptedEdit& right) {
+        return left.frame < right.frame;
+    });
+    return !script.camera_path.empty();
+}
+
+PlayerCoordinates getScriptedCamera(const BenchmarkScript& script, std::uint32_t frame) {
+    const auto& path = script.camera_path;
+    auto next = std::upper_bound(path.begin(), path.end(), frame, [](std::uint32_t value, const CameraKey& key) {
+        return value < key.frame;
+    });
+    if (next == path.begin()) {
+        return path.front().coordinates;
+    }
+    if (next == path.end()) {
+        return path.back().coordinates;
+    }
+    const CameraKey& previous = *(next - 1);
+    const double t = static_cast<double>(frame - previous.frame) / static_cast<double>(next->frame - previous.frame);
+    PlayerCoordinates result;
+    result.x = previous.coordinates.x + (next->coordinates.x - previous.coordinates.x) * t;
+    result.y = previous.coordinates.y + (next->coordinates.y - previous.coordinates.y) * t;
+    result.pitch = previous.coordinates.pitch + (next->coordinates.pitch - previous.coordinates.pitch) * t;
+    // Turn by the shortest way
+    double direction_delta = next->coordinates.direction - previous.coordinates.direction;
+    if (direction_delta > 180.0) {
+        direction_delta -= 360.0;
+    } else if (direction_delta < -180.0) {
+        direction_delta += 360.0;
+    }
+    result.direction = previous.coordinates.direction + direction_delta * t;
+    normalizeDirection(result.direction);
+    return result;
+}
+
+static float getMilliseconds(BenchmarkClock::duration duration) {
+    return std::chrono::duration<float, std::milli>(duration).count();
+}
+
+static BenchmarkReport runScript(const BenchmarkScript& script, const BenchmarkOptions& options) {
+    BenchmarkReport report;
+    g_player_coordinates.write(script.camera_path.front().coordinates);
+
+    const auto initialization_start = BenchmarkClock::now();
+    initializeHeadlessRenderer(options.width, options.height, options.quality_level);
+    startBlockOperationThread();
+    startWorldStreamingThreads();
+    const auto meshing_start = BenchmarkClock::now();
+    report.initialization_ms = getMilliseconds(meshing_start - initialization_start);
+
+    // Stay at the first camera key until all visible blocks are meshed.
+    const std::chrono::milliseconds mesh_timeout(options.mesh_timeout_ms);
+    while (BenchmarkClock::now() - meshing_start < mesh_timeout) {
+        renderHeadlessFrame();
+        ++report.meshing_frames;
+        // The first frame only requests tessellation
+        if (report.meshing_frames > 1 && g_render_statistics.incomplete_blocks == 0) {
+            report.fully_meshed = true;
+            break;
+        }
+    }
+    report.time_to_fully_meshed_ms = getMilliseconds(BenchmarkClock::now() - meshing_start);
+
+    const auto playback_start = BenchmarkClock::now();
+    std::size_t next_edit = 0;
+    for (std::uint32_t frame = 0; frame < script.frame_count; ++frame) {
+        g_player_coordinates.write(getScriptedCamera(script, frame));
+        while (next_edit < script.edits.size() && script.edits[next_edit].frame <= frame) {
+            postBlockOperation(script.edits[next_edit].operation);
+            ++next_edit;
+            ++report.posted_edits;
+        }
+        renderHeadlessFrame();
+
+        const float cpu_frame_ms = g_render_statistics.cpu_frame_ms;
+        const std::uint32_t instances = g_render_statistics.instances;
+        const std::uint32_t draw_calls = g_render_statistics.draw_calls;
+        report.cpu_frame_times.add(cpu_frame_ms);
+        report.cpu_frame_ms_sum += cpu_frame_ms;
+        report.instances_sum += instances;
+        report.max_instances = std::max(report.max_instances, instances);
+        report.draw_calls_sum += draw_calls;
+        report.max_draw_calls = std::max(report.max_draw_calls, draw_calls);
+        report.max_truncated_instances = std::max(report.max_truncated_instances, g_render_statistics.truncated_instances.load());
+        if (g_render_statistics.incomplete_blocks != 0) {
+            ++report.incomplete_frames;
+        }
+        ++report.frames;
+    }
+    report.playback_ms = getMilliseconds(BenchmarkClock::now() - playback_start);
+
+    // The world is released by the shutdown, so memory statistics are written before it.
+    if (!options.memory_file_name.empty()) {
+        report.memory_statistics_failed = !dumpMemoryStatistics(options.memory_file_name);
+    }
+    g_is_running = false;
+    shutdownHeadlessRenderer();
+    return report;
+}
+
+static void writeReport(std::ostream& output, const BenchmarkReport& report, const BenchmarkOptions& options) {
+    const double frames = std::max<std::uint32_t>(report.frames, 1);
+    output << "width " << options.width << "\n";
+    output << "height " << options.height << "\n";
+    output << "quality_level " << options.quality_level << "\n";
+    output << "initialization_ms " << report.initialization_ms << "\n";
+    output << "fully_meshed " << (report.fully_meshed ? 1 : 0) << "\n";
+    output << "time_to_fully_meshed_ms " << report.time_to_fully_meshed_ms << "\n";
+    output << "meshing_frames " << report.meshing_frames << "\n";
+    output << "frames " << report.frames << "\n";
+    output << "playback_ms " << report.playback_ms << "\n";
+    output << "cpu_frame_mean_ms " << report.cpu_frame_ms_sum / frames << "\n";
+    output << "cpu_frame_p50_ms " << report.cpu_frame_times.getPercentile(0.5f) << "\n";
+    output << "cpu_frame_p95_ms " << report.cpu_frame_times.getPercentile(0.95f) << "\n";
+    output << "cpu_frame_p99_ms " << report.cpu_frame_times.getPercentile(0.99f) << "\n";
+    output << "cpu_frame_worst_ms " << report.cpu_frame_times.getWorstMs() << "\n";
+    output << "instances_mean " << report.instances_sum / frames << "\n";
+    output << "instances_max " << report.max_instances << "\n";
+    output << "draw_calls_mean " << report.draw_calls_sum / frames << "\n";
+    output << "draw_calls_max " << report.max_draw_calls << "\n";
+    output << "truncated_instances_max " << report.max_truncated_instances << "\n";
+    output << "incomplete_frames " << report.incomplete_frames << "\n";
+    output << "posted_edits " << report.posted_edits << "\n";
+
+    std::vector<RequestQueueSnapshot> queues;
+    collectRequestQueueStatistics(queues);
+    for (const auto& queue : queues) {
+        const std::string prefix = std::string("queue_") + queue.name + "_";
+        output << prefix << "pushes " << queue.pushes << "\n";
+        output << prefix << "high_water_mark " << queue.high_water_mark << "\n";
+        output << prefix << "latency_p50_us " << queue.getLatencyPercentileUs(0.5f) << "\n";
+        output << prefix << "latency_p99_us " << queue.getLatencyPercentileUs(0.99f) << "\n";
+        output << prefix << "blocking_waits " << queue.blocking_waits << "\n";
+        output << prefix << "overflows " << queue.overflows << "\n";
+    }
+}
+
+static bool parseOptions(int argc, char** argv, BenchmarkOptions& options) {
+    for (int i = 1; i < argc; ++i) {
+        const char* option = argv[i];
+        if (std::strcmp(option, "--headless") == 0) {
+            continue;
+        }
+        if (i + 1 >= argc) {
+            return false;
+        }
+        std::istringstream value(argv[++i]);
+        if (std::strcmp(option, "--script") == 0) {
+            options.script_file_name = value.str();
+        } else if (std::strcmp(option, "--report") == 0) {
+            options.report_file_name = value.str();
+        } else if (std::strcmp(option, "--trace") == 0) {
+            options.trace_file_name = value.str();
+        } else if (std::strcmp(option, "--memory") == 0) {
+            options.memory_file_name = value.str();
+        } else if (std::strcmp(option, "--width") == 0) {
+            value >> options.width;
+        } else if (std::strcmp(option, "--height") == 0) {
+            value >> options.height;
+        } else if (std::strcmp(option, "--quality") == 0) {
+            value >> options.quality_level;
+        } else if (std::strcmp(option, "--mesh-timeout") == 0) {
+            value >> options.mesh_timeout_ms;
+        } else {
+            return false;
+        }
+        if (!value) {
+            return false;
+        }
+    }
+    return options.width > 0 && options.height > 0;
+}
+
+int runHeadlessBenchmark(int argc, char** argv) {
+    BenchmarkOptions options;
+    if (!parseOptions(argc, argv, options)) {
+        std::cerr << "Usage: " << argv[0] << " [--script file] [--report file] [--trace file] [--memory file] [--width pixels] [--height pixels] [--quality level] [--mesh-timeout ms]" << std::endl;
+        return EXIT_FAILURE;
+    }
+    BenchmarkScript script = makeDefaultBenchmarkScript();
+    if (!options.script_file_name.empty() && !loadBenchmarkScript(options.script_file_name, script)) {
+        std::cerr << "Couldn't load benchmark script " << options.script_file_name << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    const BenchmarkReport report = runScript(script, options);
+    writeReport(std::cout, report, options);
+    std::ofstream report_file(options.report_file_name);
+    if (report_file) {
+        writeReport(report_file, report, options);
+    }
+    if (!report_file) {
+        std::cerr << "Couldn't write benchmark report " << options.report_file_name << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (!options.trace_file_name.empty() && !dumpChromeTrace(options.trace_file_name)) {
+        std::cerr << "Couldn't write profiler trace " << options.trace_file_name << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (report.memory_statistics_failed) {
+        std::cerr << "Couldn't write memory statistics " << options.memory_file_name << std::endl;
+        return EXIT_FAILURE;
+    }
+    return report.fully_meshed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
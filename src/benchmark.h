@@ -0,0 +1,54 @@
+// Copyright 2023 Petr Petrov. All rights reserved.
+// License: https://github.com/PetrPPetrov/gkm-local/blob/main/LICENSE
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "game_logic.h"
+#include "block_operation.h"
+
+// Camera position which is reached at the specified frame, the camera moves linearly between keys.
+struct CameraKey {
+    std::uint32_t frame = 0;
+    PlayerCoordinates coordinates;
+};
+
+// Block operation which is posted before the specified frame.
+struct ScriptedEdit {
+    std::uint32_t frame = 0;
+    BlockOperation operation;
+};
+
+struct BenchmarkScript {
+    std::uint32_t frame_count = 0;
+    // Sorted by frame, the first key is used while the world is being meshed.
+    std::vector<CameraKey> camera_path;
+    // Sorted by frame.
+    std::vector<ScriptedEdit> edits;
+};
+
+struct BenchmarkOptions {
+    std::string script_file_name;
+    std::string report_file_name = "benchmark_report.txt";
+    // Profiler zones of the whole run are written in Chrome trace event format if it is not empty.
+    std::string trace_file_name;
+    // Memory statistics at the end of the playback are written as JSON if it is not empty.
+    std::string memory_file_name;
+    std::uint32_t width = 1280;
+    std::uint32_t height = 720;
+    unsigned quality_level = 3;
+    // The run is reported as not meshed if the first camera key is not fully meshed during this time.
+    std::uint32_t mesh_timeout_ms = 60000;
+};
+
+// Flies over the default flat world and builds a wall on the way.
+BenchmarkScript makeDefaultBenchmarkScript();
+// Text file with lines "frames <count>", "camera <frame> <x> <y> <direction> <pitch>"
+// and "edit <frame> <x> <y> <z> <material> [level]", "#" starts a comment. Returns false on failure.
+bool loadBenchmarkScript(const std::string& file_name, BenchmarkScript& script);
+PlayerCoordinates getScriptedCamera(const BenchmarkScript& script, std::uint32_t frame);
+
+// Parses the command line, runs the benchmark without a window and writes the report, returns the process exit code.
+int runHeadlessBenchmark(int argc, char** argv);
@@ -14,6 +14,8 @@
 #include "bimg/encode.h"
 #include "bgfx/bgfx.h"
 #include "imgui/imgui.h"
+#include "release_queue.h"
+#include "block_vertex.h"
 
 template<class BgfxType>
 class BgfxHandleHolder {
@@ -22,7 +24,8 @@ class BgfxHandleHolder {
 public:
     BgfxHandleHolder(BgfxType bgfx_handle_) : bgfx_handle(bgfx_handle_) {}
     ~BgfxHandleHolder() {
-        bgfx::destroy(bgfx_handle);
+        // The last owner can be any thread, so the handle is destroyed later by the render thread
+        scheduleRelease(bgfx_handle);
     }
     operator BgfxType() const {
         return bgfx_handle;
@@ -58,6 +61,7 @@ typedef BgfxSharedPtr<bgfx::TextureHandle> BgfxTexturePtr;
 class BgfxEngineShutdown {
 public:
     ~BgfxEngineShutdown() {
+        g_release_queue.close();
         bgfx::shutdown();
     }
 };
@@ -80,17 +84,14 @@ public:
 
 #pragma pack(push, 1)
 
-struct BgfxVertex {
-    float x, y, z;
-    std::int16_t u, v;
-    std::int16_t offset_u_mode, offset_v_mode;
-
+struct BgfxVertex : public BlockVertex {
     static void init() {
         ms_layout
             .begin()
             .add(bgfx::Attrib::Position, 3, bgfx::AttribType::Float)
             .add(bgfx::Attrib::TexCoord0, 2, bgfx::AttribType::Int16)
             .add(bgfx::Attrib::TexCoord1, 2, bgfx::AttribType::Int16)
+            .add(bgfx::Attrib::TexCoord2, 2, bgfx::AttribType::Int16)
             .end();
     }
 
@@ -98,3 +99,5 @@ struct BgfxVertex {
 };
 
 #pragma pack(pop)
+
+static_assert(sizeof(BgfxVertex) == sizeof(BlockVertex));
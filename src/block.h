@@ -3,47 +3,95 @@
 
 #pragma once
 
+#include <cassert>
 #include <cstdint>
 #include <atomic>
 #include <memory>
+#include <algorithm>
 #include "gkm_local.h"
-#include "draw_info.h"
 #include "fnv_hash.h"
 #include "game_logic.h"
 #include "spin_lock.h"
+#include "memory_statistics.h"
+#include "epoch.h"
 #include "constants.sh"
 
 static_assert(std::atomic<bool>::is_always_lock_free);
 
+// Blocks do not depend on the renderer, draw info is defined in draw_info.h.
+struct BlockDrawInfo;
+struct BlockBase;
+
+// Id of a block record in the world store, it is the offset of the record in the block store.
+typedef std::uint64_t StoredBlockId;
+constexpr StoredBlockId NULL_STORED_BLOCK = 0;
+
+// Requests paging in of paged out children of the block, it is defined in block_paging.cpp.
+void postBlockPageIn(std::uint8_t level, const BlockBase* block);
+
 // Base class for representing blocks in this game.
-struct BlockBase {
+// Blocks are built by copy-on-write in block operations and frozen when they are published in the block cache:
+// entire, material, materials and children never change after onPublished(), so they are plain data read without locks.
+// Only the block pager pages children in and out, their content stays the same.
+// Published blocks reach other threads only through the world and request queues, which synchronize the frozen data.
+// Children are owned by their parent, except children which the block pager paged out to the world store (see BlockChild).
+struct BlockBase : public std::enable_shared_from_this<BlockBase> {
     // Indicates that the entire block is filled by one material (or entire empty).
-    std::atomic<bool> entire = true;
+    bool entire = true;
     // Specifies the material for this block. Usefull only if entire is true.
-    std::atomic<BlockMaterial> material = 0;
+    BlockMaterial material = 0;
 
     // Indicates that tessellation request was sent for this block.
     std::atomic<bool> tessellation_request = false;
     // Contains pre-tessellated vertex buffers for rendering by BGFX.
-    SpinLocked<BlockDrawInfo::Ptr> draw_info;
-    // Collects information for instance drawing. It is used only by single rendering thread.
-    // So, no multi-threaded synchronization is required.
-    std::list<DrawInstanceInfo> draw_instance_info;
+    SpinLocked<std::shared_ptr<BlockDrawInfo>> draw_info;
+    // Majority material of the block, parent blocks use it for their level of detail meshes.
+    // It is calculated by updateLod() once before the block is published in the block cache.
+    BlockMaterial representative_material = 0;
+    // Contains level of detail mesh with one cube per child, it is used for far blocks.
+    SpinLocked<std::shared_ptr<BlockDrawInfo>> lod_draw_info;
+    // Indicates that the block is published in the block cache, only published blocks are counted in memory statistics.
+    bool cached = false;
+    // Indicates that page in request was sent for children of this block.
+    mutable std::atomic<bool> page_in_request = false;
+    // Value of the block access clock when the block was used by the renderer last time.
+    mutable std::atomic<std::uint32_t> last_access = 0;
 
     BlockBase(BlockMaterial material_ = 0) {
         material = material_;
     }
 
-    BlockBase(const BlockBase& other) {
-        entire = other.entire.load();
+    // The copy is a new block, so it is not owned by owners of the other block.
+    BlockBase(const BlockBase& other) : std::enable_shared_from_this<BlockBase>() {
+        entire = other.entire;
         if (entire) {
-            material = other.material.load();
+            material = other.material;
         }
     }
 };
 
 constexpr BlockIndex NESTED_BLOCKS = 8;
 
+// Returns the most frequent non-empty material if at least a half of materials are non-empty, otherwise 0.
+inline BlockMaterial getRepresentativeMaterial(const BlockMaterial* materials, std::uint32_t count) {
+    std::uint32_t count_per_material[MATERIAL_MAX] = { 0 };
+    for (std::uint32_t i = 0; i < count; ++i) {
+        ++count_per_material[materials[i]];
+    }
+    if (count_per_material[0] * 2 > count) {
+        return 0;
+    }
+    BlockMaterial result = 0;
+    std::uint32_t result_count = 0;
+    for (unsigned cur_material = 1; cur_material < MATERIAL_MAX; ++cur_material) {
+        if (count_per_material[cur_material] > result_count) {
+            result = static_cast<BlockMaterial>(cur_material);
+            result_count = count_per_material[cur_material];
+        }
+    }
+    return result;
+}
+
 // Level 0 = 8 cm
 // Level 1 = 64 cm
 // Level 2 = 5 m 12 cm
@@ -59,19 +107,30 @@ struct Block<0> : public BlockBase {
     constexpr static BlockIndex MATERIAL_COUNT = NESTED_BLOCKS * NESTED_BLOCKS * NESTED_BLOCKS;
     constexpr static BlockIndex SIZE = NESTED_BLOCKS;
 
-    std::atomic<BlockMaterial> materials[MATERIAL_COUNT] = { 0 };
+    BlockMaterial materials[MATERIAL_COUNT] = { 0 };
 
     Block(BlockMaterial material_ = 0) : BlockBase(material_) {
     }
 
     Block(const Block<0>& other) : BlockBase(other) {
         if (!entire) {
-            for (BlockIndex i = 0; i < MATERIAL_COUNT; ++i) {
-                materials[i] = other.materials[i].load();
-            }
+            std::copy(other.materials, other.materials + MATERIAL_COUNT, materials);
         }
     }
 
+    ~Block() {
+        if (cached) {
+            onBlockReleased(0, sizeof(Block<0>), 0);
+        }
+    }
+
+    // Should be called once when the block is published in the block cache, it freezes the block.
+    void onPublished() {
+        assert(!cached);
+        cached = true;
+        onBlockPublished(0, sizeof(Block<0>), 0);
+    }
+
     BlockMaterial getMaterial(BlockIndex x, BlockIndex y, BlockIndex z) const {
         if (entire) {
             return material;
@@ -80,22 +139,78 @@ struct Block<0> : public BlockBase {
         }
     }
 
+    void updateLod() {
+        if (entire) {
+            representative_material = material;
+        } else {
+            representative_material = getRepresentativeMaterial(materials, MATERIAL_COUNT);
+        }
+    }
+
     FnvHash::Hash calculateHash() const {
         FnvHash hash;
-        bool entire_value = entire.load();
-        hash.update(entire_value);
-        if (entire_value) {
-            BlockMaterial material_value = material.load();
-            hash.update(material_value);
+        hash.update(entire);
+        if (entire) {
+            hash.update(material);
         } else {
-            for (BlockIndex i = 0; i < MATERIAL_COUNT; ++i) {
-                hash.update(materials[i].load());
-            }
+            hash.update(materials);
         }
         return hash.getHash();
     }
 };
 
+// Reference to a child block. A child which has a record in the world store could be paged out by the block pager,
+// then only the id of its record is kept. Resident children are read without locks by raw pointers:
+// readers should hold an EpochGuard or own the parent exclusively, paged out children are released after readers.
+// The owner is changed only by the block pager and by the thread which builds the parent before it is published.
+template <std::uint8_t Level>
+struct BlockChild {
+    typename Block<Level>::Ptr owner;
+    std::atomic<Block<Level>*> resident = nullptr;
+    // Set when the child is loaded from the store or saved, it does not change then.
+    std::atomic<StoredBlockId> stored_id = NULL_STORED_BLOCK;
+
+    // Returns nullptr if there is no child or it is paged out.
+    Block<Level>* get() const {
+        return resident.load(std::memory_order_acquire);
+    }
+    // Returns nullptr if there is no child or it is paged out, the child is kept alive by the returned pointer.
+    typename Block<Level>::Ptr lock() const {
+        EpochGuard epoch_guard;
+        Block<Level>* child = get();
+        return child ? std::static_pointer_cast<Block<Level>>(child->shared_from_this()) : nullptr;
+    }
+    StoredBlockId getStoredId() const {
+        return stored_id.load(std::memory_order_relaxed);
+    }
+    bool isPagedOut() const {
+        return !get() && getStoredId() != NULL_STORED_BLOCK;
+    }
+
+    // Should be used only before the parent is published.
+    void set(const typename Block<Level>::Ptr& child, StoredBlockId id = NULL_STORED_BLOCK) {
+        owner = child;
+        resident.store(child.get(), std::memory_order_relaxed);
+        stored_id.store(id, std::memory_order_relaxed);
+    }
+    void copyFrom(const BlockChild<Level>& other) {
+        set(other.lock(), other.getStoredId());
+    }
+    void setStoredId(StoredBlockId id) {
+        stored_id.store(id, std::memory_order_relaxed);
+    }
+
+    // Block pager only, readers which could see the child should be gone before the returned owner is released.
+    typename Block<Level>::Ptr pageOut() {
+        resident.store(nullptr, std::memory_order_release);
+        return std::move(owner);
+    }
+    void pageIn(const typename Block<Level>::Ptr& child) {
+        owner = child;
+        resident.store(child.get(), std::memory_order_release);
+    }
+};
+
 template <std::uint8_t Level>
 struct Block : public BlockBase
 {
@@ -104,19 +219,53 @@ struct Block : public BlockBase
     constexpr static BlockIndex CHILDREN_COUNT = NESTED_BLOCKS * NESTED_BLOCKS * NESTED_BLOCKS;
     constexpr static BlockIndex SIZE = NESTED_BLOCKS * Block<Level - 1>::SIZE;
 
-    SpinLocked<typename Block<Level-1>::Ptr> children[CHILDREN_COUNT] = { nullptr };
+    BlockChild<Level - 1> children[CHILDREN_COUNT];
+    // Representative material of every child, it is the source for the level of detail mesh.
+    // It is known for paged out children as well, so they have level of detail without being paged in.
+    BlockMaterial lod_materials[CHILDREN_COUNT] = { 0 };
 
     Block(BlockMaterial material_ = 0) : BlockBase(material_) {
     }
 
     Block(const Block<Level>& other) : BlockBase(other) {
         if (!entire) {
-            for (BlockIndex i = 0; i < Block<Level>::CHILDREN_COUNT; ++i) {
-                children[i].write(other.children[i].read());
+            EpochGuard epoch_guard;
+            for (BlockIndex i = 0; i < CHILDREN_COUNT; ++i) {
+                children[i].copyFrom(other.children[i]);
             }
+            std::copy(other.lod_materials, other.lod_materials + CHILDREN_COUNT, lod_materials);
+        }
+    }
+
+    ~Block() {
+        if (cached) {
+            onBlockReleased(Level, sizeof(Block<Level>), getChildReferences());
         }
     }
 
+    // Should be called once when the block is published in the block cache, it freezes the block.
+    void onPublished() {
+        assert(!cached);
+        cached = true;
+        onBlockPublished(Level, sizeof(Block<Level>), getChildReferences());
+    }
+
+    // Returns false if some children are paged out.
+    bool areChildrenResident() const {
+        for (BlockIndex i = 0; i < CHILDREN_COUNT; ++i) {
+            if (children[i].isPagedOut()) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Published blocks do not change, a block which is not entire references all its children.
+    BlockIndex getChildReferences() const {
+        return entire ? 0 : CHILDREN_COUNT;
+    }
+
+    // Paged out children are not waited for, their representative material is returned and they are requested from the store.
     BlockMaterial getMaterial(BlockIndex x, BlockIndex y, BlockIndex z) const {
         if (entire) {
             return material;
@@ -124,24 +273,53 @@ struct Block : public BlockBase
         BlockIndex sub_block_x = x / Block<Level - 1>::SIZE;
         BlockIndex sub_block_y = y / Block<Level - 1>::SIZE;
         BlockIndex sub_block_z = z / Block<Level - 1>::SIZE;
-        auto child = children[sub_block_z * NESTED_BLOCKS * NESTED_BLOCKS + sub_block_y * NESTED_BLOCKS + sub_block_x].read();
-        assert(child.get());
+        const BlockIndex child_index = sub_block_z * NESTED_BLOCKS * NESTED_BLOCKS + sub_block_y * NESTED_BLOCKS + sub_block_x;
+        const Block<Level - 1>* child = children[child_index].get();
+        if (!child) {
+            assert(children[child_index].isPagedOut());
+            postBlockPageIn(Level, this);
+            return lod_materials[child_index];
+        }
         BlockIndex inside_sub_block_x = x % Block<Level - 1>::SIZE;
         BlockIndex inside_sub_block_y = y % Block<Level - 1>::SIZE;
         BlockIndex inside_sub_block_z = z % Block<Level - 1>::SIZE;
         return child->getMaterial(inside_sub_block_x, inside_sub_block_y, inside_sub_block_z);
     }
 
+    // Children should be already published, so their representative materials are known.
+    // Representative materials of paged out children are kept.
+    void updateLod() {
+        if (entire) {
+            representative_material = material;
+        } else {
+            for (BlockIndex i = 0; i < CHILDREN_COUNT; ++i) {
+                const Block<Level - 1>* child = children[i].get();
+                if (child) {
+                    lod_materials[i] = child->representative_material;
+                } else if (!children[i].isPagedOut()) {
+                    lod_materials[i] = 0;
+                }
+            }
+            representative_material = getRepresentativeMaterial(lod_materials, CHILDREN_COUNT);
+        }
+    }
+
     FnvHash::Hash calculateHash() const {
         FnvHash hash;
-        bool entire_value = entire.load();
-        hash.update(entire_value);
-        if (entire_value) {
-            BlockMaterial material_value = material.load();
-            hash.update(material_value);
+        hash.update(entire);
+        if (entire) {
+            hash.update(material);
         } else {
+            // Children which have records are identified by their ids, so paging does not change the hash.
+            // Only resident children are identified by pointers, a tag separates ids from pointers.
             for (BlockIndex i = 0; i < CHILDREN_COUNT; ++i) {
-                hash.update(children[i].read().get());
+                const StoredBlockId id = children[i].getStoredId();
+                hash.update(id != NULL_STORED_BLOCK);
+                if (id != NULL_STORED_BLOCK) {
+                    hash.update(id);
+                } else {
+                    hash.update(children[i].get());
+                }
             }
         }
         return hash.getHash();
@@ -154,6 +332,7 @@ constexpr std::int16_t TEX_COORD_RATIO = TEXTURE_SIZE / StandardBlock::SIZE;
 
 constexpr std::uint8_t TOP_LEVEL = 3;
 typedef Block<TOP_LEVEL> TopLevelBlock;
+static_assert(TOP_LEVEL + 1 == BLOCK_LEVEL_COUNT);
 
 template <template<std::uint8_t> typename Operator, std::uint8_t Level>
 struct ExecutorForAllLevels;
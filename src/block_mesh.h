@@ -0,0 +1,144 @@
+// Copyright 2023 Petr Petrov. All rights reserved.
+// License: https://github.com/PetrPPetrov/gkm-local/blob/main/LICENSE
+
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <iterator>
+#include "block.h"
+#include "block_vertex.h"
+
+// CPU side of block tessellation, it does not depend on bgfx.
+// Every builder has a counting function, so the caller can allocate the vertex buffer of the exact size.
+
+constexpr std::uint32_t VERTICES_PER_CUBE = 12 * 3;
+
+template <BlockIndex Size>
+inline void addSimpleCube(BlockVertex* vbo, unsigned& vbo_index, BlockIndex base_x, BlockIndex base_y, BlockIndex base_z, BlockMaterial material) {
+    constexpr static BlockIndex SIZE = Size;
+    constexpr static BlockIndex coords[8][3] = {
+        { 0, 0, 0 },
+        { 1, 0, 0 },
+        { 1, 1, 0 },
+        { 0, 1, 0 },
+        { 0, 0, 1 },
+        { 1, 0, 1 },
+        { 1, 1, 1 },
+        { 0, 1, 1 }
+    };
+    constexpr static std::int16_t indices[12][5] = {
+        { 0, 3, 1,  1, 2 },
+        { 3, 2, 1,  1, 2 },
+        { 4, 5, 7,  1, 2 },
+        { 7, 5, 6,  1, 2 },
+        { 0, 1, 4,  1, 3 },
+        { 4, 1, 5,  1, 3 },
+        { 1, 2, 5,  2, 3 },
+        { 5, 2, 6,  2, 3 },
+        { 2, 3, 6, -1, 3 },
+        { 3, 7, 6, -1, 3 },
+        { 3, 0, 4, -2, 3 },
+        { 3, 4, 7, -2, 3 }
+    };
+    constexpr static std::int16_t TEX_COORD_SIZE = static_cast<std::int16_t>(SIZE * TEX_COORD_RATIO);
+
+    const std::int16_t offsets[3] = {
+        static_cast<std::int16_t>((base_x % StandardBlock::SIZE) * TEX_COORD_RATIO),
+        static_cast<std::int16_t>((base_y % StandardBlock::SIZE) * TEX_COORD_RATIO),
+        static_cast<std::int16_t>((base_z % StandardBlock::SIZE) * TEX_COORD_RATIO),
+    };
+
+    for (unsigned i = 0; i < std::size(indices); ++i) {
+        std::uint16_t u_index = std::abs(indices[i][3]) - 1;
+        std::uint16_t v_index = std::abs(indices[i][4]) - 1;
+        for (unsigned j = 0; j < 3; ++j) {
+            vbo[vbo_index].x = static_cast<float>(base_x + coords[indices[i][j]][0] * SIZE);
+            vbo[vbo_index].y = static_cast<float>(base_y + coords[indices[i][j]][1] * SIZE);
+            vbo[vbo_index].z = static_cast<float>(base_z + coords[indices[i][j]][2] * SIZE);
+            std::int16_t u = coords[indices[i][j]][u_index] * TEX_COORD_SIZE;
+            std::int16_t v = coords[indices[i][j]][v_index] * TEX_COORD_SIZE;
+            if (indices[i][3] > 0) {
+                u += offsets[u_index];
+            } else {
+                u = TEXTURE_SIZE - u - offsets[u_index];
+            }
+            if (indices[i][4] > 0) {
+                v += offsets[v_index];
+            } else {
+                v = TEXTURE_SIZE - v - offsets[v_index];
+            }
+            vbo[vbo_index].u = u;
+            vbo[vbo_index].v = v;
+            vbo[vbo_index].offset_u_mode = indices[i][3];
+            vbo[vbo_index].offset_v_mode = indices[i][4];
+            vbo[vbo_index].material = material;
+            vbo[vbo_index].reserved = 0;
+            ++vbo_index;
+        }
+    }
+}
+
+// Returns count of non-empty cells of the block with 1 unit cells.
+template <std::uint8_t Level>
+std::uint32_t countBlockCubes(const Block<Level>& block) {
+    std::uint32_t block_count = 0;
+    for (BlockIndex z = 0; z < Block<Level>::SIZE; ++z) {
+        for (BlockIndex y = 0; y < Block<Level>::SIZE; ++y) {
+            for (BlockIndex x = 0; x < Block<Level>::SIZE; ++x) {
+                if (block.getMaterial(x, y, z) != 0) {
+                    ++block_count;
+                }
+            }
+        }
+    }
+    return block_count;
+}
+
+// Adds one cube per non-empty unit cell, vbo should have room for countBlockCubes() cubes. Returns count of vertices.
+template <std::uint8_t Level>
+std::uint32_t buildBlockMesh(const Block<Level>& block, BlockVertex* vbo) {
+    unsigned vbo_index = 0;
+    for (BlockIndex z = 0; z < Block<Level>::SIZE; ++z) {
+        for (BlockIndex y = 0; y < Block<Level>::SIZE; ++y) {
+            for (BlockIndex x = 0; x < Block<Level>::SIZE; ++x) {
+                BlockMaterial cur_material = block.getMaterial(x, y, z);
+                if (cur_material != 0) {
+                    addSimpleCube<1>(vbo, vbo_index, x, y, z, cur_material);
+                }
+            }
+        }
+    }
+    return vbo_index;
+}
+
+// Returns count of children which have non-empty representative material.
+template <std::uint8_t Level>
+std::uint32_t countLodCubes(const Block<Level>& block) {
+    std::uint32_t cell_count = 0;
+    for (BlockIndex i = 0; i < Block<Level>::CHILDREN_COUNT; ++i) {
+        if (block.lod_materials[i] != 0) {
+            ++cell_count;
+        }
+    }
+    return cell_count;
+}
+
+// Adds one cube per child from the representative materials of children, vbo should have room for countLodCubes() cubes.
+// Returns count of vertices.
+template <std::uint8_t Level>
+std::uint32_t buildLodMesh(const Block<Level>& block, BlockVertex* vbo) {
+    constexpr static BlockIndex CELL_SIZE = Block<Level - 1>::SIZE;
+    unsigned vbo_index = 0;
+    for (BlockIndex z = 0; z < NESTED_BLOCKS; ++z) {
+        for (BlockIndex y = 0; y < NESTED_BLOCKS; ++y) {
+            for (BlockIndex x = 0; x < NESTED_BLOCKS; ++x) {
+                BlockMaterial cur_material = block.lod_materials[z * NESTED_BLOCKS * NESTED_BLOCKS + y * NESTED_BLOCKS + x];
+                if (cur_material != 0) {
+                    addSimpleCube<CELL_SIZE>(vbo, vbo_index, x * CELL_SIZE, y * CELL_SIZE, z * CELL_SIZE, cur_material);
+                }
+            }
+        }
+    }
+    return vbo_index;
+}
@@ -6,14 +6,19 @@
 #include <thread>
 #include "main.h"
 #include "fnv_hash.h"
+#include "profiler.h"
 #include "block.h"
 #include "world.h"
 #include "request_queue.h"
 #include "tessellation.h"
+#include "block_paging.h"
 #include "block_operation.h"
 
 static std::unique_ptr<std::thread> g_block_operation_thread = nullptr;
-static RequestQueue<BlockOperation> g_block_operation_queue;
+static RequestQueue<BlockOperation> g_block_operation_queue("block_operation");
+constexpr std::uint32_t BLOCK_OPERATION_BATCH_SIZE = 64;
+// Cache entries checked by every level of the block cache between batches of operations.
+constexpr std::uint32_t CACHE_CLEANING_STEPS = 64;
 
 template <std::uint8_t Level>
 using BlockCache = std::unordered_map<FnvHash::Hash, typename Block<Level>::WeakPtr>;
@@ -26,7 +31,7 @@ BlockCache<Level>& getCache() {
 
 template <std::uint8_t Level>
 typename BlockCache<Level>::iterator& getCacheCleaningIterator() {
-    static BlockCache<Level>::iterator cache_cleaning_iterator;
+    static typename BlockCache<Level>::iterator cache_cleaning_iterator;
     return cache_cleaning_iterator;
 }
 
@@ -46,6 +51,7 @@ void cleanUpCache() {
     if (getCacheCleaningIterator<Level>() != getCache<Level>().end()) {
         if (!getCacheCleaningIterator<Level>()->second.lock()) {
             getCache<Level>().erase(getCacheCleaningIterator<Level>());
+            --g_memory_statistics.levels[Level].cache_entries;
             getCacheCleaningIterator<Level>() = getCache<Level>().begin();
         } else {
             ++getCacheCleaningIterator<Level>();
@@ -68,22 +74,42 @@ static void cleanUpCaches() {
 
 template <std::uint8_t Level>
 static inline typename Block<Level>::Ptr getCached(const typename Block<Level>::Ptr& block) {
+    GKM_PROFILE_ZONE("getCached");
+    LevelMemoryStatistics& memory_statistics = g_memory_statistics.levels[Level];
+    ++memory_statistics.cache_lookups;
     auto& cache = getCache<Level>();
     FnvHash::Hash hash = block->calculateHash();
     auto fit = cache.find(hash);
     if (fit != cache.end()) {
         auto existing = fit->second.lock();
-        if (existing) {
+        // Saves set ids of children after the block is cached, so the cached hash could have pointers of children
+        // which were paged out since then and whose pointers were reused. Such a block is moved to its current hash.
+        const FnvHash::Hash existing_hash = existing && Level != 0 ? existing->calculateHash() : hash;
+        if (existing && existing_hash == hash) {
+            ++memory_statistics.cache_hits;
             return existing;
         } else {
+            block->updateLod();
+            block->onPublished();
             fit->second = block;
+            if (existing) {
+                auto [moved, inserted] = cache.emplace(existing_hash, existing);
+                if (inserted) {
+                    ++memory_statistics.cache_entries;
+                } else if (moved->second.expired()) {
+                    moved->second = existing;
+                }
+            }
             TessellationRequest<Level> request;
             request.block = block;
             postBlockTessellationRequest(request);
             return block;
         }
     } else {
+        block->updateLod();
+        block->onPublished();
         cache.emplace(hash, block);
+        ++memory_statistics.cache_entries;
         TessellationRequest<Level> request;
         request.block = block;
         postBlockTessellationRequest(request);
@@ -108,7 +134,7 @@ struct BlockOperationProcessor<0> {
             copy_block = std::make_shared<Block<0>>(*block);
             if (copy_block->entire) {
                 copy_block->entire = false;
-                BlockMaterial overall_material = copy_block->material.load();
+                BlockMaterial overall_material = copy_block->material;
                 for (BlockIndex i = 0; i < Block<0>::MATERIAL_COUNT; ++i) {
                     copy_block->materials[i] = overall_material;
                 }
@@ -137,7 +163,7 @@ struct BlockOperationProcessor {
     static typename Block<Level>::Ptr process(
         const typename Block<Level>::Ptr& block,
         const BlockOperation& operation) {
-        Block<Level>::Ptr copy_block = nullptr;
+        typename Block<Level>::Ptr copy_block = nullptr;
         if (operation.use_level && operation.level == Level) {
             copy_block = std::make_shared<Block<Level>>();
             copy_block->entire = true;
@@ -149,7 +175,7 @@ struct BlockOperationProcessor {
                 auto sub_level_block = std::make_shared<Block<Level - 1>>(copy_block->material);
                 auto cached_sub_level_block = getCached<Level - 1>(sub_level_block);
                 for (BlockIndex i = 0; i < Block<Level>::CHILDREN_COUNT; ++i) {
-                    copy_block->children[i].write(cached_sub_level_block);
+                    copy_block->children[i].set(cached_sub_level_block);
                 }
             }
             BlockOperation sub_operation;
@@ -163,22 +189,29 @@ struct BlockOperationProcessor {
             BlockIndex sub_block_y = operation.y / Block<Level - 1>::SIZE;
             BlockIndex sub_block_z = operation.z / Block<Level - 1>::SIZE;
             auto child_index = sub_block_z * NESTED_BLOCKS * NESTED_BLOCKS + sub_block_y * NESTED_BLOCKS + sub_block_x;
-            auto child = copy_block->children[child_index].read();
-            copy_block->children[child_index].write(BlockOperationProcessor<Level - 1>::process(child, sub_operation));
+            // The copy is not published yet, so its children are changed in place.
+            // Operations should not be lost, so a paged out child is loaded synchronously.
+            auto& child = copy_block->children[child_index];
+            auto sub_block = loadBlockChild(child);
+            if (!sub_block) {
+                return block;
+            }
+            child.set(BlockOperationProcessor<Level - 1>::process(sub_block, sub_operation));
+            // Paged out children are never entire, so a block with them could not become entire.
             bool all_sub_blocks_same = true;
-            auto first_sub_block = copy_block->children[0].read();
-            if (first_sub_block->entire) {
+            const Block<Level - 1>* first_sub_block = copy_block->children[0].get();
+            if (first_sub_block && first_sub_block->entire) {
                 for (BlockIndex i = 1; i < Block<Level>::CHILDREN_COUNT; ++i) {
-                    if (copy_block->children[i].read().get() != first_sub_block.get()) {
+                    if (copy_block->children[i].get() != first_sub_block) {
                         all_sub_blocks_same = false;
                         break;
                     }
                 }
                 if (all_sub_blocks_same) {
                     copy_block->entire = true;
-                    copy_block->material = first_sub_block->material.load();
+                    copy_block->material = first_sub_block->material;
                     for (BlockIndex i = 0; i < Block<Level>::CHILDREN_COUNT; ++i) {
-                        copy_block->children[i].write(nullptr);
+                        copy_block->children[i].set(nullptr);
                     }
                 }
             }
@@ -187,7 +220,27 @@ struct BlockOperationProcessor {
     }
 };
 
-static inline void processBlockOperation(const BlockOperation& operation) {
+// Operations should see the exact material, so paged out children are loaded synchronously instead of being requested.
+template <std::uint8_t Level>
+static BlockMaterial getExactMaterial(const Block<Level>& block, BlockIndex x, BlockIndex y, BlockIndex z) {
+    if constexpr (Level == 0) {
+        return block.getMaterial(x, y, z);
+    } else {
+        if (block.entire) {
+            return block.material;
+        }
+        constexpr BlockIndex SUB_BLOCK_SIZE = Block<Level - 1>::SIZE;
+        const BlockIndex child_index = (z / SUB_BLOCK_SIZE) * NESTED_BLOCKS * NESTED_BLOCKS + (y / SUB_BLOCK_SIZE) * NESTED_BLOCKS + x / SUB_BLOCK_SIZE;
+        auto child = loadBlockChild(block.children[child_index]);
+        if (!child) {
+            return block.lod_materials[child_index];
+        }
+        return getExactMaterial<Level - 1>(*child, x % SUB_BLOCK_SIZE, y % SUB_BLOCK_SIZE, z % SUB_BLOCK_SIZE);
+    }
+}
+
+static inline void processBlockOperation(WorldWriter& world_writer, const BlockOperation& operation) {
+    GKM_PROFILE_ZONE("processBlockOperation");
     BlockOperation sub_operation;
     sub_operation.use_level = operation.use_level;
     sub_operation.level = operation.level;
@@ -196,41 +249,45 @@ static inline void processBlockOperation(const BlockOperation& operation) {
     BlockIndex block_y_index = coordToBlockIndex<TOP_LEVEL>(operation.y, sub_operation.y);
     BlockIndex block_z_index = coordToBlockIndex<TOP_LEVEL>(operation.z, sub_operation.z);
 
-    auto line = g_world->getLineByAbsoluteIndex(block_x_index);
-    if (line) {
-        auto column = line->getColumnByAbsoluteIndex(block_y_index);
-        if (column) {
-            auto top_block = column->getBlock(block_z_index);
-            BlockMaterial existing_material = top_block->getMaterial(sub_operation.x, sub_operation.y, sub_operation.z);
-            if (existing_material == operation.material) {
-                // Do nothing.
-                return;
-            }
-            if ((existing_material != 0) && (operation.material != 0)) {
-                // Do nothing
-                return;
-            }
-            auto result_top_block = BlockOperationProcessor<TOP_LEVEL>::process(top_block, sub_operation);
-            column->setBlock(block_z_index, result_top_block);
+    const TopLevelBlock::Ptr& top_block = world_writer.getBlock(block_x_index, block_y_index, block_z_index);
+    if (top_block) {
+        BlockMaterial existing_material = getExactMaterial<TOP_LEVEL>(*top_block, sub_operation.x, sub_operation.y, sub_operation.z);
+        if (existing_material == operation.material) {
+            // Do nothing.
+            return;
+        }
+        if ((existing_material != 0) && (operation.material != 0)) {
+            // Do nothing
+            return;
         }
+        auto result_top_block = BlockOperationProcessor<TOP_LEVEL>::process(top_block, sub_operation);
+        world_writer.setBlock(block_x_index, block_y_index, block_z_index, result_top_block);
     }
 }
 
 static void blockOperationThread() {
-    SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN);
+    beginBackgroundThread();
+    GKM_PROFILE_THREAD("Block operation");
 
+    BlockOperation block_operations[BLOCK_OPERATION_BATCH_SIZE];
     while (g_is_running) {
-        BlockOperation block_operation;
-        g_block_operation_queue.waitForNewRequests(block_operation);
-        do {
-            if (!g_is_running || block_operation.finish) {
-                return;
+        std::uint32_t count = g_block_operation_queue.waitForNewRequests(block_operations, BLOCK_OPERATION_BATCH_SIZE);
+        while (count > 0) {
+            // Readers see all operations of the batch at once.
+            WorldWriter world_writer;
+            for (std::uint32_t i = 0; i < count; ++i) {
+                if (!g_is_running || block_operations[i].finish) {
+                    return;
+                }
+                processBlockOperation(world_writer, block_operations[i]);
             }
-            processBlockOperation(block_operation);
-        } while (g_block_operation_queue.pop(block_operation));
+            world_writer.publish();
+            count = g_block_operation_queue.popBatch(block_operations, BLOCK_OPERATION_BATCH_SIZE);
+        }
 
+        GKM_PROFILE_ZONE("cleanUpCaches");
         initializeCacheCleaningIterators();
-        for (BlockIndex i = 0; i < WORLD_BLOCK_SIZE_X; ++i) {
+        for (std::uint32_t i = 0; i < CACHE_CLEANING_STEPS; ++i) {
             if (!g_is_running) {
                 return;
             }
@@ -238,7 +295,7 @@ static void blockOperationThread() {
         }
     }
 
-    SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_END);
+    endBackgroundThread();
 }
 
 void startBlockOperationThread() {
@@ -248,13 +305,15 @@ void startBlockOperationThread() {
 void finishBlockOperationThread() {
     BlockOperation wakeup_and_finish_operation;
     wakeup_and_finish_operation.finish = true;
-    postBlockOperation(wakeup_and_finish_operation);
+    // Full queue means that the thread is busy, it checks g_is_running after every operation.
+    g_block_operation_queue.push(wakeup_and_finish_operation, EPushPolicy::Drop);
     g_block_operation_thread->join();
     g_block_operation_thread.reset();
 }
 
 void postBlockOperation(const BlockOperation& block_operation) {
-    g_block_operation_queue.push(block_operation);
+    // Edits should not be lost, so the caller waits while the queue is full.
+    g_block_operation_queue.push(block_operation, EPushPolicy::Block);
 }
 
 template <std::uint8_t Level>
@@ -262,22 +321,17 @@ typename Block<Level>::Ptr getBlockCached(const typename Block<Level>::Ptr& bloc
     return getCached<Level>(block);
 }
 
-template <std::uint8_t Level>
-struct GetBlockCachedInstantiation;
-
-template <>
-struct GetBlockCachedInstantiation<0> {
-    static void instantiate() {
-        getBlockCached<0>(nullptr);
-    }
-};
+template Block<0>::Ptr getBlockCached<0>(const Block<0>::Ptr& block);
+template Block<1>::Ptr getBlockCached<1>(const Block<1>::Ptr& block);
+template Block<2>::Ptr getBlockCached<2>(const Block<2>::Ptr& block);
+template Block<3>::Ptr getBlockCached<3>(const Block<3>::Ptr& block);
 
 template <std::uint8_t Level>
-struct GetBlockCachedInstantiation {
-    static void instantiate() {
-        getBlockCached<Level>(nullptr);
-        GetBlockCachedInstantiation<Level - 1>::instantiate();
-    }
-};
+typename Block<Level>::Ptr applyBlockOperation(const typename Block<Level>::Ptr& block, const BlockOperation& operation) {
+    return BlockOperationProcessor<Level>::process(block, operation);
+}
 
-template struct GetBlockCachedInstantiation<TOP_LEVEL>;
+template Block<0>::Ptr applyBlockOperation<0>(const Block<0>::Ptr& block, const BlockOperation& operation);
+template Block<1>::Ptr applyBlockOperation<1>(const Block<1>::Ptr& block, const BlockOperation& operation);
+template Block<2>::Ptr applyBlockOperation<2>(const Block<2>::Ptr& block, const BlockOperation& operation);
+template Block<3>::Ptr applyBlockOperation<3>(const Block<3>::Ptr& block, const BlockOperation& operation);
@@ -20,3 +20,9 @@ void postBlockOperation(const BlockOperation& block_operation);
 
 template <std::uint8_t Level>
 typename Block<Level>::Ptr getBlockCached(const typename Block<Level>::Ptr& block); // TODO: Not thread safe right now
+
+// Applies the operation to the block, coordinates of the operation are relative to the block.
+// Returns the cached result block, the source block is not changed.
+// The block cache is not synchronized, so only the block operation thread or a single-threaded benchmark may call it.
+template <std::uint8_t Level>
+typename Block<Level>::Ptr applyBlockOperation(const typename Block<Level>::Ptr& block, const BlockOperation& operation);
@@ -0,0 +1,328 @@
+// Copyright 2023 Petr Petrov. All rights reserved.
+// License: https://github.com/PetrPPetrov/gkm-local/blob/main/LICENSE
+
+#include <cstdint>
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+#include "main.h"
+#include "profiler.h"
+#include "request_queue.h"
+#include "tessellation.h"
+#include "world.h"
+#include "world_store.h"
+#include "block_paging.h"
+
+BlockPagingSettings g_block_paging_settings;
+BlockPagingStatistics g_block_paging_statistics;
+std::atomic<std::uint64_t> g_block_eviction_generation = 0;
+std::atomic<std::uint32_t> g_block_access_clock = 1;
+
+constexpr std::chrono::milliseconds PAGING_PERIOD(250);
+// Blocks used during this count of paging periods are not paged out.
+constexpr std::uint32_t RECENT_ACCESS_PERIODS = 4;
+constexpr std::uint32_t PAGE_IN_BATCH_SIZE = 16;
+
+struct BlockPageInRequest {
+    bool finish = false;
+    std::uint8_t level = 0;
+    std::weak_ptr<const BlockBase> block;
+};
+
+// Resident children of one parent which are the same block, they are paged out together.
+struct PagingCandidate {
+    BlockBase* parent = nullptr;
+    std::uint8_t level = 0;
+    BlockIndex first_child = 0;
+    BlockIndex child_count = 0;
+    std::uint32_t last_access = 0;
+    // Resident blocks of the child, children shared with other parents are counted for every parent.
+    std::int64_t memory_size = 0;
+};
+
+static std::unique_ptr<std::thread> g_paging_thread = nullptr;
+static std::unique_ptr<std::thread> g_page_in_thread = nullptr;
+static RequestQueue<BlockPageInRequest> g_block_page_in_queue("block_page_in");
+// Owners of children are changed by the page in worker and by the paging thread.
+static std::mutex g_paging_mutex;
+
+void postBlockPageIn(std::uint8_t level, const BlockBase* block) {
+    if (block->page_in_request.exchange(true)) {
+        return;
+    }
+    ++g_block_paging_statistics.page_in_requests;
+    BlockPageInRequest request;
+    request.level = level;
+    request.block = block->weak_from_this();
+    // Full queue means that the worker is busy, the block is requested again by the next reader.
+    if (!g_block_page_in_queue.push(request, EPushPolicy::Drop)) {
+        block->page_in_request = false;
+    }
+}
+
+template <std::uint8_t Level>
+typename Block<Level>::Ptr loadBlockChild(const BlockChild<Level>& child) {
+    // The id is read first, the child could be paged in meanwhile.
+    const StoredBlockId id = child.getStoredId();
+    auto block = child.lock();
+    if (!block && id != NULL_STORED_BLOCK) {
+        WorldStore::Ptr store = getWorldStore();
+        if (store) {
+            block = store->loadBlock<Level>(id);
+            ++g_block_paging_statistics.loaded_children;
+        }
+    }
+    return block;
+}
+
+template Block<0>::Ptr loadBlockChild<0>(const BlockChild<0>& child);
+template Block<1>::Ptr loadBlockChild<1>(const BlockChild<1>& child);
+template Block<2>::Ptr loadBlockChild<2>(const BlockChild<2>& child);
+
+// Children are decoded without the paging lock, neighbour children with the same record are decoded once.
+template <std::uint8_t Level>
+static void pageInChildren(Block<Level>& block, WorldStore& store) {
+    GKM_PROFILE_ZONE("pageInChildren");
+    typename Block<Level - 1>::Ptr children[Block<Level>::CHILDREN_COUNT];
+    StoredBlockId last_id = NULL_STORED_BLOCK;
+    typename Block<Level - 1>::Ptr last_child = nullptr;
+    for (BlockIndex i = 0; i < Block<Level>::CHILDREN_COUNT; ++i) {
+        if (block.children[i].isPagedOut()) {
+            const StoredBlockId id = block.children[i].getStoredId();
+            if (id != last_id) {
+                last_id = id;
+                last_child = store.loadBlock<Level - 1>(id);
+            }
+            children[i] = last_child;
+        }
+    }
+    std::uint32_t paged_in_children = 0;
+    {
+        std::lock_guard lock(g_paging_mutex);
+        for (BlockIndex i = 0; i < Block<Level>::CHILDREN_COUNT; ++i) {
+            if (children[i] && block.children[i].isPagedOut()) {
+                block.children[i].pageIn(children[i]);
+                ++paged_in_children;
+            }
+        }
+    }
+    g_block_paging_statistics.paged_in_children += paged_in_children;
+}
+
+static void pageInThread() {
+    beginBackgroundThread();
+    GKM_PROFILE_THREAD("Block page in");
+
+    BlockPageInRequest requests[PAGE_IN_BATCH_SIZE];
+    while (g_is_running) {
+        std::uint32_t count = g_block_page_in_queue.waitForNewRequests(requests, PAGE_IN_BATCH_SIZE);
+        while (count > 0) {
+            WorldStore::Ptr store = getWorldStore();
+            for (std::uint32_t i = 0; i < count; ++i) {
+                if (!g_is_running || requests[i].finish) {
+                    return;
+                }
+                // The block is changed only by paging, so it is requested as a const block.
+                auto block = std::const_pointer_cast<BlockBase>(requests[i].block.lock());
+                requests[i].block.reset();
+                if (!block) {
+                    continue;
+                }
+                if (store) {
+                    if (requests[i].level == TOP_LEVEL) {
+                        pageInChildren(static_cast<Block<TOP_LEVEL>&>(*block), *store);
+                    } else if (requests[i].level == TOP_LEVEL - 1) {
+                        pageInChildren(static_cast<Block<TOP_LEVEL - 1>&>(*block), *store);
+                    }
+                }
+                block->page_in_request = false;
+            }
+            // Blocks which were drawn by level of detail are collected again.
+            ++g_draw_info_generation;
+            count = g_block_page_in_queue.popBatch(requests, PAGE_IN_BATCH_SIZE);
+        }
+    }
+
+    endBackgroundThread();
+}
+
+// Collects resident children which could be paged out, returns the size of resident children of the block.
+// Level 1 blocks are counted without their level 0 children, which are small and shared by many blocks.
+template <std::uint8_t Level>
+static std::int64_t collectPagingCandidates(Block<Level>& block, std::uint32_t last_access, std::vector<PagingCandidate>& candidates, std::uint32_t& pageable_children) {
+    std::int64_t memory_size = 0;
+    if (block.entire) {
+        return memory_size;
+    }
+    for (BlockIndex i = 0; i < Block<Level>::CHILDREN_COUNT;) {
+        Block<Level - 1>* child = block.children[i].get();
+        const StoredBlockId id = block.children[i].getStoredId();
+        BlockIndex next = i + 1;
+        while (next < Block<Level>::CHILDREN_COUNT && block.children[next].get() == child && block.children[next].getStoredId() == id) {
+            ++next;
+        }
+        if (child && !child->entire) {
+            const std::uint32_t child_access = std::max(last_access, child->last_access.load(std::memory_order_relaxed));
+            std::int64_t child_size = sizeof(Block<Level - 1>);
+            if constexpr (Level - 1 > STANDARD_LEVEL) {
+                child_size += collectPagingCandidates<Level - 1>(*child, child_access, candidates, pageable_children);
+            }
+            if (id != NULL_STORED_BLOCK) {
+                PagingCandidate candidate;
+                candidate.parent = &block;
+                candidate.level = Level;
+                candidate.first_child = i;
+                candidate.child_count = next - i;
+                candidate.last_access = child_access;
+                candidate.memory_size = child_size;
+                candidates.push_back(candidate);
+                pageable_children += next - i;
+            }
+            memory_size += child_size;
+        }
+        i = next;
+    }
+    return memory_size;
+}
+
+// Readers could still see the children, so their owners are released after readers by the caller.
+template <std::uint8_t Level>
+static void pageOutChildren(Block<Level>& block, const PagingCandidate& candidate, std::unordered_set<const BlockBase*>& paged_out_blocks, std::vector<std::shared_ptr<const void>>& owners) {
+    for (BlockIndex i = candidate.first_child; i < candidate.first_child + candidate.child_count; ++i) {
+        auto owner = block.children[i].pageOut();
+        paged_out_blocks.insert(owner.get());
+        owners.push_back(std::move(owner));
+    }
+}
+
+class BlockPager {
+    std::vector<PagingCandidate> candidates;
+    std::unordered_set<const BlockBase*> paged_out_blocks;
+    std::vector<std::shared_ptr<const void>> owners;
+
+public:
+    void update() {
+        GKM_PROFILE_ZONE("updateBlockPaging");
+        const std::uint32_t clock = ++g_block_access_clock;
+        std::int64_t resident_bytes = 0;
+        for (const auto& level : g_memory_statistics.levels) {
+            resident_bytes += level.block_bytes;
+        }
+        g_block_paging_statistics.resident_bytes = resident_bytes;
+        const std::int64_t memory_budget = g_block_paging_settings.memory_budget;
+        if (g_block_paging_settings.page_out && resident_bytes > memory_budget) {
+            evictChildren(clock, resident_bytes - memory_budget);
+        }
+        // Released children could wait for readers which left already.
+        reclaimRetired();
+    }
+
+private:
+    // Pages out the least recently used children until the estimated size of paged out blocks exceeds the excess.
+    // The size is measured again by the next update, after paged out blocks are released.
+    void evictChildren(std::uint32_t clock, std::int64_t excess) {
+        GKM_PROFILE_ZONE("evictBlockChildren");
+        const auto start = std::chrono::steady_clock::now();
+        candidates.clear();
+        paged_out_blocks.clear();
+        owners.clear();
+        WorldReader world_reader;
+        const World* world = world_reader.get();
+        if (!world) {
+            return;
+        }
+        std::uint32_t pageable_children = 0;
+        world->forEachTile([&](const WorldTile::Ptr& tile) {
+            for (BlockIndex x = 0; x < WORLD_TILE_SIZE; ++x) {
+                for (BlockIndex y = 0; y < WORLD_TILE_SIZE; ++y) {
+                    const WorldColumn* column = tile->getColumn(x, y);
+                    if (!column) {
+                        continue;
+                    }
+                    for (BlockIndex z = 0; z < WORLD_BLOCK_HEIGHT; ++z) {
+                        TopLevelBlock* block = column->getBlock(z).get();
+                        if (block) {
+                            collectPagingCandidates<TOP_LEVEL>(*block, block->last_access.load(std::memory_order_relaxed), candidates, pageable_children);
+                        }
+                    }
+                }
+            }
+        });
+        g_block_paging_statistics.pageable_children = pageable_children;
+
+        // Children of the same age are paged out from upper levels first, they release whole subtrees.
+        std::sort(candidates.begin(), candidates.end(), [](const PagingCandidate& left, const PagingCandidate& right) {
+            return left.last_access < right.last_access || (left.last_access == right.last_access && left.level > right.level);
+        });
+        std::int64_t paged_out_bytes = 0;
+        std::uint32_t paged_out_children = 0;
+        {
+            std::lock_guard lock(g_paging_mutex);
+            for (const auto& candidate : candidates) {
+                if (paged_out_bytes >= excess || candidate.last_access + RECENT_ACCESS_PERIODS > clock) {
+                    break;
+                }
+                // The parent itself could be paged out already.
+                if (paged_out_blocks.count(candidate.parent) != 0) {
+                    continue;
+                }
+                if (candidate.level == TOP_LEVEL) {
+                    pageOutChildren(static_cast<Block<TOP_LEVEL>&>(*candidate.parent), candidate, paged_out_blocks, owners);
+                } else {
+                    pageOutChildren(static_cast<Block<TOP_LEVEL - 1>&>(*candidate.parent), candidate, paged_out_blocks, owners);
+                }
+                paged_out_bytes += candidate.memory_size;
+                paged_out_children += candidate.child_count;
+            }
+        }
+        if (owners.empty()) {
+            return;
+        }
+        // The renderer collects instances again before it could draw released children, see Renderer::render.
+        ++g_block_eviction_generation;
+        for (auto& owner : owners) {
+            retireAfterReaders(std::move(owner));
+        }
+        owners.clear();
+        g_block_paging_statistics.paged_out_children += paged_out_children;
+        ++g_block_paging_statistics.evictions;
+        g_block_paging_statistics.last_eviction_us = static_cast<std::uint64_t>(
+            std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+    }
+};
+
+static void pagingThread() {
+    beginBackgroundThread();
+    GKM_PROFILE_THREAD("Block paging");
+
+    BlockPager pager;
+    while (g_is_running) {
+        pager.update();
+        std::this_thread::sleep_for(PAGING_PERIOD);
+    }
+
+    endBackgroundThread();
+}
+
+void startBlockPagingThreads() {
+    g_page_in_thread = std::make_unique<std::thread>(&pageInThread);
+    g_paging_thread = std::make_unique<std::thread>(&pagingThread);
+}
+
+void finishBlockPagingThreads() {
+    if (!g_paging_thread) {
+        return;
+    }
+    g_paging_thread->join();
+    g_paging_thread.reset();
+    BlockPageInRequest wakeup_and_finish_request;
+    wakeup_and_finish_request.finish = true;
+    // Full queue means that the worker is busy, it checks g_is_running after every request.
+    g_block_page_in_queue.push(wakeup_and_finish_request, EPushPolicy::Drop);
+    g_page_in_thread->join();
+    g_page_in_thread.reset();
+}
@@ -0,0 +1,55 @@
+// Copyright 2023 Petr Petrov. All rights reserved.
+// License: https://github.com/PetrPPetrov/gkm-local/blob/main/LICENSE
+
+#pragma once
+
+#include <cstdint>
+#include <atomic>
+#include "block.h"
+
+// Block paging keeps interior blocks which have records in the world store resident only while they are used.
+// Blocks of levels 1 and 2 are loaded lazily: a loaded parent keeps only record ids of its children which are not entire.
+// Readers do not wait for paged out children, they request them from the page in worker and use level of detail meanwhile.
+// The paging thread measures resident blocks, and above the memory budget it pages out children of resident tiles,
+// least recently used first. Children are as recently used as their top-level block, which the renderer marks every frame.
+
+struct BlockPagingSettings {
+    std::atomic<bool> page_out = true;
+    // Resident blocks above this size are paged out, recently used blocks are kept even above the budget.
+    std::atomic<std::int64_t> memory_budget = 512 * 1024 * 1024;
+};
+
+struct BlockPagingStatistics {
+    std::atomic<std::int64_t> resident_bytes = 0;
+    // Resident children which could be paged out, counted by the last eviction.
+    std::atomic<std::uint32_t> pageable_children = 0;
+    std::atomic<std::uint64_t> page_in_requests = 0;
+    std::atomic<std::uint64_t> paged_in_children = 0;
+    std::atomic<std::uint64_t> paged_out_children = 0;
+    // Children loaded synchronously by block operations.
+    std::atomic<std::uint64_t> loaded_children = 0;
+    std::atomic<std::uint64_t> evictions = 0;
+    std::atomic<std::uint64_t> last_eviction_us = 0;
+};
+
+extern BlockPagingSettings g_block_paging_settings;
+extern BlockPagingStatistics g_block_paging_statistics;
+// Incremented when children are paged out, instances collected before could refer to draw info of released blocks.
+extern std::atomic<std::uint64_t> g_block_eviction_generation;
+// Advanced by the paging thread, used blocks are marked by its current value.
+extern std::atomic<std::uint32_t> g_block_access_clock;
+
+inline void touchBlock(const BlockBase& block) {
+    const std::uint32_t clock = g_block_access_clock.load(std::memory_order_relaxed);
+    if (block.last_access.load(std::memory_order_relaxed) != clock) {
+        block.last_access.store(clock, std::memory_order_relaxed);
+    }
+}
+
+// Returns the child, a paged out child is loaded synchronously, its parent is not changed.
+// Returns nullptr if there is no child or it could not be loaded.
+template <std::uint8_t Level>
+typename Block<Level>::Ptr loadBlockChild(const BlockChild<Level>& child);
+
+void startBlockPagingThreads();
+void finishBlockPagingThreads();
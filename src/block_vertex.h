@@ -0,0 +1,18 @@
+// Copyright 2023 Petr Petrov. All rights reserved.
+// License: https://github.com/PetrPPetrov/gkm-local/blob/main/LICENSE
+
+#pragma once
+
+#include <cstdint>
+
+#pragma pack(push, 1)
+
+// Vertex of block meshes, BgfxVertex adds its bgfx layout.
+struct BlockVertex {
+    float x, y, z;
+    std::int16_t u, v;
+    std::int16_t offset_u_mode, offset_v_mode;
+    std::int16_t material, reserved;
+};
+
+#pragma pack(pop)
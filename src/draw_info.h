@@ -6,18 +6,21 @@
 #include <cstdint>
 #include <memory>
 #include <limits>
-#include <list>
 #include "bgfx_api.h"
+#include "mesh_heap.h"
+#include "memory_statistics.h"
 #include "game_logic.h"
 
-constexpr unsigned MATERIAL_MAX = std::numeric_limits<BlockMaterial>::max() + 1;
-
 struct DrawRefInfo {
     typedef std::shared_ptr<DrawRefInfo> Ptr;
 
     BgfxProgramPtr program;
     BgfxUniformPtr texture;
-    BgfxTexturePtr material_textures[MATERIAL_MAX];
+    BgfxUniformPtr material_layers;
+    // Textures of all materials, one layer per material which has a texture
+    BgfxTexturePtr material_texture_array;
+    // MATERIAL_MAX x 1 table which maps material to texture array layer
+    BgfxTexturePtr material_layer_table;
 };
 
 struct DrawInfo {
@@ -29,13 +32,12 @@ struct DrawInstanceInfo {
     BlockIndex x, y, z;
 };
 
-struct MaterialDrawInfo {
-    BlockMaterial material;
-    BgfxVertexBufferPtr vertex_buffer;
-};
-
 struct BlockDrawInfo {
     typedef std::shared_ptr<BlockDrawInfo> Ptr;
 
-    std::list<MaterialDrawInfo> commands;
+    // All materials of the block are in one mesh heap range, material is stored in every vertex.
+    // Empty tessellation has no mesh.
+    MeshRange mesh;
+    // Accounts the mesh bytes in memory statistics of the block level.
+    MemoryRecord mesh_memory;
 };
@@ -0,0 +1,124 @@
+// Copyright 2023 Petr Petrov. All rights reserved.
+// License: https://github.com/PetrPPetrov/gkm-local/blob/main/LICENSE
+
+#include <cstdint>
+#include <atomic>
+#include <limits>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "epoch.h"
+
+constexpr std::uint32_t MAX_READER_THREADS = 64;
+constexpr std::size_t CACHE_LINE_SIZE = 64;
+// Epochs start from 1, so 0 marks a slot of a thread which is not reading now.
+constexpr std::uint64_t INACTIVE_EPOCH = 0;
+
+// Every reader thread owns a slot, so readers do not share cache lines.
+struct alignas(CACHE_LINE_SIZE) ReaderSlot {
+    std::atomic<std::uint64_t> epoch = INACTIVE_EPOCH;
+    std::atomic<bool> used = false;
+};
+
+static ReaderSlot g_reader_slots[MAX_READER_THREADS];
+static std::atomic<std::uint64_t> g_global_epoch = 1;
+
+struct RetiredObject {
+    std::shared_ptr<const void> object;
+    // Readers which entered at this epoch or before could still see the object.
+    std::uint64_t epoch = 0;
+};
+
+static std::mutex g_retired_mutex;
+static std::vector<RetiredObject> g_retired_objects;
+
+// Slot of the current thread, it is returned when the thread finishes.
+struct ThreadReader {
+    ReaderSlot* slot = nullptr;
+    std::uint32_t depth = 0;
+
+    ~ThreadReader() {
+        if (slot) {
+            slot->used.store(false, std::memory_order_release);
+        }
+    }
+};
+
+static thread_local ThreadReader g_thread_reader;
+
+static ReaderSlot* acquireReaderSlot() noexcept {
+    for (;;) {
+        for (ReaderSlot& slot : g_reader_slots) {
+            bool expected = false;
+            if (!slot.used.load(std::memory_order_relaxed) && slot.used.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+                return &slot;
+            }
+        }
+        // More reader threads than slots, wait until some reader thread finishes.
+        std::this_thread::yield();
+    }
+}
+
+EpochGuard::EpochGuard() noexcept {
+    ThreadReader& reader = g_thread_reader;
+    if (reader.depth++ == 0) {
+        if (!reader.slot) {
+            reader.slot = acquireReaderSlot();
+        }
+        // Sequentially consistent store orders the slot before the following loads of published pointers,
+        // so a writer which retires an object either sees this reader or the reader sees the new version.
+        reader.slot->epoch.store(g_global_epoch.load(std::memory_order_seq_cst), std::memory_order_seq_cst);
+    }
+}
+
+EpochGuard::~EpochGuard() noexcept {
+    ThreadReader& reader = g_thread_reader;
+    if (--reader.depth == 0) {
+        reader.slot->epoch.store(INACTIVE_EPOCH, std::memory_order_release);
+    }
+}
+
+void retireAfterReaders(std::shared_ptr<const void> object) {
+    if (object) {
+        const std::uint64_t epoch = g_global_epoch.fetch_add(1, std::memory_order_seq_cst);
+        std::lock_guard lock(g_retired_mutex);
+        g_retired_objects.push_back({ std::move(object), epoch });
+    }
+    reclaimRetired();
+}
+
+std::size_t reclaimRetired() {
+    std::uint64_t min_reader_epoch = std::numeric_limits<std::uint64_t>::max();
+    for (const ReaderSlot& slot : g_reader_slots) {
+        const std::uint64_t epoch = slot.epoch.load(std::memory_order_seq_cst);
+        if (epoch != INACTIVE_EPOCH && epoch < min_reader_epoch) {
+            min_reader_epoch = epoch;
+        }
+    }
+    // Objects are released outside of the lock, releasing of a version could release many nested objects.
+    std::vector<RetiredObject> released;
+    std::size_t waiting_count = 0;
+    {
+        std::lock_guard lock(g_retired_mutex);
+        auto waiting_end = g_retired_objects.begin();
+        for (auto it = g_retired_objects.begin(); it != g_retired_objects.end(); ++it) {
+            if (it->epoch < min_reader_epoch) {
+                released.push_back(std::move(*it));
+            } else {
+                if (waiting_end != it) {
+                    *waiting_end = std::move(*it);
+                }
+                ++waiting_end;
+            }
+        }
+        g_retired_objects.erase(waiting_end, g_retired_objects.end());
+        waiting_count = g_retired_objects.size();
+    }
+    return waiting_count;
+}
+
+void releaseAllRetired() {
+    std::vector<RetiredObject> released;
+    std::lock_guard lock(g_retired_mutex);
+    released.swap(g_retired_objects);
+}
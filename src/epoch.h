@@ -0,0 +1,28 @@
+// Copyright 2023 Petr Petrov. All rights reserved.
+// License: https://github.com/PetrPPetrov/gkm-local/blob/main/LICENSE
+
+#pragma once
+
+#include <cstddef>
+#include <memory>
+
+// Epoch-based reclamation of shared read-mostly data.
+// Readers enter an epoch by EpochGuard and access the published data by raw pointers without locks and reference counting.
+// Writers publish a new version, then retire the old one, it is released when all readers which could see it have left.
+
+// Marks the thread as a reader while the guard exists, guards could be nested.
+class EpochGuard {
+public:
+    EpochGuard() noexcept;
+    ~EpochGuard() noexcept;
+    EpochGuard(const EpochGuard&) = delete;
+    EpochGuard& operator=(const EpochGuard&) = delete;
+};
+
+// The object should be already replaced by the new version, so new readers can not find it.
+// Also releases previously retired objects which have no readers anymore.
+void retireAfterReaders(std::shared_ptr<const void> object);
+// Returns count of retired objects which are still waiting for readers.
+std::size_t reclaimRetired();
+// Releases all retired objects, it should be called when there are no readers anymore.
+void releaseAllRetired();
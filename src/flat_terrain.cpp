@@ -5,7 +5,9 @@
 #include "constants.sh"
 #include "flat_terrain.h"
 
-FlatTerrain::FlatTerrain(const BgfxTexturePtr& texture) {
+constexpr static BlockMaterial TERRAIN_MATERIAL = 1;
+
+FlatTerrain::FlatTerrain() {
     //const bgfx::Memory* vertex_buffer_data = bgfx::alloc(static_cast<std::uint32_t>(sizeof(BgfxVertex) * 3));
     //auto vbo = reinterpret_cast<BgfxVertex*>(vertex_buffer_data->data);
     //vbo[0].x = 0.0f;
@@ -129,11 +131,14 @@ FlatTerrain::FlatTerrain(const BgfxTexturePtr& texture) {
             cell_data[3].v = TEXTURE_SIZE;
             cell_data[4].v = 0;
             cell_data[5].v = TEXTURE_SIZE;
+            for (unsigned i = 0; i < 6; ++i) {
+                cell_data[i].material = TERRAIN_MATERIAL;
+                cell_data[i].reserved = 0;
+            }
         }
     }
 
     vertex_buffer = makeBgfxSharedPtr(bgfx::createVertexBuffer(vertex_buffer_data, BgfxVertex::ms_layout));
-    terrain_texture = texture;
 }
 
 void FlatTerrain::draw(DrawInfo draw_info) {
@@ -144,7 +149,8 @@ void FlatTerrain::draw(DrawInfo draw_info) {
     float_matrix[3][3] = 1.0f;
     bgfx::setTransform(float_matrix);
 
-    bgfx::setTexture(0, *draw_info.ref_info->texture, *terrain_texture);
+    bgfx::setTexture(0, *draw_info.ref_info->texture, *draw_info.ref_info->material_texture_array);
+    bgfx::setTexture(1, *draw_info.ref_info->material_layers, *draw_info.ref_info->material_layer_table);
     bgfx::setVertexBuffer(0, *vertex_buffer);
     bgfx::setState(draw_info.state);
     bgfx::submit(0, *draw_info.ref_info->program);
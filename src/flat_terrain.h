@@ -14,10 +14,9 @@ class FlatTerrain {
 public:
     typedef std::unique_ptr<FlatTerrain> Ptr;
 
-    FlatTerrain(const BgfxTexturePtr& texture);
+    FlatTerrain();
     void draw(DrawInfo draw_info);
 
 private:
     BgfxVertexBufferPtr vertex_buffer;
-    BgfxTexturePtr terrain_texture;
 };
@@ -0,0 +1,148 @@
+// Copyright 2023 Petr Petrov. All rights reserved.
+// License: https://github.com/PetrPPetrov/gkm-local/blob/main/LICENSE
+
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <vector>
+#include <type_traits>
+
+// Linear allocator for data which lives exactly one frame.
+// All allocations are taken from one contiguous storage buffer and released together by reset().
+// If a frame needs more memory than the storage has, the rest is taken from extra heap chunks,
+// and the next reset() grows the storage to the peak usage. So steady-state frames do not touch the heap.
+class FrameArena {
+    std::unique_ptr<std::uint8_t[]> storage;
+    std::size_t storage_size = 0;
+    std::size_t used = 0;
+    std::size_t requested = 0; // Total bytes requested during the current frame, including overflow chunks
+    std::vector<std::unique_ptr<std::uint8_t[]>> overflow_chunks;
+    std::uint32_t frame_allocations = 0;
+
+    static std::size_t alignUp(std::size_t value, std::size_t alignment) {
+        return (value + alignment - 1) & ~(alignment - 1);
+    }
+
+public:
+    constexpr static std::size_t MAX_ALIGNMENT = alignof(std::max_align_t);
+
+    FrameArena(std::size_t initial_size) : storage(std::make_unique<std::uint8_t[]>(initial_size)), storage_size(initial_size) {
+    }
+
+    // Starts a new frame. All pointers returned before become invalid.
+    void reset() {
+        frame_allocations = 0;
+        if (!overflow_chunks.empty()) {
+            overflow_chunks.clear();
+            storage_size = alignUp(requested + requested / 2, MAX_ALIGNMENT);
+            storage = std::make_unique<std::uint8_t[]>(storage_size);
+            ++frame_allocations;
+        }
+        used = 0;
+        requested = 0;
+    }
+
+    void* allocate(std::size_t size, std::size_t alignment) {
+        assert(alignment <= MAX_ALIGNMENT);
+        requested += size + alignment;
+        const std::size_t offset = alignUp(used, alignment);
+        if (offset + size <= storage_size) {
+            used = offset + size;
+            return storage.get() + offset;
+        }
+        overflow_chunks.push_back(std::make_unique<std::uint8_t[]>(size));
+        ++frame_allocations;
+        return overflow_chunks.back().get();
+    }
+
+    // Grows the most recent allocation in place if it is possible.
+    bool tryExtend(void* data, std::size_t old_size, std::size_t new_size) {
+        std::uint8_t* bytes = static_cast<std::uint8_t*>(data);
+        if (bytes + old_size != storage.get() + used) {
+            return false;
+        }
+        if (used - old_size + new_size > storage_size) {
+            return false;
+        }
+        used = used - old_size + new_size;
+        requested += new_size - old_size;
+        return true;
+    }
+
+    // Returns how many times the current frame had to use the heap.
+    std::uint32_t getFrameAllocations() const {
+        return frame_allocations;
+    }
+    std::size_t getCapacity() const {
+        return storage_size;
+    }
+    std::size_t getUsed() const {
+        return used;
+    }
+};
+
+// Growable array of trivially copyable items, allocated from FrameArena.
+template <class ItemType>
+class FrameArray {
+    static_assert(std::is_trivially_copyable_v<ItemType>);
+
+    FrameArena& arena;
+    ItemType* items = nullptr;
+    std::size_t count = 0;
+    std::size_t capacity = 0;
+
+    void grow() {
+        const std::size_t new_capacity = capacity ? capacity * 2 : 256;
+        if (items && arena.tryExtend(items, capacity * sizeof(ItemType), new_capacity * sizeof(ItemType))) {
+            capacity = new_capacity;
+            return;
+        }
+        auto new_items = static_cast<ItemType*>(arena.allocate(new_capacity * sizeof(ItemType), alignof(ItemType)));
+        if (count > 0) {
+            std::memcpy(new_items, items, count * sizeof(ItemType));
+        }
+        items = new_items;
+        capacity = new_capacity;
+    }
+
+public:
+    FrameArray(FrameArena& arena_) : arena(arena_) {
+    }
+    FrameArray(const FrameArray&) = delete;
+    FrameArray& operator=(const FrameArray&) = delete;
+
+    void push_back(const ItemType& item) {
+        if (count == capacity) {
+            grow();
+        }
+        items[count++] = item;
+    }
+    std::size_t size() const {
+        return count;
+    }
+    bool empty() const {
+        return count == 0;
+    }
+    ItemType* begin() {
+        return items;
+    }
+    ItemType* end() {
+        return items + count;
+    }
+    const ItemType* begin() const {
+        return items;
+    }
+    const ItemType* end() const {
+        return items + count;
+    }
+    ItemType& operator[](std::size_t index) {
+        return items[index];
+    }
+    const ItemType& operator[](std::size_t index) const {
+        return items[index];
+    }
+};
@@ -0,0 +1,92 @@
+// Copyright 2023 Petr Petrov. All rights reserved.
+// License: https://github.com/PetrPPetrov/gkm-local/blob/main/LICENSE
+
+#include <algorithm>
+#include <fstream>
+#include <thread>
+#include "frame_pacer.h"
+
+constexpr static std::chrono::milliseconds SPIN_MARGIN(2);
+
+FramePacer::FramePacer(std::uint32_t target_fps) :
+    period(std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / target_fps))) {
+}
+
+FramePacer::Clock::duration FramePacer::waitForNextFrame() {
+    Clock::time_point now = Clock::now();
+    if (!started) {
+        started = true;
+        last_frame_start = now;
+        next_deadline = now + period;
+        return Clock::duration::zero();
+    }
+    if (now < next_deadline) {
+        if (next_deadline - now > SPIN_MARGIN) {
+            std::this_thread::sleep_until(next_deadline - SPIN_MARGIN);
+        }
+        while (Clock::now() < next_deadline) {
+            std::this_thread::yield();
+        }
+        now = Clock::now();
+        next_deadline += period;
+    } else if (now - next_deadline > period) {
+        next_deadline = now + period;
+    } else {
+        next_deadline += period;
+    }
+    const Clock::duration frame_time = now - last_frame_start;
+    last_frame_start = now;
+    return frame_time;
+}
+
+void FrameTimeHistogram::add(float frame_ms) {
+    const float bin = std::max(frame_ms, 0.0f) * BINS_PER_MS;
+    const unsigned bin_index = bin >= BIN_COUNT - 1 ? BIN_COUNT - 1 : static_cast<unsigned>(bin);
+    ++bins[bin_index];
+    ++frame_count;
+    worst_ms = std::max(worst_ms, frame_ms);
+}
+
+void FrameTimeHistogram::reset() {
+    bins.fill(0);
+    frame_count = 0;
+    worst_ms = 0.0f;
+}
+
+float FrameTimeHistogram::getPercentile(float ratio) const {
+    if (frame_count == 0) {
+        return 0.0f;
+    }
+    const std::uint64_t required_count = std::max<std::uint64_t>(1, static_cast<std::uint64_t>(ratio * frame_count + 0.5f));
+    std::uint64_t count = 0;
+    for (unsigned i = 0; i < BIN_COUNT; ++i) {
+        count += bins[i];
+        if (count >= required_count) {
+            // Upper bound of the bin, the last bin is open so the worst frame is used
+            if (i == BIN_COUNT - 1) {
+                return worst_ms;
+            }
+            return std::min(static_cast<float>(i + 1) / BINS_PER_MS, worst_ms);
+        }
+    }
+    return worst_ms;
+}
+
+bool FrameTimeHistogram::dump(const std::string& file_name) const {
+    std::ofstream output_file(file_name);
+    if (!output_file) {
+        return false;
+    }
+    output_file << "frames " << frame_count << "\n";
+    output_file << "p50_ms " << getPercentile(0.5f) << "\n";
+    output_file << "p95_ms " << getPercentile(0.95f) << "\n";
+    output_file << "p99_ms " << getPercentile(0.99f) << "\n";
+    output_file << "worst_ms " << worst_ms << "\n";
+    output_file << "# bin_start_ms count\n";
+    for (unsigned i = 0; i < BIN_COUNT; ++i) {
+        if (bins[i] != 0) {
+            output_file << static_cast<float>(i) / BINS_PER_MS << " " << bins[i] << "\n";
+        }
+    }
+    return static_cast<bool>(output_file);
+}
@@ -0,0 +1,57 @@
+// Copyright 2023 Petr Petrov. All rights reserved.
+// License: https://github.com/PetrPPetrov/gkm-local/blob/main/LICENSE
+
+#pragma once
+
+#include <cstdint>
+#include <chrono>
+#include <string>
+#include <array>
+
+// Limits the frame rate by deadlines. Every frame has its own deadline one period after the previous one,
+// so sleep inaccuracy of one frame is compensated by the next frame. Most of the wait is done by sleeping,
+// the last SPIN_MARGIN is done by yielding to hit the deadline precisely.
+// If a frame misses its deadline by more than one period the schedule starts again from now,
+// so slow frames are not followed by a burst of fast frames.
+class FramePacer {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    FramePacer(std::uint32_t target_fps);
+
+    // Waits for the deadline of the next frame, returns the time since the previous frame start.
+    Clock::duration waitForNextFrame();
+
+private:
+    Clock::duration period;
+    Clock::time_point next_deadline;
+    Clock::time_point last_frame_start;
+    bool started = false;
+};
+
+// Histogram of frame times with 0.1 ms resolution up to MAX_FRAME_MS, longer frames are put into the last bin.
+// The worst frame is tracked exactly.
+class FrameTimeHistogram {
+public:
+    constexpr static unsigned BINS_PER_MS = 10;
+    constexpr static unsigned MAX_FRAME_MS = 200;
+    constexpr static unsigned BIN_COUNT = MAX_FRAME_MS * BINS_PER_MS + 1;
+
+    void add(float frame_ms);
+    void reset();
+    // Returns frame time in milliseconds which is not exceeded by the specified ratio of frames, ratio is in [0, 1].
+    float getPercentile(float ratio) const;
+    float getWorstMs() const {
+        return worst_ms;
+    }
+    std::uint64_t getFrameCount() const {
+        return frame_count;
+    }
+    // Writes the summary and all non-empty bins into the text file, returns false on failure.
+    bool dump(const std::string& file_name) const;
+
+private:
+    std::array<std::uint32_t, BIN_COUNT> bins = {};
+    std::uint64_t frame_count = 0;
+    float worst_ms = 0.0f;
+};
@@ -0,0 +1,41 @@
+// Copyright 2023 Petr Petrov. All rights reserved.
+// License: https://github.com/PetrPPetrov/gkm-local/blob/main/LICENSE
+
+#pragma once
+
+// View frustum for culling of axis aligned boxes.
+class Frustum {
+    float planes[6][4] = { 0 };
+
+public:
+    // Extracts frustum planes from view projection matrix, bx matrix convention is used (row vector multiplied by matrix).
+    void update(const float* view_projection, bool homogeneous_depth) {
+        float columns[4][4];
+        for (unsigned j = 0; j < 4; ++j) {
+            for (unsigned i = 0; i < 4; ++i) {
+                columns[j][i] = view_projection[i * 4 + j];
+            }
+        }
+        for (unsigned i = 0; i < 4; ++i) {
+            planes[0][i] = columns[3][i] + columns[0][i]; // Left
+            planes[1][i] = columns[3][i] - columns[0][i]; // Right
+            planes[2][i] = columns[3][i] + columns[1][i]; // Bottom
+            planes[3][i] = columns[3][i] - columns[1][i]; // Top
+            planes[4][i] = homogeneous_depth ? columns[3][i] + columns[2][i] : columns[2][i]; // Near
+            planes[5][i] = columns[3][i] - columns[2][i]; // Far
+        }
+    }
+
+    bool isBoxVisible(float min_x, float min_y, float min_z, float max_x, float max_y, float max_z) const {
+        for (const auto& plane : planes) {
+            // Check the box corner which is the farthest along the plane normal.
+            const float x = plane[0] >= 0.0f ? max_x : min_x;
+            const float y = plane[1] >= 0.0f ? max_y : min_y;
+            const float z = plane[2] >= 0.0f ? max_z : min_z;
+            if (plane[0] * x + plane[1] * y + plane[2] * z + plane[3] < 0.0f) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
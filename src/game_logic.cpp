@@ -5,20 +5,23 @@
 #include <memory>
 #include "main.h"
 #include "request_queue.h"
+#include "profiler.h"
 #include "block_operation.h"
 #include "game_logic.h"
 
 PlayerCoordinates::Atomic g_player_coordinates;
 
-static RequestQueue<DirectionPitchDelta> g_direction_pitch_delta_queue;
+static RequestQueue<DirectionPitchDelta> g_direction_pitch_delta_queue("direction_pitch_delta");
 
 static std::unique_ptr<std::thread> g_game_logic_thread = nullptr;
 
 static std::uint32_t g_tick = 0;
 
 static void gameLogicThread() {
+    GKM_PROFILE_THREAD("Game logic");
     while (g_is_running) {
         std::this_thread::sleep_for(std::chrono::milliseconds(25));
+        GKM_PROFILE_ZONE("gameLogicTick");
         auto player_coordinates = g_player_coordinates.read();
         DirectionPitchDelta delta;
         while (g_direction_pitch_delta_queue.pop(delta)) {
@@ -99,5 +102,5 @@ void finishGameLogicThread() {
 }
 
 void postDirectionPitchDelta(const DirectionPitchDelta& delta) {
-    g_direction_pitch_delta_queue.push(delta);
+    g_direction_pitch_delta_queue.push(delta, EPushPolicy::Drop);
 }
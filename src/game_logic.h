@@ -4,7 +4,7 @@
 #pragma once
 
 #include "gkm_local.h"
-#include "spin_lock.h"
+#include "seq_lock.h"
 
 constexpr double GKM_PI = 3.14159265358979323846264338327950288;
 constexpr double GKM_2PI = 2 * GKM_PI;
@@ -17,7 +17,8 @@ struct PlayerCoordinates {
     double direction = 0; // In degrees between 0 and 359
     double pitch = 0; // In degrees between -90 and 90
 
-    typedef SpinLocked<PlayerCoordinates> Atomic;
+    // Game logic writes the coordinates every tick, the renderer reads them every frame.
+    typedef SeqLocked<PlayerCoordinates> Atomic;
 };
 
 extern PlayerCoordinates::Atomic g_player_coordinates;
@@ -0,0 +1,481 @@
+// Copyright 2023 Petr Petrov. All rights reserved.
+// License: https://github.com/PetrPPetrov/gkm-local/blob/main/LICENSE
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <string>
+#include <random>
+#include <algorithm>
+#include <functional>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include "main.h"
+#include "fnv_hash.h"
+#include "spin_lock.h"
+#include "seq_lock.h"
+#include "request_queue.h"
+#include "block.h"
+#include "block_mesh.h"
+#include "block_operation.h"
+#include "tessellation.h"
+#include "game_logic.h"
+
+// Micro benchmarks of the engine kernels, they do not need bgfx or a window.
+// Every benchmark body performs several operations and returns their count,
+// the body is repeated until the measured time is long enough.
+
+std::atomic<bool> g_is_running = true;
+
+static std::atomic<std::uint64_t> g_tessellation_requests = 0;
+std::atomic<std::uint64_t> g_draw_info_generation = 0;
+
+// Tessellation threads are not started, requests are only counted.
+template <std::uint8_t Level>
+void postBlockTessellationRequest(const TessellationRequest<Level>& request) {
+    if (request.block) {
+        g_tessellation_requests.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+template void postBlockTessellationRequest<0>(const TessellationRequest<0>& request);
+template void postBlockTessellationRequest<1>(const TessellationRequest<1>& request);
+template void postBlockTessellationRequest<2>(const TessellationRequest<2>& request);
+template void postBlockTessellationRequest<3>(const TessellationRequest<3>& request);
+
+// Results are accumulated here, so the compiler does not remove the measured code.
+static volatile std::uint64_t g_sink = 0;
+
+static void keep(std::uint64_t value) {
+    g_sink = g_sink + value;
+}
+
+struct BenchmarkOptions {
+    std::string filter;
+    std::string output_file_name;
+    std::uint32_t min_time_ms = 200;
+    std::uint32_t repetitions = 5;
+};
+
+struct BenchmarkResult {
+    std::string name;
+    std::uint64_t operations = 0;
+    // Median and the best of repetitions.
+    double ns_per_operation = 0.0;
+    double best_ns_per_operation = 0.0;
+};
+
+typedef std::chrono::steady_clock BenchmarkClock;
+
+class BenchmarkSuite {
+public:
+    BenchmarkSuite(const BenchmarkOptions& options_) : options(options_) {
+    }
+
+    // Body performs some operations and returns their count.
+    void run(const std::string& name, const std::function<std::uint64_t()>& body) {
+        if (!options.filter.empty() && name.find(options.filter) == std::string::npos) {
+            return;
+        }
+        std::cerr << name << std::endl;
+
+        // Warm up caches and find how many calls fit into one repetition.
+        const auto repetition_time = std::chrono::duration<double, std::milli>(static_cast<double>(options.min_time_ms) / options.repetitions);
+        std::uint64_t calls = 1;
+        while (true) {
+            const auto start = BenchmarkClock::now();
+            for (std::uint64_t i = 0; i < calls; ++i) {
+                keep(body());
+            }
+            if (BenchmarkClock::now() - start >= repetition_time || calls >= (1ull << 40)) {
+                break;
+            }
+            calls *= 2;
+        }
+
+        BenchmarkResult result;
+        result.name = name;
+        std::vector<double> ns_per_operation;
+        for (std::uint32_t repetition = 0; repetition < options.repetitions; ++repetition) {
+            std::uint64_t operations = 0;
+            const auto start = BenchmarkClock::now();
+            for (std::uint64_t i = 0; i < calls; ++i) {
+                operations += body();
+            }
+            const std::chrono::duration<double, std::nano> elapsed = BenchmarkClock::now() - start;
+            result.operations += operations;
+            ns_per_operation.push_back(elapsed.count() / static_cast<double>(std::max<std::uint64_t>(operations, 1)));
+        }
+        std::sort(ns_per_operation.begin(), ns_per_operation.end());
+        result.ns_per_operation = ns_per_operation[ns_per_operation.size() / 2];
+        result.best_ns_per_operation = ns_per_operation.front();
+        results.push_back(result);
+    }
+
+    void writeJson(std::ostream& output) const {
+        output << "{\n";
+        output << "  \"suite\": \"gkm_bench\",\n";
+        output << "  \"hardware_threads\": " << std::thread::hardware_concurrency() << ",\n";
+        output << "  \"min_time_ms\": " << options.min_time_ms << ",\n";
+        output << "  \"repetitions\": " << options.repetitions << ",\n";
+        output << "  \"benchmarks\": [";
+        for (std::size_t i = 0; i < results.size(); ++i) {
+            const BenchmarkResult& result = results[i];
+            output << (i == 0 ? "\n" : ",\n");
+            output << "    { \"name\": \"" << result.name << "\""
+                << ", \"operations\": " << result.operations
+                << ", \"ns_per_operation\": " << result.ns_per_operation
+                << ", \"best_ns_per_operation\": " << result.best_ns_per_operation
+                << ", \"operations_per_second\": " << (result.ns_per_operation > 0.0 ? 1.0e9 / result.ns_per_operation : 0.0)
+                << " }";
+        }
+        output << "\n  ]\n";
+        output << "}\n";
+    }
+
+private:
+    BenchmarkOptions options;
+    std::vector<BenchmarkResult> results;
+};
+
+// Blocks with details on every level, children with index 0 form the dense path from the top-level block down to level 0.
+struct BlockSamples {
+    TopLevelBlock::Ptr top;
+    Block<2>::Ptr level2;
+    Block<1>::Ptr level1;
+    Block<0>::Ptr level0;
+};
+
+static BlockOperation makeCellOperation(BlockIndex x, BlockIndex y, BlockIndex z, BlockMaterial material) {
+    BlockOperation operation;
+    operation.use_level = false;
+    operation.level = 0;
+    operation.material = material;
+    operation.x = x;
+    operation.y = y;
+    operation.z = z;
+    return operation;
+}
+
+static BlockSamples makeBlockSamples() {
+    std::mt19937 random(12345);
+    BlockSamples samples;
+    samples.top = getBlockCached<TOP_LEVEL>(std::make_shared<TopLevelBlock>(1));
+    // Holes and other materials in the first level 1 block, so levels 0 and 1 are dense.
+    std::uniform_int_distribution<BlockIndex> dense_coordinate(0, Block<1>::SIZE - 1);
+    std::uniform_int_distribution<unsigned> material(0, 3);
+    for (unsigned i = 0; i < 8192; ++i) {
+        const BlockMaterial cur_material = static_cast<BlockMaterial>(material(random));
+        samples.top = applyBlockOperation<TOP_LEVEL>(samples.top, makeCellOperation(dense_coordinate(random), dense_coordinate(random), dense_coordinate(random), cur_material));
+    }
+    // Sparse holes in the whole top-level block, so levels 2 and 3 have many different children.
+    std::uniform_int_distribution<BlockIndex> sparse_coordinate(0, TopLevelBlock::SIZE - 1);
+    for (unsigned i = 0; i < 4096; ++i) {
+        samples.top = applyBlockOperation<TOP_LEVEL>(samples.top, makeCellOperation(sparse_coordinate(random), sparse_coordinate(random), sparse_coordinate(random), 0));
+    }
+    samples.level2 = samples.top->children[0].lock();
+    samples.level1 = samples.level2->children[0].lock();
+    samples.level0 = samples.level1->children[0].lock();
+    return samples;
+}
+
+static void benchmarkFnvHash(BenchmarkSuite& suite) {
+    for (std::size_t size : { 8, 64, 512 }) {
+        std::vector<std::uint8_t> data(size);
+        for (std::size_t i = 0; i < size; ++i) {
+            data[i] = static_cast<std::uint8_t>(i * 31);
+        }
+        suite.run("fnv_hash/" + std::to_string(size) + "_bytes", [&]() {
+            FnvHash hash;
+            hash.update(data.data(), data.size());
+            keep(hash.getHash());
+            return std::uint64_t(1);
+        });
+    }
+}
+
+template <std::uint8_t Level>
+static void benchmarkBlockKernels(BenchmarkSuite& suite, const typename Block<Level>::Ptr& block) {
+    const std::string level = "/level" + std::to_string(Level);
+
+    suite.run("block_hash" + level, [&]() {
+        keep(block->calculateHash());
+        return std::uint64_t(1);
+    });
+
+    constexpr unsigned LOOKUP_COUNT = 1024;
+    std::mt19937 random(Level);
+    std::uniform_int_distribution<BlockIndex> coordinate(0, Block<Level>::SIZE - 1);
+    std::vector<BlockIndex> coordinates(LOOKUP_COUNT * 3);
+    for (auto& value : coordinates) {
+        value = coordinate(random);
+    }
+    suite.run("get_material" + level, [&]() {
+        std::uint64_t sum = 0;
+        for (unsigned i = 0; i < LOOKUP_COUNT; ++i) {
+            sum += block->getMaterial(coordinates[i * 3], coordinates[i * 3 + 1], coordinates[i * 3 + 2]);
+        }
+        keep(sum);
+        return std::uint64_t(LOOKUP_COUNT);
+    });
+
+    // Every edit is reverted by the next one, so the block cache does not grow.
+    constexpr unsigned EDIT_POSITION_COUNT = 64;
+    std::vector<BlockOperation> put_operations;
+    std::vector<BlockOperation> revert_operations;
+    for (unsigned i = 0; i < EDIT_POSITION_COUNT; ++i) {
+        const BlockIndex x = coordinate(random);
+        const BlockIndex y = coordinate(random);
+        const BlockIndex z = coordinate(random);
+        const BlockMaterial existing_material = block->getMaterial(x, y, z);
+        put_operations.push_back(makeCellOperation(x, y, z, existing_material == 2 ? 3 : 2));
+        revert_operations.push_back(makeCellOperation(x, y, z, existing_material));
+    }
+    suite.run("block_operation" + level, [&]() {
+        for (unsigned i = 0; i < EDIT_POSITION_COUNT; ++i) {
+            auto changed = applyBlockOperation<Level>(block, put_operations[i]);
+            auto reverted = applyBlockOperation<Level>(changed, revert_operations[i]);
+            keep(reverted == block);
+        }
+        return std::uint64_t(EDIT_POSITION_COUNT * 2);
+    });
+}
+
+static void benchmarkBlockCache(BenchmarkSuite& suite, const BlockSamples& samples) {
+    // Distinct level 0 blocks which differ by one cell.
+    constexpr unsigned BLOCK_COUNT = 1024;
+    std::vector<Block<0>::Ptr> cached_blocks;
+    std::vector<Block<0>::Ptr> equal_blocks;
+    for (unsigned i = 0; i < BLOCK_COUNT; ++i) {
+        auto block = std::make_shared<Block<0>>(*samples.level0);
+        block->materials[i % Block<0>::MATERIAL_COUNT] = static_cast<BlockMaterial>(4 + i / Block<0>::MATERIAL_COUNT);
+        cached_blocks.push_back(getBlockCached<0>(block));
+        equal_blocks.push_back(std::make_shared<Block<0>>(*block));
+    }
+    suite.run("get_cached_hit/level0", [&]() {
+        for (const auto& block : equal_blocks) {
+            keep(getBlockCached<0>(block).get() != block.get());
+        }
+        return std::uint64_t(BLOCK_COUNT);
+    });
+
+    // Blocks are released before the next call, so the cache entry is found expired and replaced by the new block.
+    // It includes the copy of the block, as block operations always copy the block before the lookup.
+    std::size_t next_block = 0;
+    cached_blocks.clear();
+    suite.run("get_cached_miss/level0", [&]() {
+        auto block = std::make_shared<Block<0>>(*equal_blocks[next_block]);
+        next_block = (next_block + 1) % BLOCK_COUNT;
+        keep(getBlockCached<0>(block).get() == block.get());
+        return std::uint64_t(1);
+    });
+
+    const auto level1_copy = std::make_shared<Block<1>>(*samples.level1);
+    suite.run("get_cached_hit/level1", [&]() {
+        keep(getBlockCached<1>(level1_copy).get() != level1_copy.get());
+        return std::uint64_t(1);
+    });
+}
+
+static void benchmarkRequestQueue(BenchmarkSuite& suite) {
+    constexpr std::uint32_t QUEUE_SIZE = 4096;
+    constexpr std::uint32_t BATCH_SIZE = 64;
+    constexpr std::uint64_t REQUESTS_PER_PRODUCER = 16 * 1024;
+    typedef RequestQueue<std::uint64_t, QUEUE_SIZE> Queue;
+    for (std::uint32_t batch_size : { std::uint32_t(1), BATCH_SIZE }) {
+        for (unsigned producer_count : { 1, 2, 4 }) {
+            const std::string name = batch_size == 1 ? "request_queue_push_pop/" : "request_queue_pop_batch/";
+            suite.run(name + std::to_string(producer_count) + "_producers", [&]() {
+                auto queue = std::make_unique<Queue>("bench");
+                // Producers wait while the queue is full.
+                std::vector<std::thread> producers;
+                for (unsigned producer = 0; producer < producer_count; ++producer) {
+                    producers.emplace_back([&]() {
+                        for (std::uint64_t i = 0; i < REQUESTS_PER_PRODUCER; ++i) {
+                            queue->push(i, EPushPolicy::Block);
+                        }
+                    });
+                }
+                const std::uint64_t total_requests = REQUESTS_PER_PRODUCER * producer_count;
+                std::uint64_t requests[BATCH_SIZE];
+                std::uint64_t sum = 0;
+                for (std::uint64_t popped = 0; popped < total_requests;) {
+                    const std::uint32_t count = queue->waitForNewRequests(requests, batch_size);
+                    for (std::uint32_t i = 0; i < count; ++i) {
+                        sum += requests[i];
+                    }
+                    popped += count;
+                }
+                for (auto& producer : producers) {
+                    producer.join();
+                }
+                keep(sum);
+                return total_requests;
+            });
+        }
+    }
+}
+
+static void benchmarkSpinLocked(BenchmarkSuite& suite, const BlockSamples& samples) {
+    SpinLocked<Block<1>::Ptr> locked_block(samples.level1);
+    constexpr unsigned READ_COUNT = 1024;
+    suite.run("spin_locked_read/1_thread", [&]() {
+        std::uint64_t sum = 0;
+        for (unsigned i = 0; i < READ_COUNT; ++i) {
+            sum += locked_block.read() != nullptr;
+        }
+        keep(sum);
+        return std::uint64_t(READ_COUNT);
+    });
+    for (unsigned reader_count : { 2, 4 }) {
+        suite.run("spin_locked_read/" + std::to_string(reader_count) + "_threads", [&]() {
+            std::vector<std::thread> readers;
+            std::atomic<std::uint64_t> sum = 0;
+            for (unsigned reader = 0; reader < reader_count; ++reader) {
+                readers.emplace_back([&]() {
+                    std::uint64_t reader_sum = 0;
+                    for (unsigned i = 0; i < READ_COUNT * 16; ++i) {
+                        reader_sum += locked_block.read() != nullptr;
+                    }
+                    sum += reader_sum;
+                });
+            }
+            for (auto& reader : readers) {
+                reader.join();
+            }
+            keep(sum);
+            return std::uint64_t(READ_COUNT * 16 * reader_count);
+        });
+    }
+}
+
+// Readers of the player coordinates while one thread writes them, as the renderer and game logic do.
+template <template <class> class Locked>
+static void benchmarkLockedCoordinates(BenchmarkSuite& suite, const std::string& name) {
+    Locked<PlayerCoordinates> locked_coordinates;
+    constexpr unsigned READ_COUNT = 1024 * 16;
+    for (unsigned reader_count : { 1, 4 }) {
+        suite.run(name + "/" + std::to_string(reader_count) + "_readers_1_writer", [&]() {
+            std::atomic<bool> writing = true;
+            std::thread writer([&]() {
+                PlayerCoordinates coordinates;
+                while (writing.load(std::memory_order_relaxed)) {
+                    coordinates.x += 1.0;
+                    locked_coordinates.write(coordinates);
+                    // Game logic writes once per tick, so the writer does not occupy the value all the time.
+                    for (unsigned i = 0; i < 64; ++i) {
+                        cpuPause();
+                    }
+                }
+            });
+            std::vector<std::thread> readers;
+            std::atomic<std::uint64_t> sum = 0;
+            for (unsigned reader = 0; reader < reader_count; ++reader) {
+                readers.emplace_back([&]() {
+                    std::uint64_t reader_sum = 0;
+                    for (unsigned i = 0; i < READ_COUNT; ++i) {
+                        reader_sum += static_cast<std::uint64_t>(locked_coordinates.read().x);
+                    }
+                    sum += reader_sum;
+                });
+            }
+            for (auto& reader : readers) {
+                reader.join();
+            }
+            writing = false;
+            writer.join();
+            keep(sum);
+            return std::uint64_t(READ_COUNT * reader_count);
+        });
+    }
+}
+
+template <std::uint8_t Level>
+static void benchmarkBlockMesh(BenchmarkSuite& suite, const typename Block<Level>::Ptr& block) {
+    std::vector<BlockVertex> vertices;
+    suite.run("tessellate_block/level" + std::to_string(Level), [&]() {
+        const std::uint32_t cube_count = countBlockCubes<Level>(*block);
+        vertices.resize(std::max<std::size_t>(vertices.size(), cube_count * VERTICES_PER_CUBE));
+        keep(buildBlockMesh<Level>(*block, vertices.data()));
+        return std::uint64_t(1);
+    });
+}
+
+template <std::uint8_t Level>
+static void benchmarkLodMesh(BenchmarkSuite& suite, const typename Block<Level>::Ptr& block) {
+    std::vector<BlockVertex> vertices;
+    suite.run("tessellate_lod/level" + std::to_string(Level), [&]() {
+        const std::uint32_t cube_count = countLodCubes<Level>(*block);
+        vertices.resize(std::max<std::size_t>(vertices.size(), cube_count * VERTICES_PER_CUBE));
+        keep(buildLodMesh<Level>(*block, vertices.data()));
+        return std::uint64_t(1);
+    });
+}
+
+static bool parseOptions(int argc, char** argv, BenchmarkOptions& options) {
+    for (int i = 1; i < argc; ++i) {
+        const char* option = argv[i];
+        if (i + 1 >= argc) {
+            return false;
+        }
+        std::istringstream value(argv[++i]);
+        if (std::strcmp(option, "--filter") == 0) {
+            options.filter = value.str();
+        } else if (std::strcmp(option, "--output") == 0) {
+            options.output_file_name = value.str();
+        } else if (std::strcmp(option, "--min-time") == 0) {
+            value >> options.min_time_ms;
+        } else if (std::strcmp(option, "--repetitions") == 0) {
+            value >> options.repetitions;
+        } else {
+            return false;
+        }
+        if (!value) {
+            return false;
+        }
+    }
+    return options.repetitions > 0;
+}
+
+int main(int argc, char** argv) {
+    BenchmarkOptions options;
+    if (!parseOptions(argc, argv, options)) {
+        std::cerr << "Usage: " << argv[0] << " [--filter substring] [--output file] [--min-time ms] [--repetitions count]" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    const BlockSamples samples = makeBlockSamples();
+    BenchmarkSuite suite(options);
+    benchmarkFnvHash(suite);
+    benchmarkBlockKernels<0>(suite, samples.level0);
+    benchmarkBlockKernels<1>(suite, samples.level1);
+    benchmarkBlockKernels<2>(suite, samples.level2);
+    benchmarkBlockKernels<3>(suite, samples.top);
+    benchmarkBlockCache(suite, samples);
+    benchmarkRequestQueue(suite);
+    benchmarkSpinLocked(suite, samples);
+    benchmarkLockedCoordinates<SpinLocked>(suite, "spin_locked_coordinates");
+    benchmarkLockedCoordinates<SeqLocked>(suite, "seq_locked_coordinates");
+    benchmarkBlockMesh<0>(suite, samples.level0);
+    benchmarkBlockMesh<1>(suite, samples.level1);
+    benchmarkLodMesh<2>(suite, samples.level2);
+    benchmarkLodMesh<3>(suite, samples.top);
+
+    if (options.output_file_name.empty()) {
+        suite.writeJson(std::cout);
+        return EXIT_SUCCESS;
+    }
+    std::ofstream output_file(options.output_file_name);
+    suite.writeJson(output_file);
+    if (!output_file) {
+        std::cerr << "Couldn't write " << options.output_file_name << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
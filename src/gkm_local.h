@@ -5,6 +5,7 @@
 
 #include <cstdint>
 #include <atomic>
+#include <limits>
 
 // We use integer coordinates, 1 unit = 1 centimeter.
 typedef std::int32_t BlockIndex;
@@ -13,3 +14,5 @@ typedef std::int32_t BlockIndex;
 typedef std::uint8_t BlockMaterial;
 
 static_assert(std::atomic<BlockMaterial>::is_always_lock_free);
+
+constexpr unsigned MATERIAL_MAX = std::numeric_limits<BlockMaterial>::max() + 1;
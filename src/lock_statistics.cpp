@@ -0,0 +1,53 @@
+// Copyright 2023 Petr Petrov. All rights reserved.
+// License: https://github.com/PetrPPetrov/gkm-local/blob/main/LICENSE
+
+#include <cstdlib>
+#include <mutex>
+#ifdef __GNUG__
+#include <cxxabi.h>
+#endif
+#include "lock_statistics.h"
+
+// Function-local statics, because sites are function-local statics too and they could be created during static initialization.
+static std::mutex& getRegistryMutex() {
+    static std::mutex registry_mutex;
+    return registry_mutex;
+}
+
+static std::vector<SpinLockSite*>& getRegistry() {
+    static std::vector<SpinLockSite*> registry;
+    return registry;
+}
+
+SpinLockSite::SpinLockSite(const char* name_) : name(name_) {
+    std::lock_guard lock(getRegistryMutex());
+    getRegistry().push_back(this);
+}
+
+static std::string getReadableName(const char* name) {
+#ifdef __GNUG__
+    int status = 0;
+    char* demangled = abi::__cxa_demangle(name, nullptr, nullptr, &status);
+    if (status == 0 && demangled) {
+        std::string result(demangled);
+        std::free(demangled);
+        return result;
+    }
+#endif
+    return name;
+}
+
+void collectSpinLockStatistics(std::vector<SpinLockSiteSnapshot>& result) {
+    std::lock_guard lock(getRegistryMutex());
+    const auto& registry = getRegistry();
+    result.resize(registry.size());
+    for (std::size_t i = 0; i < registry.size(); ++i) {
+        const SpinLockSite& site = *registry[i];
+        SpinLockSiteSnapshot& snapshot = result[i];
+        snapshot.name = getReadableName(site.name);
+        snapshot.acquisitions = site.acquisitions.load(std::memory_order_relaxed);
+        snapshot.contended_acquisitions = site.contended_acquisitions.load(std::memory_order_relaxed);
+        snapshot.spins = site.spins.load(std::memory_order_relaxed);
+        snapshot.yields = site.yields.load(std::memory_order_relaxed);
+    }
+}
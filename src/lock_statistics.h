@@ -0,0 +1,60 @@
+// Copyright 2023 Petr Petrov. All rights reserved.
+// License: https://github.com/PetrPPetrov/gkm-local/blob/main/LICENSE
+
+#pragma once
+
+#include <cstdint>
+#include <atomic>
+#include <string>
+#include <vector>
+
+struct SpinLockSiteSnapshot;
+
+// Contention counters of one lock site, the site is a place in code or a kind of locked values, not a lock instance.
+// Spin locks update them only if GKM_SPIN_LOCK_STATISTICS is defined.
+class SpinLockSite {
+public:
+    explicit SpinLockSite(const char* name_);
+    SpinLockSite(const SpinLockSite&) = delete;
+    SpinLockSite& operator=(const SpinLockSite&) = delete;
+
+    void onAcquired() noexcept {
+        acquisitions.fetch_add(1, std::memory_order_relaxed);
+    }
+    // The first attempt failed, even if the lock was taken again without spins or yields.
+    void onContendedAcquired(std::uint32_t spins, std::uint32_t yields) noexcept {
+        acquisitions.fetch_add(1, std::memory_order_relaxed);
+        contended_acquisitions.fetch_add(1, std::memory_order_relaxed);
+        this->spins.fetch_add(spins, std::memory_order_relaxed);
+        this->yields.fetch_add(yields, std::memory_order_relaxed);
+    }
+
+private:
+    friend void collectSpinLockStatistics(std::vector<SpinLockSiteSnapshot>& result);
+
+    const char* name;
+    std::atomic<std::uint64_t> acquisitions = 0;
+    std::atomic<std::uint64_t> contended_acquisitions = 0;
+    std::atomic<std::uint64_t> spins = 0;
+    std::atomic<std::uint64_t> yields = 0;
+};
+
+struct SpinLockSiteSnapshot {
+    // Sites of SpinLocked values are named by the value type, the name is demangled if it is possible.
+    std::string name;
+    std::uint64_t acquisitions = 0;
+    std::uint64_t contended_acquisitions = 0;
+    // Backoff rounds with CPU pause before the lock was taken
+    std::uint64_t spins = 0;
+    // Time slices given up after the backoff reached its limit
+    std::uint64_t yields = 0;
+};
+
+// Copies counters of all sites which were used at least once, sites are never destroyed.
+void collectSpinLockStatistics(std::vector<SpinLockSiteSnapshot>& result);
+
+#ifdef GKM_SPIN_LOCK_STATISTICS
+#define GKM_SPIN_LOCK_SITE(name) ([]() -> SpinLockSite* { static SpinLockSite site(name); return &site; }())
+#else
+#define GKM_SPIN_LOCK_SITE(name) nullptr
+#endif
@@ -9,9 +9,13 @@
 #include "user_interface.h"
 #include "game_logic.h"
 #include "block_operation.h"
-#include "tessellation.h"
 #include "renderer.h"
 #include "world.h"
+#include "world_streaming.h"
+#include "world_store.h"
+#include "block_paging.h"
+#include "benchmark.h"
+#include "profiler.h"
 #include "main.h"
 
 std::atomic<bool> g_is_running = true;
@@ -30,9 +34,26 @@ std::atomic<bool> g_key_left_pressed = false;
 std::atomic<bool> g_key_right_pressed = false;
 
 std::atomic<bool> g_main_menu_open = false;
+std::atomic<bool> g_profiler_open = false;
 std::atomic<int> g_window_width = 800;
 std::atomic<int> g_window_height = 600;
 
+#ifdef GKM_HEADLESS
+
+int main(int argc, char** argv) {
+    try {
+        return runHeadlessBenchmark(argc, argv);
+    } catch (const std::exception& exception) {
+        std::cout << "std::exception was thrown: " << exception.what() << std::endl;
+        return EXIT_FAILURE;
+    } catch (...) {
+        std::cout << "unknown exception was thrown" << std::endl;
+        return EXIT_FAILURE;
+    }
+}
+
+#else
+
 static HINSTANCE g_hinstance = 0;
 static HWND g_hwnd = 0;
 
@@ -128,6 +149,12 @@ static LRESULT APIENTRY CALLBACK onWindowEvent(HWND window_handle, UINT window_m
         case VK_ESCAPE:
             g_main_menu_open = !g_main_menu_open;
             break;
+        case VK_F9:
+            g_profiler_dump_requested = true;
+            break;
+        case VK_F10:
+            g_profiler_open = !g_profiler_open;
+            break;
         case VK_UP:
         case 0x57:
             g_key_up_pressed = true;
@@ -222,10 +249,13 @@ static int winMainImpl(HINSTANCE h_instance, HINSTANCE h_prev_instance, LPSTR lp
     ShowWindow(g_hwnd, SW_SHOWDEFAULT);
     UpdateWindow(g_hwnd);
     SetFocus(g_hwnd);
+    openWorldStore(WORLD_STORE_DIRECTORY);
     initializeRenderer(g_hwnd);
     startGameLogicThread();
     startBlockOperationThread();
-    startTessellationThreads();
+    startWorldStreamingThreads();
+    startWorldSavingThread();
+    startBlockPagingThreads();
 
     MSG window_event;
     while (g_is_running && GetMessage(&window_event, g_hwnd, 0, 0) > 0) {
@@ -257,3 +287,5 @@ int WINAPI WinMain(HINSTANCE h_instance, HINSTANCE h_prev_instance, LPSTR lp_cmd
         return EXIT_FAILURE;
     }
 }
+
+#endif
@@ -5,7 +5,6 @@
 
 #include <atomic>
 #include "win_api.h"
-#include "texture_cache.h"
 
 static_assert(std::atomic<bool>::is_always_lock_free);
 static_assert(std::atomic<int>::is_always_lock_free);
@@ -26,5 +25,6 @@ extern std::atomic<bool> g_key_left_pressed;
 extern std::atomic<bool> g_key_right_pressed;
 
 extern std::atomic<bool> g_main_menu_open;
+extern std::atomic<bool> g_profiler_open;
 extern std::atomic<int> g_window_width;
 extern std::atomic<int> g_window_height;
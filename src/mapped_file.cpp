@@ -0,0 +1,117 @@
+// Copyright 2023 Petr Petrov. All rights reserved.
+// License: https://github.com/PetrPPetrov/gkm-local/blob/main/LICENSE
+
+#ifdef _WIN32
+#include "win_api.h"
+#else
+#include <cstdio>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include <filesystem>
+#include "mapped_file.h"
+
+MappedFile::~MappedFile() {
+#ifdef _WIN32
+    if (data) {
+        UnmapViewOfFile(data);
+    }
+    if (mapping_handle) {
+        CloseHandle(mapping_handle);
+    }
+    if (file_handle) {
+        CloseHandle(file_handle);
+    }
+#else
+    if (data) {
+        munmap(const_cast<std::uint8_t*>(data), size);
+    }
+#endif
+}
+
+bool MappedFile::open(const std::string& file_name, std::size_t size_) {
+    if (data || size_ == 0) {
+        return false;
+    }
+#ifdef _WIN32
+    // Writers append to the file while it is mapped.
+    HANDLE file = CreateFileA(file_name.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    file_handle = file;
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file, &file_size) || static_cast<std::uint64_t>(file_size.QuadPart) < size_) {
+        return false;
+    }
+    const std::uint64_t mapping_size = size_;
+    mapping_handle = CreateFileMappingA(file, NULL, PAGE_READONLY, static_cast<DWORD>(mapping_size >> 32), static_cast<DWORD>(mapping_size), NULL);
+    if (!mapping_handle) {
+        return false;
+    }
+    data = static_cast<const std::uint8_t*>(MapViewOfFile(mapping_handle, FILE_MAP_READ, 0, 0, size_));
+    if (!data) {
+        return false;
+    }
+#else
+    const int file = ::open(file_name.c_str(), O_RDONLY);
+    if (file < 0) {
+        return false;
+    }
+    struct stat file_stat;
+    if (fstat(file, &file_stat) != 0 || static_cast<std::uint64_t>(file_stat.st_size) < size_) {
+        close(file);
+        return false;
+    }
+    // The mapping keeps the file referenced after the descriptor is closed.
+    void* mapping = mmap(nullptr, size_, PROT_READ, MAP_SHARED, file, 0);
+    close(file);
+    if (mapping == MAP_FAILED) {
+        return false;
+    }
+    data = static_cast<const std::uint8_t*>(mapping);
+#endif
+    size = size_;
+    return true;
+}
+
+bool syncFile(const std::string& file_name) {
+#ifdef _WIN32
+    HANDLE file = CreateFileA(file_name.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    const bool result = FlushFileBuffers(file) != 0;
+    CloseHandle(file);
+    return result;
+#else
+    const int file = ::open(file_name.c_str(), O_RDONLY);
+    if (file < 0) {
+        return false;
+    }
+    const bool result = fsync(file) == 0;
+    close(file);
+    return result;
+#endif
+}
+
+bool replaceFile(const std::string& new_file_name, const std::string& file_name) {
+#ifdef _WIN32
+    return MoveFileExA(new_file_name.c_str(), file_name.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+    if (std::rename(new_file_name.c_str(), file_name.c_str()) != 0) {
+        return false;
+    }
+    // The renamed entry and files created in the directory before are on the disk after the directory is synced.
+    const std::string directory = std::filesystem::path(file_name).parent_path().string();
+    const int directory_file = ::open(directory.empty() ? "." : directory.c_str(), O_RDONLY);
+    if (directory_file < 0) {
+        return false;
+    }
+    const bool result = fsync(directory_file) == 0;
+    close(directory_file);
+    return result;
+#endif
+}
@@ -0,0 +1,40 @@
+// Copyright 2023 Petr Petrov. All rights reserved.
+// License: https://github.com/PetrPPetrov/gkm-local/blob/main/LICENSE
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Read-only memory mapping of the beginning of a file. The file could be appended while it is mapped,
+// the mapping keeps showing the first size bytes.
+class MappedFile {
+    const std::uint8_t* data = nullptr;
+    std::size_t size = 0;
+#ifdef _WIN32
+    void* file_handle = nullptr;
+    void* mapping_handle = nullptr;
+#endif
+
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile();
+
+    // Maps size bytes of the file, returns false if the file could not be opened or it is shorter.
+    bool open(const std::string& file_name, std::size_t size);
+
+    const std::uint8_t* getData() const {
+        return data;
+    }
+    std::size_t getSize() const {
+        return size;
+    }
+};
+
+// Writes data of the file which was written by streams to the disk, returns false if it could not be done.
+bool syncFile(const std::string& file_name);
+// Replaces the file by the new file, the replacement is on the disk when it returns true.
+bool replaceFile(const std::string& new_file_name, const std::string& file_name);
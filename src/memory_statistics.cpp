@@ -0,0 +1,43 @@
+// Copyright 2023 Petr Petrov. All rights reserved.
+// License: https://github.com/PetrPPetrov/gkm-local/blob/main/LICENSE
+
+#include <fstream>
+#include "memory_statistics.h"
+
+MemoryStatistics g_memory_statistics;
+
+void writeMemoryStatistics(std::ostream& output) {
+    std::int64_t total_bytes = g_memory_statistics.texture_bytes;
+    output << "{\n  \"levels\": [\n";
+    for (std::uint8_t level = 0; level < BLOCK_LEVEL_COUNT; ++level) {
+        const LevelMemoryStatistics& statistics = g_memory_statistics.levels[level];
+        total_bytes += statistics.block_bytes + statistics.vertex_bytes + statistics.lod_vertex_bytes;
+        output << "    { \"level\": " << static_cast<unsigned>(level)
+            << ", \"unique_blocks\": " << statistics.unique_blocks
+            << ", \"referenced_blocks\": " << statistics.referenced_blocks
+            << ", \"deduplication_ratio\": " << statistics.getDeduplicationRatio()
+            << ", \"block_bytes\": " << statistics.block_bytes
+            << ", \"cache_lookups\": " << statistics.cache_lookups
+            << ", \"cache_hits\": " << statistics.cache_hits
+            << ", \"cache_entries\": " << statistics.cache_entries
+            << ", \"cache_tombstones\": " << statistics.getCacheTombstones()
+            << ", \"vertex_bytes\": " << statistics.vertex_bytes
+            << ", \"lod_vertex_bytes\": " << statistics.lod_vertex_bytes
+            << ", \"pending_tessellations\": " << statistics.pending_tessellations
+            << " }" << (level + 1 < BLOCK_LEVEL_COUNT ? ",\n" : "\n");
+    }
+    output << "  ],\n";
+    output << "  \"texture_bytes\": " << g_memory_statistics.texture_bytes << ",\n";
+    output << "  \"world_tiles\": " << g_memory_statistics.world_tiles << ",\n";
+    output << "  \"world_columns\": " << g_memory_statistics.world_columns << ",\n";
+    output << "  \"total_bytes\": " << total_bytes << "\n}\n";
+}
+
+bool dumpMemoryStatistics(const std::string& file_name) {
+    std::ofstream output_file(file_name);
+    if (!output_file) {
+        return false;
+    }
+    writeMemoryStatistics(output_file);
+    return static_cast<bool>(output_file);
+}
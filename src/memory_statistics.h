@@ -0,0 +1,118 @@
+// Copyright 2023 Petr Petrov. All rights reserved.
+// License: https://github.com/PetrPPetrov/gkm-local/blob/main/LICENSE
+
+#pragma once
+
+#include <cstdint>
+#include <atomic>
+#include <ostream>
+#include <string>
+#include <utility>
+
+// Live memory counters, they are updated by relaxed atomic additions on allocation and release.
+// It does not depend on block.h, so blocks can update the counters in their destructors.
+
+constexpr std::uint8_t BLOCK_LEVEL_COUNT = 4;
+
+struct LevelMemoryStatistics {
+    // Blocks published in the block cache which are still alive.
+    std::atomic<std::int64_t> unique_blocks = 0;
+    // References to blocks of this level from alive published parents (from world columns for top-level blocks).
+    // Ratio of referenced to unique blocks is the deduplication ratio of the block cache.
+    std::atomic<std::int64_t> referenced_blocks = 0;
+    std::atomic<std::int64_t> block_bytes = 0;
+    std::atomic<std::uint64_t> cache_lookups = 0;
+    std::atomic<std::uint64_t> cache_hits = 0;
+    // Entries of the block cache, entries of released blocks (tombstones) are removed by the cache cleaning.
+    std::atomic<std::int64_t> cache_entries = 0;
+    std::atomic<std::int64_t> vertex_bytes = 0;
+    std::atomic<std::int64_t> lod_vertex_bytes = 0;
+    // Queued tessellation requests hold their blocks alive.
+    std::atomic<std::int64_t> pending_tessellations = 0;
+
+    std::int64_t getCacheTombstones() const {
+        return cache_entries - unique_blocks;
+    }
+    double getDeduplicationRatio() const {
+        const std::int64_t unique = unique_blocks;
+        return unique > 0 ? static_cast<double>(referenced_blocks) / unique : 0.0;
+    }
+    double getCacheHitRate() const {
+        const std::uint64_t lookups = cache_lookups;
+        return lookups > 0 ? static_cast<double>(cache_hits) / lookups : 0.0;
+    }
+};
+
+struct MemoryStatistics {
+    LevelMemoryStatistics levels[BLOCK_LEVEL_COUNT];
+    // Textures live as long as the renderer, so they are only added.
+    std::atomic<std::int64_t> texture_bytes = 0;
+    // World tiles and columns with own storage, including ones of versions waiting for reclamation.
+    std::atomic<std::int64_t> world_tiles = 0;
+    std::atomic<std::int64_t> world_columns = 0;
+};
+
+extern MemoryStatistics g_memory_statistics;
+
+inline void addMemory(std::atomic<std::int64_t>& counter, std::int64_t bytes) {
+    counter.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+inline void onBlockPublished(std::uint8_t level, std::int64_t bytes, std::int64_t child_references) {
+    LevelMemoryStatistics& statistics = g_memory_statistics.levels[level];
+    addMemory(statistics.unique_blocks, 1);
+    addMemory(statistics.block_bytes, bytes);
+    if (level > 0) {
+        addMemory(g_memory_statistics.levels[level - 1].referenced_blocks, child_references);
+    }
+}
+
+inline void onBlockReleased(std::uint8_t level, std::int64_t bytes, std::int64_t child_references) {
+    LevelMemoryStatistics& statistics = g_memory_statistics.levels[level];
+    addMemory(statistics.unique_blocks, -1);
+    addMemory(statistics.block_bytes, -bytes);
+    if (level > 0) {
+        addMemory(g_memory_statistics.levels[level - 1].referenced_blocks, -child_references);
+    }
+}
+
+// Adds bytes to the counter and subtracts them back on destruction.
+class MemoryRecord {
+    std::atomic<std::int64_t>* counter = nullptr;
+    std::int64_t bytes = 0;
+
+public:
+    MemoryRecord() = default;
+    MemoryRecord(std::atomic<std::int64_t>& counter_, std::int64_t bytes_) : counter(&counter_), bytes(bytes_) {
+        addMemory(*counter, bytes);
+    }
+    MemoryRecord(MemoryRecord&& other) noexcept {
+        *this = std::move(other);
+    }
+    MemoryRecord& operator=(MemoryRecord&& other) noexcept {
+        if (this != &other) {
+            release();
+            counter = other.counter;
+            bytes = other.bytes;
+            other.counter = nullptr;
+        }
+        return *this;
+    }
+    MemoryRecord(const MemoryRecord&) = delete;
+    MemoryRecord& operator=(const MemoryRecord&) = delete;
+    ~MemoryRecord() {
+        release();
+    }
+
+private:
+    void release() {
+        if (counter) {
+            addMemory(*counter, -bytes);
+            counter = nullptr;
+        }
+    }
+};
+
+void writeMemoryStatistics(std::ostream& output);
+// Writes the counters as JSON, returns false on failure.
+bool dumpMemoryStatistics(const std::string& file_name);
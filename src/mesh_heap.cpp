@@ -0,0 +1,112 @@
+// Copyright 2023 Petr Petrov. All rights reserved.
+// License: https://github.com/PetrPPetrov/gkm-local/blob/main/LICENSE
+
+#include <algorithm>
+#include <iterator>
+#include "spin_lock.h"
+#include "mesh_heap.h"
+
+MeshHeap::Ptr g_mesh_heap = nullptr;
+
+static void releaseMeshRange(const PendingRelease& pending_release) {
+    // Ranges which are released after the heap are owned by nobody
+    if (g_mesh_heap) {
+        g_mesh_heap->free(pending_release.page, pending_release.start, pending_release.count);
+    }
+}
+
+void MeshRange::release() {
+    // The range can be used by the frame which is being submitted, so it is returned to the heap by the render thread
+    if (count != 0) {
+        g_release_queue.push({ &releaseMeshRange, 0, page, start, count });
+    }
+    count = 0;
+}
+
+void MeshHeap::addFreeRange(std::uint16_t page, std::uint32_t start, std::uint32_t count) {
+    pages[page].free_by_start.emplace(start, count);
+    free_by_size.insert({ count, page, start });
+}
+
+void MeshHeap::removeFreeRange(std::uint16_t page, std::uint32_t start, std::uint32_t count) {
+    pages[page].free_by_start.erase(start);
+    free_by_size.erase({ count, page, start });
+}
+
+MeshRange MeshHeap::allocate(std::uint32_t vertex_count) {
+    if (vertex_count == 0) {
+        return MeshRange();
+    }
+    FreeRange found_range;
+    bgfx::DynamicVertexBufferHandle vertex_buffer;
+    {
+        SpinLock lock(locked_flag, GKM_SPIN_LOCK_SITE("Mesh heap"));
+        auto found_it = free_by_size.lower_bound({ vertex_count, 0, 0 });
+        if (found_it == free_by_size.end()) {
+            if (page_count == MAX_PAGES) {
+                ++failed_allocations;
+                return MeshRange();
+            }
+            const std::uint16_t new_page = page_count++;
+            // Very big meshes get their own page
+            const std::uint32_t page_vertex_count = std::max(PAGE_VERTEX_COUNT, vertex_count);
+            pages[new_page].vertex_count = page_vertex_count;
+            pages[new_page].vertex_buffer = makeBgfxSharedPtr(bgfx::createDynamicVertexBuffer(page_vertex_count, BgfxVertex::ms_layout));
+            capacity_vertices += page_vertex_count;
+            addFreeRange(new_page, 0, page_vertex_count);
+            found_it = free_by_size.lower_bound({ vertex_count, 0, 0 });
+        }
+        found_range = *found_it;
+        removeFreeRange(found_range.page, found_range.start, found_range.count);
+        if (found_range.count > vertex_count) {
+            addFreeRange(found_range.page, found_range.start + vertex_count, found_range.count - vertex_count);
+        }
+        used_vertices += vertex_count;
+        ++allocations;
+        vertex_buffer = *pages[found_range.page].vertex_buffer;
+    }
+    return MeshRange(vertex_buffer, found_range.page, found_range.start, vertex_count);
+}
+
+void MeshHeap::free(std::uint16_t page, std::uint32_t start, std::uint32_t count) {
+    SpinLock lock(locked_flag, GKM_SPIN_LOCK_SITE("Mesh heap"));
+    auto& free_by_start = pages[page].free_by_start;
+    std::uint32_t new_start = start;
+    std::uint32_t new_count = count;
+    auto next_it = free_by_start.upper_bound(start);
+    if (next_it != free_by_start.end() && next_it->first == start + count) {
+        new_count += next_it->second;
+        removeFreeRange(page, next_it->first, next_it->second);
+        next_it = free_by_start.upper_bound(start);
+    }
+    if (next_it != free_by_start.begin()) {
+        auto previous_it = std::prev(next_it);
+        if (previous_it->first + previous_it->second == start) {
+            new_start = previous_it->first;
+            new_count += previous_it->second;
+            removeFreeRange(page, previous_it->first, previous_it->second);
+        }
+    }
+    addFreeRange(page, new_start, new_count);
+    used_vertices -= count;
+    --allocations;
+}
+
+MeshHeapStatistics MeshHeap::getStatistics() const {
+    SpinLock lock(locked_flag, GKM_SPIN_LOCK_SITE("Mesh heap"));
+    MeshHeapStatistics result;
+    result.pages = page_count;
+    result.capacity_vertices = capacity_vertices;
+    result.used_vertices = used_vertices;
+    result.allocations = allocations;
+    result.failed_allocations = failed_allocations;
+    result.free_ranges = static_cast<std::uint32_t>(free_by_size.size());
+    if (!free_by_size.empty()) {
+        result.largest_free_range = free_by_size.rbegin()->count;
+    }
+    const std::uint64_t free_vertices = capacity_vertices - used_vertices;
+    if (free_vertices > 0) {
+        result.fragmentation = 1.0f - static_cast<float>(result.largest_free_range) / static_cast<float>(free_vertices);
+    }
+    return result;
+}
@@ -0,0 +1,128 @@
+// Copyright 2023 Petr Petrov. All rights reserved.
+// License: https://github.com/PetrPPetrov/gkm-local/blob/main/LICENSE
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <array>
+#include <map>
+#include <set>
+#include <atomic>
+#include "bgfx_api.h"
+
+struct MeshHeapStatistics {
+    std::uint32_t pages = 0;
+    std::uint64_t capacity_vertices = 0;
+    std::uint64_t used_vertices = 0;
+    std::uint32_t allocations = 0;
+    // Allocations which failed because all pages are used.
+    std::uint32_t failed_allocations = 0;
+    std::uint32_t free_ranges = 0;
+    std::uint32_t largest_free_range = 0;
+    // 0 if all free vertices are in one range, goes to 1 if they are split into many small ranges
+    float fragmentation = 0.0f;
+};
+
+// Range of vertices in one of mesh heap pages, it is returned back to the heap on destruction.
+class MeshRange {
+    bgfx::DynamicVertexBufferHandle vertex_buffer = BGFX_INVALID_HANDLE;
+    std::uint16_t page = 0;
+    std::uint32_t start = 0;
+    std::uint32_t count = 0;
+
+    void release();
+
+public:
+    MeshRange() = default;
+    MeshRange(bgfx::DynamicVertexBufferHandle vertex_buffer_, std::uint16_t page_, std::uint32_t start_, std::uint32_t count_) :
+        vertex_buffer(vertex_buffer_), page(page_), start(start_), count(count_) {
+    }
+    MeshRange(MeshRange&& other) noexcept {
+        *this = std::move(other);
+    }
+    MeshRange& operator=(MeshRange&& other) noexcept {
+        if (this != &other) {
+            release();
+            vertex_buffer = other.vertex_buffer;
+            page = other.page;
+            start = other.start;
+            count = other.count;
+            other.count = 0;
+        }
+        return *this;
+    }
+    MeshRange(const MeshRange&) = delete;
+    MeshRange& operator=(const MeshRange&) = delete;
+    ~MeshRange() {
+        release();
+    }
+
+    bool isValid() const {
+        return count != 0;
+    }
+    bgfx::DynamicVertexBufferHandle getVertexBuffer() const {
+        return vertex_buffer;
+    }
+    std::uint32_t getStart() const {
+        return start;
+    }
+    std::uint32_t getCount() const {
+        return count;
+    }
+};
+
+// Suballocates block meshes from a few big dynamic vertex buffers (pages),
+// so block meshes do not consume bgfx vertex buffer handles.
+// Free ranges are indexed by start for coalescing and by size for the best fit search.
+class MeshHeap {
+public:
+    typedef std::unique_ptr<MeshHeap> Ptr;
+
+    constexpr static std::uint32_t PAGE_VERTEX_COUNT = 1024 * 1024;
+    constexpr static std::uint16_t MAX_PAGES = 64;
+
+    // Allocates vertex_count vertices, the range is not valid if the heap is full.
+    MeshRange allocate(std::uint32_t vertex_count);
+    void free(std::uint16_t page, std::uint32_t start, std::uint32_t count);
+    MeshHeapStatistics getStatistics() const;
+
+private:
+    struct FreeRange {
+        std::uint32_t count;
+        std::uint16_t page;
+        std::uint32_t start;
+
+        bool operator<(const FreeRange& other) const {
+            if (count != other.count) {
+                return count < other.count;
+            }
+            if (page != other.page) {
+                return page < other.page;
+            }
+            return start < other.start;
+        }
+    };
+
+    struct Page {
+        BgfxSharedPtr<bgfx::DynamicVertexBufferHandle> vertex_buffer;
+        std::uint32_t vertex_count = 0;
+        // Start -> count
+        std::map<std::uint32_t, std::uint32_t> free_by_start;
+    };
+
+    void addFreeRange(std::uint16_t page, std::uint32_t start, std::uint32_t count);
+    void removeFreeRange(std::uint16_t page, std::uint32_t start, std::uint32_t count);
+
+    mutable std::atomic<bool> locked_flag = false;
+    std::array<Page, MAX_PAGES> pages;
+    std::uint16_t page_count = 0;
+    std::set<FreeRange> free_by_size;
+    std::uint64_t capacity_vertices = 0;
+    std::uint64_t used_vertices = 0;
+    std::uint32_t allocations = 0;
+    std::uint32_t failed_allocations = 0;
+};
+
+// Created and destroyed by the render thread while tessellation threads are not running.
+extern MeshHeap::Ptr g_mesh_heap;
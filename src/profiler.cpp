@@ -0,0 +1,98 @@
+// Copyright 2023 Petr Petrov. All rights reserved.
+// License: https://github.com/PetrPPetrov/gkm-local/blob/main/LICENSE
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <fstream>
+#include <iomanip>
+#include "profiler.h"
+
+std::atomic<bool> g_profiler_dump_requested = false;
+
+thread_local std::uint32_t ProfileZone::depth = 0;
+
+static const std::chrono::steady_clock::time_point g_profile_start = std::chrono::steady_clock::now();
+
+// Buffers are never destroyed, so events of finished threads are still available.
+static std::mutex g_profile_threads_mutex;
+static std::vector<std::unique_ptr<ProfileThreadBuffer>> g_profile_threads;
+
+std::uint64_t getProfileTime() {
+    return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - g_profile_start).count());
+}
+
+void ProfileThreadBuffer::copyEvents(std::vector<ProfileEvent>& result, std::uint64_t since_ns) const {
+    const std::uint64_t end = write_index.load(std::memory_order_acquire);
+    const std::uint64_t begin = end > CAPACITY ? end - CAPACITY : 0;
+    const std::size_t first_copied = result.size();
+    for (std::uint64_t i = begin; i < end; ++i) {
+        result.push_back(events[i % CAPACITY]);
+    }
+    // The owner thread could overwrite the oldest events during the copy, they are dropped.
+    // The slot of the next event could be written right now, so it is dropped as well.
+    std::atomic_thread_fence(std::memory_order_acquire);
+    const std::uint64_t new_end = write_index.load(std::memory_order_relaxed);
+    const std::uint64_t valid_begin = new_end >= CAPACITY ? new_end - CAPACITY + 1 : 0;
+    std::size_t write = first_copied;
+    for (std::uint64_t i = begin; i < end; ++i) {
+        const ProfileEvent& event = result[first_copied + (i - begin)];
+        if (i >= valid_begin && event.end_ns > since_ns) {
+            result[write++] = event;
+        }
+    }
+    result.resize(write);
+}
+
+ProfileThreadBuffer& getProfileThreadBuffer() {
+    thread_local ProfileThreadBuffer* thread_buffer = nullptr;
+    if (!thread_buffer) {
+        std::lock_guard lock(g_profile_threads_mutex);
+        g_profile_threads.push_back(std::make_unique<ProfileThreadBuffer>("Thread", static_cast<std::uint32_t>(g_profile_threads.size())));
+        thread_buffer = g_profile_threads.back().get();
+    }
+    return *thread_buffer;
+}
+
+void setProfileThreadName(const char* name) {
+    getProfileThreadBuffer().setName(name);
+}
+
+void collectProfileEvents(std::vector<ProfileThreadEvents>& threads, std::uint64_t since_ns) {
+    std::lock_guard lock(g_profile_threads_mutex);
+    threads.resize(g_profile_threads.size());
+    for (std::size_t i = 0; i < g_profile_threads.size(); ++i) {
+        const ProfileThreadBuffer& buffer = *g_profile_threads[i];
+        threads[i].name = buffer.getName();
+        threads[i].thread_index = buffer.getThreadIndex();
+        threads[i].events.clear();
+        buffer.copyEvents(threads[i].events, since_ns);
+    }
+}
+
+bool dumpChromeTrace(const std::string& file_name) {
+    std::vector<ProfileThreadEvents> threads;
+    collectProfileEvents(threads, 0);
+
+    std::ofstream output_file(file_name);
+    if (!output_file) {
+        return false;
+    }
+    // Chrome trace uses microseconds, keep nanoseconds for long sessions
+    output_file << std::fixed << std::setprecision(3);
+    output_file << "{\"traceEvents\":[\n";
+    bool first = true;
+    for (const auto& thread : threads) {
+        output_file << (first ? "" : ",\n");
+        first = false;
+        output_file << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << thread.thread_index
+            << ",\"args\":{\"name\":\"" << thread.name << "\"}}";
+        for (const auto& event : thread.events) {
+            output_file << ",\n{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << thread.thread_index
+                << ",\"ts\":" << event.start_ns / 1000.0
+                << ",\"dur\":" << (event.end_ns - event.start_ns) / 1000.0 << "}";
+        }
+    }
+    output_file << "\n],\"displayTimeUnit\":\"ms\"}\n";
+    return static_cast<bool>(output_file);
+}
@@ -0,0 +1,100 @@
+// Copyright 2023 Petr Petrov. All rights reserved.
+// License: https://github.com/PetrPPetrov/gkm-local/blob/main/LICENSE
+
+#pragma once
+
+#include <cstdint>
+#include <atomic>
+#include <array>
+#include <string>
+#include <vector>
+
+// Scoped zone profiler. Every thread records finished zones into its own ring buffer, only the owner thread writes it,
+// so recording takes no locks. Readers copy the ring and drop events which could be overwritten during the copy.
+// Zones are recorded only if GKM_PROFILER is defined, otherwise the macros compile to nothing.
+// Zone and thread names should be string literals, they are stored as pointers.
+
+struct ProfileEvent {
+    const char* name;
+    std::uint64_t start_ns;
+    std::uint64_t end_ns;
+    std::uint32_t depth;
+};
+
+class ProfileThreadBuffer {
+public:
+    constexpr static std::uint32_t CAPACITY = 16 * 1024;
+
+    ProfileThreadBuffer(const char* name_, std::uint32_t thread_index_) : name(name_), thread_index(thread_index_) {
+    }
+
+    // Called only by the owner thread.
+    void add(const ProfileEvent& event) {
+        const std::uint64_t index = write_index.load(std::memory_order_relaxed);
+        events[index % CAPACITY] = event;
+        write_index.store(index + 1, std::memory_order_release);
+    }
+    // Appends events finished after since_ns, oldest first.
+    void copyEvents(std::vector<ProfileEvent>& result, std::uint64_t since_ns) const;
+
+    const char* getName() const {
+        return name.load();
+    }
+    void setName(const char* name_) {
+        name = name_;
+    }
+    std::uint32_t getThreadIndex() const {
+        return thread_index;
+    }
+
+private:
+    std::atomic<const char*> name;
+    std::uint32_t thread_index;
+    std::atomic<std::uint64_t> write_index = 0;
+    std::array<ProfileEvent, CAPACITY> events = {};
+};
+
+struct ProfileThreadEvents {
+    const char* name;
+    std::uint32_t thread_index;
+    std::vector<ProfileEvent> events;
+};
+
+// Nanoseconds since the profiler start.
+std::uint64_t getProfileTime();
+// Returns the buffer of the calling thread, it is created on the first call.
+ProfileThreadBuffer& getProfileThreadBuffer();
+void setProfileThreadName(const char* name);
+// Copies events of all threads finished after since_ns.
+void collectProfileEvents(std::vector<ProfileThreadEvents>& threads, std::uint64_t since_ns);
+// Writes events of all threads in Chrome trace event format (chrome://tracing, Perfetto), returns false on failure.
+bool dumpChromeTrace(const std::string& file_name);
+
+// Set by the hotkey, the render thread dumps the trace after the frame.
+extern std::atomic<bool> g_profiler_dump_requested;
+
+class ProfileZone {
+public:
+    ProfileZone(const char* name_) : name(name_), start_ns(getProfileTime()) {
+        ++depth;
+    }
+    ~ProfileZone() {
+        --depth;
+        getProfileThreadBuffer().add({ name, start_ns, getProfileTime(), depth });
+    }
+
+private:
+    const char* name;
+    std::uint64_t start_ns;
+    static thread_local std::uint32_t depth;
+};
+
+#ifdef GKM_PROFILER
+#define GKM_PROFILE_CONCATENATE_IMPL(left, right) left##right
+#define GKM_PROFILE_CONCATENATE(left, right) GKM_PROFILE_CONCATENATE_IMPL(left, right)
+#define GKM_PROFILE_ZONE(name) ProfileZone GKM_PROFILE_CONCATENATE(profile_zone_, __LINE__)(name)
+#define GKM_PROFILE_THREAD(name) setProfileThreadName(name)
+#else
+#define GKM_PROFILE_ZONE(name) ((void)0)
+#define GKM_PROFILE_THREAD(name) ((void)0)
+#endif
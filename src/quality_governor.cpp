@@ -0,0 +1,88 @@
+// Copyright 2023 Petr Petrov. All rights reserved.
+// License: https://github.com/PetrPPetrov/gkm-local/blob/main/LICENSE
+
+#include <algorithm>
+#include "quality_governor.h"
+
+// From the lowest quality to the highest one.
+constexpr static QualitySettings QUALITY_LADDER[QualityGovernor::QUALITY_LEVEL_COUNT] = {
+    { 4, 16.0f, 16 },
+    { 5, 12.0f, 24 },
+    { 6, 8.0f, 32 },
+    { 8, 4.0f, 64 },
+    { 10, 3.0f, 96 },
+    { 12, 2.0f, 128 },
+    { 16, 1.5f, 256 }
+};
+
+// Weight of the new frame in the smoothed frame times.
+constexpr static float SMOOTHING = 0.1f;
+// Quality is lowered if the frame is longer than the target by this ratio.
+constexpr static float LOWER_RATIO = 1.05f;
+// Quality is raised if the frame is shorter than the target by this ratio.
+constexpr static float RAISE_RATIO = 0.7f;
+constexpr static std::uint32_t LOWER_FRAMES = 30;
+constexpr static std::uint32_t RAISE_FRAMES = 120;
+constexpr static std::uint32_t COOLDOWN_FRAMES = 60;
+
+QualityGovernor::QualityGovernor(float target_frame_ms_) : target_frame_ms(target_frame_ms_) {
+}
+
+bool QualityGovernor::update(float cpu_ms, float gpu_ms) {
+    if (!has_samples) {
+        smoothed_cpu_ms = cpu_ms;
+        smoothed_gpu_ms = gpu_ms;
+        has_samples = true;
+    } else {
+        smoothed_cpu_ms += (cpu_ms - smoothed_cpu_ms) * SMOOTHING;
+        smoothed_gpu_ms += (gpu_ms - smoothed_gpu_ms) * SMOOTHING;
+    }
+    bound = smoothed_gpu_ms > smoothed_cpu_ms ? EFrameBound::Gpu : EFrameBound::Cpu;
+
+    if (fixed) {
+        return false;
+    }
+    if (cooldown_frames > 0) {
+        --cooldown_frames;
+        return false;
+    }
+
+    const float frame_ms = std::max(smoothed_cpu_ms, smoothed_gpu_ms);
+    if (frame_ms > target_frame_ms * LOWER_RATIO) {
+        ++over_budget_frames;
+        under_budget_frames = 0;
+    } else if (frame_ms < target_frame_ms * RAISE_RATIO) {
+        ++under_budget_frames;
+        over_budget_frames = 0;
+    } else {
+        over_budget_frames = 0;
+        under_budget_frames = 0;
+    }
+
+    EGovernorDecision decision = EGovernorDecision::Keep;
+    if (over_budget_frames >= LOWER_FRAMES && quality_level > 0) {
+        --quality_level;
+        decision = EGovernorDecision::Lower;
+    } else if (under_budget_frames >= RAISE_FRAMES && quality_level + 1 < QUALITY_LEVEL_COUNT) {
+        ++quality_level;
+        decision = EGovernorDecision::Raise;
+    }
+    if (decision == EGovernorDecision::Keep) {
+        return false;
+    }
+    last_decision = decision;
+    over_budget_frames = 0;
+    under_budget_frames = 0;
+    cooldown_frames = COOLDOWN_FRAMES;
+    return true;
+}
+
+void QualityGovernor::fixQualityLevel(unsigned quality_level_) {
+    quality_level = std::min(quality_level_, QUALITY_LEVEL_COUNT - 1);
+    last_decision = EGovernorDecision::Keep;
+    fixed = true;
+}
+
+const QualitySettings& QualityGovernor::getSettings() const {
+    return QUALITY_LADDER[quality_level];
+}
@@ -0,0 +1,76 @@
+// Copyright 2023 Petr Petrov. All rights reserved.
+// License: https://github.com/PetrPPetrov/gkm-local/blob/main/LICENSE
+
+#pragma once
+
+#include <cstdint>
+#include "gkm_local.h"
+
+struct QualitySettings {
+    BlockIndex view_distance;
+    // Level of detail mesh is used if its cells are smaller than this count of pixels on the screen.
+    float lod_cell_pixels;
+    // Meshes which tessellation threads can upload per frame.
+    std::uint32_t tessellation_budget;
+};
+
+enum class EGovernorDecision : std::uint8_t {
+    Keep,
+    Lower,
+    Raise
+};
+
+enum class EFrameBound : std::uint8_t {
+    Cpu,
+    Gpu
+};
+
+// Holds the target frame time by moving along the quality ladder.
+// Frame times are smoothed, quality is lowered if the frame is too long for a while
+// and raised only if there is a big reserve for a longer while. After every change
+// the governor waits, so the new quality has time to show its cost.
+class QualityGovernor {
+public:
+    constexpr static unsigned QUALITY_LEVEL_COUNT = 7;
+    constexpr static unsigned DEFAULT_QUALITY_LEVEL = 3;
+
+    QualityGovernor(float target_frame_ms_);
+
+    // Accounts times of the finished frame, returns true if quality settings were changed.
+    bool update(float cpu_ms, float gpu_ms);
+    // Sets the quality level which is kept regardless of frame times.
+    void fixQualityLevel(unsigned quality_level_);
+
+    const QualitySettings& getSettings() const;
+    unsigned getQualityLevel() const {
+        return quality_level;
+    }
+    float getTargetFrameMs() const {
+        return target_frame_ms;
+    }
+    float getSmoothedCpuMs() const {
+        return smoothed_cpu_ms;
+    }
+    float getSmoothedGpuMs() const {
+        return smoothed_gpu_ms;
+    }
+    EGovernorDecision getLastDecision() const {
+        return last_decision;
+    }
+    EFrameBound getBound() const {
+        return bound;
+    }
+
+private:
+    float target_frame_ms;
+    unsigned quality_level = DEFAULT_QUALITY_LEVEL;
+    float smoothed_cpu_ms = 0.0f;
+    float smoothed_gpu_ms = 0.0f;
+    bool has_samples = false;
+    bool fixed = false;
+    std::uint32_t over_budget_frames = 0;
+    std::uint32_t under_budget_frames = 0;
+    std::uint32_t cooldown_frames = 0;
+    EGovernorDecision last_decision = EGovernorDecision::Keep;
+    EFrameBound bound = EFrameBound::Cpu;
+};
@@ -0,0 +1,80 @@
+// Copyright 2023 Petr Petrov. All rights reserved.
+// License: https://github.com/PetrPPetrov/gkm-local/blob/main/LICENSE
+
+#include <mutex>
+#include <algorithm>
+#include "queue_statistics.h"
+
+constexpr std::uint64_t RATE_PERIOD_NS = 1'000'000'000;
+
+// Function-local statics, because request queues are static objects of other translation units.
+static std::mutex& getRegistryMutex() {
+    static std::mutex registry_mutex;
+    return registry_mutex;
+}
+
+static std::vector<RequestQueueStatistics*>& getRegistry() {
+    static std::vector<RequestQueueStatistics*> registry;
+    return registry;
+}
+
+RequestQueueStatistics::RequestQueueStatistics(const char* name_) : name(name_), rate_time(getTime()) {
+    std::lock_guard lock(getRegistryMutex());
+    getRegistry().push_back(this);
+}
+
+RequestQueueStatistics::~RequestQueueStatistics() {
+    std::lock_guard lock(getRegistryMutex());
+    auto& registry = getRegistry();
+    registry.erase(std::remove(registry.begin(), registry.end(), this), registry.end());
+}
+
+std::uint64_t RequestQueueSnapshot::getLatencyPercentileUs(float percentile) const {
+    std::uint64_t total = 0;
+    for (std::uint64_t count : latency_histogram) {
+        total += count;
+    }
+    if (total == 0) {
+        return 0;
+    }
+    const std::uint64_t target = std::max<std::uint64_t>(static_cast<std::uint64_t>(total * percentile), 1);
+    std::uint64_t accumulated = 0;
+    for (std::uint32_t bucket = 0; bucket < RequestQueueStatistics::LATENCY_BUCKETS; ++bucket) {
+        accumulated += latency_histogram[bucket];
+        if (accumulated >= target) {
+            return std::uint64_t(1) << bucket;
+        }
+    }
+    return std::uint64_t(1) << (RequestQueueStatistics::LATENCY_BUCKETS - 1);
+}
+
+void collectRequestQueueStatistics(std::vector<RequestQueueSnapshot>& result) {
+    const std::uint64_t now = RequestQueueStatistics::getTime();
+    std::lock_guard lock(getRegistryMutex());
+    const auto& registry = getRegistry();
+    result.resize(registry.size());
+    for (std::size_t i = 0; i < registry.size(); ++i) {
+        RequestQueueStatistics& statistics = *registry[i];
+        RequestQueueSnapshot& snapshot = result[i];
+        snapshot.name = statistics.name;
+        snapshot.pushes = statistics.pushes.load(std::memory_order_relaxed);
+        snapshot.pops = statistics.pops.load(std::memory_order_relaxed);
+        snapshot.overflows = statistics.overflows.load(std::memory_order_relaxed);
+        snapshot.blocking_waits = statistics.blocking_waits.load(std::memory_order_relaxed);
+        snapshot.size = statistics.size.load(std::memory_order_relaxed);
+        snapshot.high_water_mark = statistics.high_water_mark.load(std::memory_order_relaxed);
+        for (std::uint32_t bucket = 0; bucket < RequestQueueStatistics::LATENCY_BUCKETS; ++bucket) {
+            snapshot.latency_histogram[bucket] = statistics.latency_histogram[bucket].load(std::memory_order_relaxed);
+        }
+        if (now - statistics.rate_time >= RATE_PERIOD_NS) {
+            const float seconds = (now - statistics.rate_time) / 1e9f;
+            statistics.push_rate = (snapshot.pushes - statistics.rate_pushes) / seconds;
+            statistics.pop_rate = (snapshot.pops - statistics.rate_pops) / seconds;
+            statistics.rate_time = now;
+            statistics.rate_pushes = snapshot.pushes;
+            statistics.rate_pops = snapshot.pops;
+        }
+        snapshot.push_rate = statistics.push_rate;
+        snapshot.pop_rate = statistics.pop_rate;
+    }
+}
@@ -0,0 +1,96 @@
+// Copyright 2023 Petr Petrov. All rights reserved.
+// License: https://github.com/PetrPPetrov/gkm-local/blob/main/LICENSE
+
+#pragma once
+
+#include <cstdint>
+#include <atomic>
+#include <array>
+#include <chrono>
+#include <vector>
+
+struct RequestQueueSnapshot;
+
+// Telemetry of one named request queue. Request queues update it only if GKM_QUEUE_STATISTICS is defined.
+// Counters are relaxed atomics, so producers and consumers do not synchronize through them.
+class RequestQueueStatistics {
+public:
+    // Bucket i counts enqueue to dequeue latencies in [2^(i-1), 2^i) microseconds, bucket 0 counts latencies below 1 us.
+    constexpr static std::uint32_t LATENCY_BUCKETS = 24;
+
+    explicit RequestQueueStatistics(const char* name_);
+    ~RequestQueueStatistics();
+    RequestQueueStatistics(const RequestQueueStatistics&) = delete;
+    RequestQueueStatistics& operator=(const RequestQueueStatistics&) = delete;
+
+    static std::uint64_t getTime() {
+        return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+    }
+
+    void onPush(std::uint32_t new_size) {
+        pushes.fetch_add(1, std::memory_order_relaxed);
+        size.store(new_size, std::memory_order_relaxed);
+        std::uint32_t high_water = high_water_mark.load(std::memory_order_relaxed);
+        while (new_size > high_water && !high_water_mark.compare_exchange_weak(high_water, new_size, std::memory_order_relaxed)) {
+        }
+    }
+    // Request dropped because the queue was full.
+    void onOverflow() {
+        overflows.fetch_add(1, std::memory_order_relaxed);
+    }
+    void onPop(std::uint32_t new_size, std::uint64_t push_time) {
+        pops.fetch_add(1, std::memory_order_relaxed);
+        size.store(new_size, std::memory_order_relaxed);
+        const std::uint64_t now = getTime();
+        std::uint64_t latency_us = now > push_time ? (now - push_time) / 1000 : 0;
+        std::uint32_t bucket = 0;
+        while (latency_us > 0 && bucket + 1 < LATENCY_BUCKETS) {
+            latency_us >>= 1;
+            ++bucket;
+        }
+        latency_histogram[bucket].fetch_add(1, std::memory_order_relaxed);
+    }
+    // Consumer parked on the empty queue or producer parked on the full queue.
+    void onBlockingWait() {
+        blocking_waits.fetch_add(1, std::memory_order_relaxed);
+    }
+
+private:
+    friend void collectRequestQueueStatistics(std::vector<RequestQueueSnapshot>& result);
+
+    const char* name;
+    std::atomic<std::uint64_t> pushes = 0;
+    std::atomic<std::uint64_t> pops = 0;
+    std::atomic<std::uint64_t> overflows = 0;
+    std::atomic<std::uint64_t> blocking_waits = 0;
+    std::atomic<std::uint32_t> size = 0;
+    std::atomic<std::uint32_t> high_water_mark = 0;
+    std::array<std::atomic<std::uint64_t>, LATENCY_BUCKETS> latency_histogram = {};
+
+    // Rates are recalculated by collectRequestQueueStatistics() not more often than once per RATE_PERIOD_NS.
+    std::uint64_t rate_time = 0;
+    std::uint64_t rate_pushes = 0;
+    std::uint64_t rate_pops = 0;
+    float push_rate = 0.0f;
+    float pop_rate = 0.0f;
+};
+
+struct RequestQueueSnapshot {
+    const char* name = nullptr;
+    std::uint64_t pushes = 0;
+    std::uint64_t pops = 0;
+    std::uint64_t overflows = 0;
+    std::uint64_t blocking_waits = 0;
+    std::uint32_t size = 0;
+    std::uint32_t high_water_mark = 0;
+    // Requests per second during the last rate period
+    float push_rate = 0.0f;
+    float pop_rate = 0.0f;
+    std::array<std::uint64_t, RequestQueueStatistics::LATENCY_BUCKETS> latency_histogram = {};
+
+    // Returns the upper bound of the latency bucket which contains the given percentile, in microseconds.
+    std::uint64_t getLatencyPercentileUs(float percentile) const;
+};
+
+// Copies statistics of all alive request queues in order of their creation.
+void collectRequestQueueStatistics(std::vector<RequestQueueSnapshot>& result);
@@ -0,0 +1,48 @@
+// Copyright 2023 Petr Petrov. All rights reserved.
+// License: https://github.com/PetrPPetrov/gkm-local/blob/main/LICENSE
+
+#include <algorithm>
+#include <limits>
+#include "spin_lock.h"
+#include "release_queue.h"
+
+ReleaseQueue g_release_queue;
+
+void ReleaseQueue::push(const PendingRelease& pending_release) {
+    if (closed) {
+        return;
+    }
+    SpinLock lock(locked_flag, GKM_SPIN_LOCK_SITE("Release queue"));
+    pending.push_back(pending_release);
+    peak_pending_count = std::max(peak_pending_count, static_cast<std::uint32_t>(pending.size()));
+}
+
+std::uint32_t ReleaseQueue::drain(std::uint32_t max_count) {
+    releasing.clear();
+    {
+        SpinLock lock(locked_flag, GKM_SPIN_LOCK_SITE("Release queue"));
+        const std::size_t count = std::min(static_cast<std::size_t>(max_count), pending.size());
+        releasing.assign(pending.begin(), pending.begin() + count);
+        pending.erase(pending.begin(), pending.begin() + count);
+    }
+    for (const auto& pending_release : releasing) {
+        pending_release.release(pending_release);
+    }
+    return static_cast<std::uint32_t>(releasing.size());
+}
+
+void ReleaseQueue::close() {
+    while (drain(std::numeric_limits<std::uint32_t>::max()) > 0) {
+    }
+    closed = true;
+}
+
+std::uint32_t ReleaseQueue::getPendingCount() const {
+    SpinLock lock(locked_flag, GKM_SPIN_LOCK_SITE("Release queue"));
+    return static_cast<std::uint32_t>(pending.size());
+}
+
+std::uint32_t ReleaseQueue::getPeakPendingCount() const {
+    SpinLock lock(locked_flag, GKM_SPIN_LOCK_SITE("Release queue"));
+    return peak_pending_count;
+}
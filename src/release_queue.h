@@ -0,0 +1,55 @@
+// Copyright 2023 Petr Petrov. All rights reserved.
+// License: https://github.com/PetrPPetrov/gkm-local/blob/main/LICENSE
+
+#pragma once
+
+#include <cstdint>
+#include <atomic>
+#include <deque>
+#include <vector>
+#include "bgfx/bgfx.h"
+
+// GPU resource which waits to be released on the render thread.
+struct PendingRelease {
+    void (*release)(const PendingRelease& pending_release);
+    std::uint16_t handle;
+    std::uint16_t page;
+    std::uint32_t start;
+    std::uint32_t count;
+};
+
+// GPU resources can be dropped by any thread, for example, by block operation thread or by the cache cleanup.
+// They are put into this queue and the render thread releases them after bgfx::frame(),
+// no more than the given count per frame, so mass edits do not cause frame hitches.
+class ReleaseQueue {
+    mutable std::atomic<bool> locked_flag = false;
+    std::deque<PendingRelease> pending;
+    std::vector<PendingRelease> releasing;
+    // bgfx is shut down, releases are ignored
+    std::atomic<bool> closed = false;
+    std::uint32_t peak_pending_count = 0;
+
+public:
+    void push(const PendingRelease& pending_release);
+    // Releases up to max_count resources in the calling thread, returns the released count.
+    std::uint32_t drain(std::uint32_t max_count);
+    // Releases all pending resources and ignores all next releases.
+    void close();
+    std::uint32_t getPendingCount() const;
+    std::uint32_t getPeakPendingCount() const;
+};
+
+extern ReleaseQueue g_release_queue;
+
+template <class BgfxType>
+void releaseBgfxHandle(const PendingRelease& pending_release) {
+    BgfxType bgfx_handle = { pending_release.handle };
+    bgfx::destroy(bgfx_handle);
+}
+
+template <class BgfxType>
+void scheduleRelease(BgfxType bgfx_handle) {
+    if (bgfx::isValid(bgfx_handle)) {
+        g_release_queue.push({ &releaseBgfxHandle<BgfxType>, bgfx_handle.idx, 0, 0, 0 });
+    }
+}
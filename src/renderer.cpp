@@ -5,16 +5,59 @@
 #include <thread>
 #include <atomic>
 #include <chrono>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <stdexcept>
 #include "main.h"
 #include "user_interface.h"
 #include "game_logic.h"
 #include "world.h"
+#include "world_streaming.h"
+#include "world_store.h"
+#include "block_paging.h"
 #include "tessellation.h"
 #include "block_operation.h"
+#include "frame_arena.h"
+#include "worker_pool.h"
+#include "frustum.h"
+#include "visible_set_cache.h"
+#include "quality_governor.h"
+#include "profiler.h"
 #include "renderer.h"
 
 bgfx::VertexLayout BgfxVertex::ms_layout;
 
+RenderStatistics g_render_statistics;
+FrameTimeHistogram g_frame_time_histogram;
+
+struct DrawCounters {
+    std::uint32_t block_types = 0;
+    std::uint32_t draw_calls = 0;
+    std::uint32_t truncated_instances = 0;
+};
+
+// Per worker data of the scene traversal.
+struct RenderWorker {
+    FrameArena frame_arena;
+    // Sorted instances collected by this worker during the last rebuilt frame, allocated from frame_arena.
+    // Blocks are submitted from sorted instances of all workers, so every block is submitted by one worker.
+    InstanceRecord* batch_begin = nullptr;
+    InstanceRecord* batch_end = nullptr;
+    std::uint32_t instances = 0;
+    DrawCounters draw_counters;
+    // True if some top-level blocks of the worker tiles were changed or their visibility was changed.
+    bool visible_set_changed = false;
+    std::uint32_t collected_blocks = 0;
+    std::uint32_t culled_blocks = 0;
+    std::uint32_t lod_blocks = 0;
+    std::uint32_t incomplete_blocks = 0;
+    std::uint32_t frame_allocations = 0;
+
+    RenderWorker(std::size_t frame_arena_size) : frame_arena(frame_arena_size) {
+    }
+};
+
 class Renderer {
 public:
     typedef std::unique_ptr<Renderer> Ptr;
@@ -25,8 +68,11 @@ public:
     TextureCache* getTextureCache() const;
 
     void render(int window_width, int window_height);
+    void fixQualityLevel(unsigned quality_level);
 
 private:
+    void loadMaterialTextures();
+
     BgfxEngineShutdown bgfx_engine_shutdown;
 
     TextureCache::Ptr texture_cache;
@@ -36,113 +82,125 @@ private:
     std::uint32_t reset;
     DrawRefInfo::Ptr draw_ref_info;
     FlatTerrain::Ptr terrain;
+    WorkerPool worker_pool;
+    std::vector<std::unique_ptr<RenderWorker>> render_workers;
+    VisibleSetCache visible_set_cache;
+    BlockIndex last_start_block_x_index = 0;
+    BlockIndex last_start_block_y_index = 0;
+    bool has_visible_set = false;
+    QualityGovernor quality_governor;
 };
 
+constexpr static std::size_t FRAME_ARENA_INITIAL_SIZE = 1024 * 1024;
+constexpr static BlockIndex TRAVERSAL_TILE_SIZE = 4;
+constexpr static unsigned MAX_RENDER_WORKERS = 8;
+// Instance data lives in the transient vertex buffer, bgfx default is 6 MB.
+constexpr static std::uint32_t TRANSIENT_VERTEX_BUFFER_SIZE = 32 * 1024 * 1024;
+constexpr static std::uint32_t MAX_INSTANCES_PER_SUBMIT = 64 * 1024;
+// GPU resources released by the render thread per frame, the rest wait for next frames.
+constexpr static std::uint32_t MAX_RELEASES_PER_FRAME = 256;
+// Vertical field of view in degrees.
+constexpr static float FIELD_OF_VIEW = 30.0f;
+// Player's eyes are 160 centimeters above the ground, which is the top of the first top-level block layer.
+constexpr static float PLAYER_EYE_Z = TopLevelBlock::SIZE + 160.0f;
+
+static unsigned getRenderWorkerCount() {
+    // Leave some cores for game logic, block operation and tessellation threads.
+    const unsigned hardware_threads = std::thread::hardware_concurrency();
+    return std::clamp(hardware_threads / 2, 1u, MAX_RENDER_WORKERS);
+}
+
 constexpr static std::uint32_t TARGET_FPS = 60;
 static_assert(TARGET_FPS > 1);
 
-constexpr static std::chrono::seconds ONE_SECOND(1);
-constexpr static std::uint32_t ONE_SEC_MC = static_cast<std::uint32_t>(std::chrono::microseconds(ONE_SECOND).count());
-
-constexpr static std::chrono::milliseconds SLEEP_FOR_FPS(50);
-constexpr static std::uint32_t SLEEP_COUNT = static_cast<std::uint32_t>(std::chrono::milliseconds(ONE_SECOND).count() / SLEEP_FOR_FPS.count());
-
 static Renderer::Ptr g_renderer = nullptr;
 static std::unique_ptr<std::thread> g_render_thread = nullptr;
-static std::unique_ptr<std::thread> g_fps_count_thread = nullptr;
-
-static_assert(std::atomic<std::uint32_t>::is_always_lock_free);
-static std::atomic<std::uint32_t> g_fps = 0;
-static std::atomic<std::uint32_t> g_wait_time = 10000;
-
-static HWND g_hwnd = 0;
-
-static void fpsCount() {
-    std::uint32_t frames[SLEEP_COUNT] = { 0 };
-    std::uint32_t step_count = 0;
-
-    while (g_is_running) {
-        g_fps = 0;
 
-        std::this_thread::sleep_for(SLEEP_FOR_FPS);
-
-        step_count++;
-        for (std::uint32_t i = 0; i < SLEEP_COUNT - 1; ++i) {
-            frames[i] = frames[i + 1];
-        }
-        frames[SLEEP_COUNT - 1] = g_fps.load();
-
-        if (step_count <= SLEEP_COUNT) {
-            return;
-        }
-
-        std::uint32_t fps = 1;
-        for (std::uint32_t i = 0; i < SLEEP_COUNT; ++i) {
-            fps += frames[i];
-        }
-
-        const std::uint32_t wait_time = g_wait_time.load();
-        const std::uint32_t wait_time_in_1_sec = wait_time * fps;
-
-        // Wait time can not be greater than 1 second (in microsecond).
-        assert(wait_time_in_1_sec < ONE_SEC_MC);
-        std::uint32_t render_time_in_1_sec = 0;
-        if (wait_time_in_1_sec < ONE_SEC_MC) {
-            render_time_in_1_sec = ONE_SEC_MC - wait_time_in_1_sec;
-        }
-
-        const std::uint32_t render_time_one_frame = render_time_in_1_sec / fps;
-        const std::uint32_t predicted_render_time_in_1_sec = TARGET_FPS * render_time_one_frame;
-        std::uint32_t desired_wait_time = 0;
-        if (predicted_render_time_in_1_sec < ONE_SEC_MC) {
-            desired_wait_time = (ONE_SEC_MC - predicted_render_time_in_1_sec) / TARGET_FPS;
-        }
-        g_wait_time.store(desired_wait_time);
-    }
-}
+static void* g_native_window_handle = nullptr;
 
 static void renderThread() {
-    g_renderer = std::make_unique<Renderer>(g_window_width, g_window_height, g_hwnd, bgfx::RendererType::Direct3D11);
+    GKM_PROFILE_THREAD("Render");
+    g_renderer = std::make_unique<Renderer>(g_window_width, g_window_height, g_native_window_handle, bgfx::RendererType::Direct3D11);
     g_renderer->init();
     imguiCreate();
+    // Tessellation threads allocate from the mesh heap of the renderer, so they are started after it and finished before it.
+    startTessellationThreads();
 
+    beginPreciseTimer();
+    FramePacer frame_pacer(TARGET_FPS);
     while (g_is_running) {
-        std::chrono::microseconds wait_time(g_wait_time.load());
-        std::this_thread::sleep_for(wait_time);
+        const std::chrono::duration<float, std::milli> frame_time = frame_pacer.waitForNextFrame();
+        if (frame_time.count() > 0.0f) {
+            g_frame_time_histogram.add(frame_time.count());
+        }
 
         bgfx::reset(g_window_width, g_window_height, BGFX_RESET_MSAA_X4);
         drawUserInterface(g_window_width, g_window_height, g_main_menu_open);
         g_renderer->render(g_window_width, g_window_height);
-        g_fps.store(g_fps.load() + 1);
+        if (g_profiler_dump_requested.exchange(false)) {
+            dumpChromeTrace("trace.json");
+        }
     }
+    endPreciseTimer();
 
+    finishWorldSavingThread();
+    finishBlockPagingThreads();
+    finishWorldStreamingThreads();
     finishTessellationThreads();
     finishBlockOperationThread();
     finishGameLogicThread();
 
     imguiDestroy();
-    g_world = nullptr;
+    shutdownWorld();
+    // Tessellation threads are joined, so nobody allocates from the mesh heap.
+    g_mesh_heap = nullptr;
     g_renderer = nullptr;
 }
 
-void initializeRenderer(HWND hwnd) {
-    g_hwnd = hwnd;
+void initializeRenderer(void* native_window_handle) {
+    g_native_window_handle = native_window_handle;
     g_render_thread = std::make_unique<std::thread>(&renderThread);
-    g_fps_count_thread = std::make_unique<std::thread>(&fpsCount);
 }
 
 void shutdownRenderer() {
     g_render_thread->join();
-    g_fps_count_thread->join();
     g_render_thread.reset();
-    g_fps_count_thread.reset();
 }
 
-Renderer::Renderer(std::uint32_t width_, std::uint32_t height_, void* native_windows_handle, bgfx::RendererType::Enum render_type) {
+void initializeHeadlessRenderer(std::uint32_t width, std::uint32_t height, unsigned quality_level) {
+    GKM_PROFILE_THREAD("Render");
+    g_window_width = static_cast<int>(width);
+    g_window_height = static_cast<int>(height);
+    g_renderer = std::make_unique<Renderer>(width, height, nullptr, bgfx::RendererType::Noop);
+    g_renderer->fixQualityLevel(quality_level);
+    g_renderer->init();
+    startTessellationThreads();
+}
+
+void renderHeadlessFrame() {
+    g_renderer->render(g_window_width, g_window_height);
+}
+
+void shutdownHeadlessRenderer() {
+    finishWorldStreamingThreads();
+    finishTessellationThreads();
+    finishBlockOperationThread();
+
+    shutdownWorld();
+    // Tessellation threads are joined, so nobody allocates from the mesh heap.
+    g_mesh_heap = nullptr;
+    g_renderer = nullptr;
+}
+
+Renderer::Renderer(std::uint32_t width_, std::uint32_t height_, void* native_windows_handle, bgfx::RendererType::Enum render_type) :
+    worker_pool(getRenderWorkerCount() - 1), visible_set_cache(2 * MAX_VIEW_DISTANCE + 1), quality_governor(1000.0f / TARGET_FPS) {
     width = width_;
     height = height_;
     debug = BGFX_DEBUG_TEXT;
     reset = BGFX_RESET_NONE;
+    for (unsigned i = 0; i < worker_pool.getWorkerCount(); ++i) {
+        render_workers.push_back(std::make_unique<RenderWorker>(FRAME_ARENA_INITIAL_SIZE));
+    }
 
     bgfx::Init init;
     init.type = render_type;
@@ -151,27 +209,60 @@ Renderer::Renderer(std::uint32_t width_, std::uint32_t height_, void* native_win
     init.resolution.height = height;
     init.resolution.reset = reset;
     init.platformData.nwh = native_windows_handle;
+    init.limits.maxEncoders = static_cast<std::uint16_t>(worker_pool.getWorkerCount());
+    init.limits.transientVbSize = TRANSIENT_VERTEX_BUFFER_SIZE;
     bgfx::init(init);
 
     bgfx::setDebug(debug);
     bgfx::setViewClear(0, BGFX_CLEAR_COLOR | BGFX_CLEAR_DEPTH, 0xbababaff, 1.0f, 0);
 
     BgfxVertex::init();
+    g_mesh_heap = std::make_unique<MeshHeap>();
 
     draw_ref_info = std::make_shared<DrawRefInfo>();
     draw_ref_info->program = loadProgram();
 
     draw_ref_info->texture = makeBgfxSharedPtr(bgfx::createUniform("s_texColor", bgfx::UniformType::Sampler));
+    draw_ref_info->material_layers = makeBgfxSharedPtr(bgfx::createUniform("s_materialLayers", bgfx::UniformType::Sampler));
     texture_cache = std::make_unique<TextureCache>("textures");
+    loadMaterialTextures();
+}
 
+void Renderer::loadMaterialTextures() {
+    static_assert(MATERIAL_LAYER_TABLE_SIZE == MATERIAL_MAX);
+
+    const bgfx::Caps* caps = bgfx::getCaps();
+    if (0 == (BGFX_CAPS_TEXTURE_2D_ARRAY & caps->supported)) {
+        throw std::runtime_error("Texture arrays are not supported");
+    }
+
+    std::vector<std::uint16_t> texture_ids;
     for (unsigned i = 1; i < MATERIAL_MAX; ++i) {
-        auto cur_texture = texture_cache->getTexture(i).bgfx_texture;
-        draw_ref_info->material_textures[i] = cur_texture;
+        texture_ids.push_back(static_cast<std::uint16_t>(i));
+    }
+    TextureArrayInfo texture_array = texture_cache->loadTextureArray(texture_ids, TEXTURE_SIZE);
+    if (!texture_array.bgfx_texture) {
+        throw std::runtime_error("No material textures found");
+    }
+    // Noop renderer of the headless mode does not report texture limits
+    if (caps->rendererType != bgfx::RendererType::Noop && texture_array.layer_texture_ids.size() > caps->limits.maxTextureLayers) {
+        throw std::runtime_error("Too many material textures");
     }
+    draw_ref_info->material_texture_array = texture_array.bgfx_texture;
+
+    // Materials without texture use the first layer
+    const bgfx::Memory* layer_table = bgfx::alloc(MATERIAL_MAX);
+    std::fill(layer_table->data, layer_table->data + MATERIAL_MAX, 0);
+    for (std::size_t layer = 0; layer < texture_array.layer_texture_ids.size(); ++layer) {
+        layer_table->data[texture_array.layer_texture_ids[layer]] = static_cast<std::uint8_t>(layer);
+    }
+    draw_ref_info->material_layer_table = makeBgfxSharedPtr(bgfx::createTexture2D(
+        static_cast<std::uint16_t>(MATERIAL_MAX), 1, false, 1, bgfx::TextureFormat::R8,
+        BGFX_SAMPLER_POINT | BGFX_SAMPLER_UVW_CLAMP, layer_table));
 }
 
 void Renderer::init() {
-    terrain = std::make_unique<FlatTerrain>(texture_cache->getTexture(1).bgfx_texture);
+    terrain = std::make_unique<FlatTerrain>();
     intializeWorld();
 }
 
@@ -179,57 +270,136 @@ TextureCache* Renderer::getTextureCache() const {
     return texture_cache.get();
 }
 
-template <std::uint8_t Level>
-void drawInstances(DrawInfo draw_info, const std::list<typename Block<Level>::Ptr>& Blocks) {
-    for (auto& block : Blocks) {
-        auto block_draw_info = block->draw_info.read();
-        if (block_draw_info) {
-            constexpr std::uint16_t INSTANCE_STRIDE = 16;
-            std::uint32_t total_blocks = static_cast<std::uint32_t>(block->draw_instance_info.size());
-            std::uint32_t drawn_blocks = bgfx::getAvailInstanceDataBuffer(total_blocks, INSTANCE_STRIDE);
-            bgfx::InstanceDataBuffer instance_buffer_data;
-            bgfx::allocInstanceDataBuffer(&instance_buffer_data, drawn_blocks, INSTANCE_STRIDE);
-            auto idb = reinterpret_cast<std::uint8_t*>(instance_buffer_data.data);
-            auto instance_data_it = block->draw_instance_info.begin();
-            for (std::uint32_t i = 0; i < drawn_blocks; ++i) {
-                float* offset = reinterpret_cast<float*>(idb);
-                offset[0] = static_cast<float>(instance_data_it->x);
-                offset[1] = static_cast<float>(instance_data_it->y);
-                offset[2] = static_cast<float>(instance_data_it->z);
-                offset[3] = 1.0f;
-                idb += INSTANCE_STRIDE;
-                ++instance_data_it;
-            }
-            bgfx::setInstanceDataBuffer(&instance_buffer_data);
-            bgfx::setState(draw_info.state);
-            for (auto& command : block_draw_info->commands) {
-                bgfx::setVertexBuffer(0, *command.vertex_buffer);
-                bgfx::setTexture(0, *draw_info.ref_info->texture, *draw_info.ref_info->material_textures[command.material]);
-                bgfx::submit(0, *draw_info.ref_info->program);
+void Renderer::fixQualityLevel(unsigned quality_level) {
+    quality_governor.fixQualityLevel(quality_level);
+}
+
+typedef FrameArray<InstanceRecord> InstanceRecords;
+
+static bool isInstanceLess(const BlockDrawInfo* left, const BlockDrawInfo* right) {
+    return std::less<const BlockDrawInfo*>()(left, right);
+}
+
+// Sorted instance records of render workers, one run per worker.
+struct InstanceRuns {
+    const InstanceRecord* begin[MAX_RENDER_WORKERS];
+    const InstanceRecord* end[MAX_RENDER_WORKERS];
+    unsigned count = 0;
+
+    void add(const InstanceRecord* run_begin, const InstanceRecord* run_end) {
+        if (run_begin != run_end) {
+            begin[count] = run_begin;
+            end[count] = run_end;
+            ++count;
+        }
+    }
+    std::uint32_t getInstanceCount() const {
+        std::uint32_t result = 0;
+        for (unsigned i = 0; i < count; ++i) {
+            result += static_cast<std::uint32_t>(end[i] - begin[i]);
+        }
+        return result;
+    }
+};
+
+// Draws instances of one block from runs of all workers. Instances are split into several instance buffers if it is required,
+// the instances which do not fit into the transient buffer memory are counted as truncated.
+static void drawBlockInstances(bgfx::Encoder* encoder, DrawInfo draw_info, const InstanceRuns& runs, DrawCounters& counters) {
+    const BlockDrawInfo* block_draw_info = runs.begin[0]->draw_info;
+    if (!block_draw_info->mesh.isValid()) {
+        return;
+    }
+    constexpr std::uint16_t INSTANCE_STRIDE = 16;
+    unsigned run = 0;
+    const InstanceRecord* instance_data_it = runs.begin[0];
+    std::uint32_t remaining_blocks = runs.getInstanceCount();
+    while (remaining_blocks > 0) {
+        const std::uint32_t requested_blocks = std::min(remaining_blocks, MAX_INSTANCES_PER_SUBMIT);
+        // Workers allocate from the same transient buffer concurrently, so the available size may already
+        // be taken by another worker. Only the allocated number of instances is written.
+        bgfx::InstanceDataBuffer instance_buffer_data;
+        bgfx::allocInstanceDataBuffer(&instance_buffer_data, requested_blocks, INSTANCE_STRIDE);
+        const std::uint32_t drawn_blocks = instance_buffer_data.num;
+        if (drawn_blocks == 0) {
+            counters.truncated_instances += remaining_blocks;
+            return;
+        }
+        auto idb = reinterpret_cast<std::uint8_t*>(instance_buffer_data.data);
+        for (std::uint32_t i = 0; i < drawn_blocks; ++i) {
+            while (instance_data_it == runs.end[run]) {
+                instance_data_it = runs.begin[++run];
             }
-            block->draw_instance_info.clear();
+            float* offset = reinterpret_cast<float*>(idb);
+            offset[0] = static_cast<float>(instance_data_it->position.x);
+            offset[1] = static_cast<float>(instance_data_it->position.y);
+            offset[2] = static_cast<float>(instance_data_it->position.z);
+            offset[3] = 1.0f;
+            idb += INSTANCE_STRIDE;
+            ++instance_data_it;
         }
+        remaining_blocks -= drawn_blocks;
+        // Submit discards all bindings, so they are set again for every instance buffer.
+        // All materials are drawn by one call, the material layer is taken from the vertex.
+        encoder->setInstanceDataBuffer(&instance_buffer_data);
+        encoder->setState(draw_info.state);
+        encoder->setVertexBuffer(0, block_draw_info->mesh.getVertexBuffer(), block_draw_info->mesh.getStart(), block_draw_info->mesh.getCount());
+        encoder->setTexture(0, *draw_info.ref_info->texture, *draw_info.ref_info->material_texture_array);
+        encoder->setTexture(1, *draw_info.ref_info->material_layers, *draw_info.ref_info->material_layer_table);
+        encoder->submit(0, *draw_info.ref_info->program);
+        ++counters.draw_calls;
     }
 }
 
-template <std::uint8_t Level>
-struct BlockInstanceRenderInfo;
+static void sortInstances(InstanceRecord* begin, InstanceRecord* end) {
+    std::sort(begin, end, [](const InstanceRecord& left, const InstanceRecord& right) {
+        return isInstanceLess(left.draw_info, right.draw_info);
+    });
+}
 
-template <>
-struct BlockInstanceRenderInfo<0> {
-    std::list<Block<0>::Ptr> Blocks;
-};
+// Returns the first instance which block is not less than the given block.
+static const InstanceRecord* findInstances(const InstanceRecord* begin, const InstanceRecord* end, const BlockDrawInfo* draw_info) {
+    return std::lower_bound(begin, end, draw_info, [](const InstanceRecord& record, const BlockDrawInfo* value) {
+        return isInstanceLess(record.draw_info, value);
+    });
+}
 
-template <std::uint8_t Level>
-struct BlockInstanceRenderInfo : public BlockInstanceRenderInfo<Level - 1> {
-    std::list<typename Block<Level>::Ptr> Blocks;
-};
+// Draws sorted runs of instances, instances of the same block from all runs are drawn by the same instanced draw calls.
+static DrawCounters drawInstances(bgfx::Encoder* encoder, DrawInfo draw_info, const InstanceRuns& runs) {
+    GKM_PROFILE_ZONE("drawInstances");
+    DrawCounters counters;
+    InstanceRuns cursors = runs;
+    while (true) {
+        const BlockDrawInfo* block_draw_info = nullptr;
+        for (unsigned i = 0; i < cursors.count; ++i) {
+            if (cursors.begin[i] != cursors.end[i] && (!block_draw_info || isInstanceLess(cursors.begin[i]->draw_info, block_draw_info))) {
+                block_draw_info = cursors.begin[i]->draw_info;
+            }
+        }
+        if (!block_draw_info) {
+            break;
+        }
+        InstanceRuns block_runs;
+        for (unsigned i = 0; i < cursors.count; ++i) {
+            const InstanceRecord* first = cursors.begin[i];
+            while (cursors.begin[i] != cursors.end[i] && cursors.begin[i]->draw_info == block_draw_info) {
+                ++cursors.begin[i];
+            }
+            block_runs.add(first, cursors.begin[i]);
+        }
+        drawBlockInstances(encoder, draw_info, block_runs, counters);
+        ++counters.block_types;
+    }
+    return counters;
+}
 
+// Blocks are borrowed by raw pointers, the render thread holds the world reader while workers collect instances.
 template <std::uint8_t Level>
 void collectInstances(
-    BlockInstanceRenderInfo<Level>& info,
-    const typename Block<Level>::Ptr& block,
-    BlockIndex base_x, BlockIndex base_y, BlockIndex base_z) {
+    std::vector<InstanceRecord>& records,
+    bool& complete,
+    Block<Level>* block,
+    BlockIndex base_x, BlockIndex base_y, BlockIndex base_z,
+    std::uint8_t lod_level) {
     if (!block) {
         return;
     }
@@ -237,43 +407,94 @@ void collectInstances(
         // The entire block is empty, skip it
         return;
     }
-    if (block->draw_info.read()) {
-        BlockMaterial material = block->material;
-        if (block->draw_instance_info.size() == 0) {
-            // First time
-            info.Blocks.push_back(block);
+    if (Level == lod_level && !block->entire) {
+        auto lod_draw_info = block->lod_draw_info.read();
+        if (lod_draw_info) {
+            records.push_back({ lod_draw_info.get(), { base_x, base_y, base_z } });
+            return;
         }
-        block->draw_instance_info.push_back({ base_x, base_y, base_z });
+        // Draw the full detail while the level of detail mesh is being built.
+        complete = false;
+    }
+    auto draw_info = block->draw_info.read();
+    if (draw_info) {
+        records.push_back({ draw_info.get(), { base_x, base_y, base_z } });
     } else {
+        if (Level <= 1 || block->entire) {
+            // This block is going to be tessellated, so it will be drawn in another way later.
+            complete = false;
+        }
+        if constexpr (Level > STANDARD_LEVEL) {
+            // Paged out children are not waited for, the level of detail mesh is drawn until they are paged in.
+            if (!block->entire && !block->areChildrenResident()) {
+                postBlockPageIn(Level, block);
+                complete = false;
+                auto lod_draw_info = block->lod_draw_info.read();
+                if (lod_draw_info) {
+                    records.push_back({ lod_draw_info.get(), { base_x, base_y, base_z } });
+                    return;
+                }
+            }
+        }
         if constexpr (Level > 0) {
             constexpr BlockIndex SUB_BLOCK_SIZE = Block<Level - 1>::SIZE;
             for (BlockIndex z = 0; z < NESTED_BLOCKS; ++z) {
                 for (BlockIndex y = 0; y < NESTED_BLOCKS; ++y) {
                     for (BlockIndex x = 0; x < NESTED_BLOCKS; ++x) {
-                        Block<Level - 1>::Ptr child = block->children[z * NESTED_BLOCKS * NESTED_BLOCKS + y * NESTED_BLOCKS + x].read();
-                        collectInstances<Level - 1>(info, child, base_x + x * SUB_BLOCK_SIZE, base_y + y * SUB_BLOCK_SIZE, base_z + z * SUB_BLOCK_SIZE);
+                        // Children are frozen and released only after readers, so they are borrowed without reference counting.
+                        Block<Level - 1>* child = block->children[z * NESTED_BLOCKS * NESTED_BLOCKS + y * NESTED_BLOCKS + x].get();
+                        collectInstances<Level - 1>(records, complete, child, base_x + x * SUB_BLOCK_SIZE, base_y + y * SUB_BLOCK_SIZE, base_z + z * SUB_BLOCK_SIZE, lod_level);
                     }
                 }
             }
         }
         TessellationRequest<Level> tessellation_request;
-        tessellation_request.block = block;
+        tessellation_request.block = std::static_pointer_cast<Block<Level>>(block->shared_from_this());
         postBlockTessellationRequest(tessellation_request);
     }
 }
 
-template <std::uint8_t Level>
-void drawInstances(DrawInfo draw_info, const BlockInstanceRenderInfo<Level>& info) {
-    drawInstances<Level>(draw_info, info.Blocks);
-    if constexpr (Level > 0) {
-        drawInstances<Level - 1>(draw_info, info);
+// Returns the highest level which level of detail mesh cells are smaller than lod_cell_pixels on the screen,
+// or 0 if full detail is required. pixels_per_unit is the projected size of one unit at distance of one unit.
+static std::uint8_t selectLodLevel(float distance, float pixels_per_unit, float lod_cell_pixels) {
+    if (distance < 1.0f) {
+        return 0;
+    }
+    const float cell_scale = pixels_per_unit / distance;
+    if (Block<2>::SIZE * cell_scale < lod_cell_pixels) {
+        return 3;
+    }
+    if (Block<1>::SIZE * cell_scale < lod_cell_pixels) {
+        return 2;
+    }
+    if (Block<0>::SIZE * cell_scale < lod_cell_pixels) {
+        return 1;
     }
+    return 0;
 }
 
-template struct BlockInstanceRenderInfo<TOP_LEVEL>;
-typedef BlockInstanceRenderInfo<TOP_LEVEL> TopLevelBlockInstanceRenderInfo;
+// Collects instances of the top-level block again, returns true if heap memory was allocated.
+static bool collectEntryInstances(VisibleSetEntry& entry, std::uint64_t generation, std::uint64_t eviction_generation) {
+    GKM_PROFILE_ZONE("collectInstances");
+    const std::size_t records_capacity = entry.records.capacity();
+    entry.records.clear();
+    bool complete = true;
+    collectInstances<TOP_LEVEL>(entry.records, complete, entry.block.get(), entry.x * TopLevelBlock::SIZE, entry.y * TopLevelBlock::SIZE, entry.z * TopLevelBlock::SIZE, entry.lod_level);
+    entry.complete = complete;
+    entry.generation = generation;
+    entry.eviction_generation = eviction_generation;
+    entry.dirty = false;
+    return entry.records.capacity() != records_capacity;
+}
 
 void Renderer::render(int window_width, int window_height) {
+    GKM_PROFILE_ZONE("Renderer::render");
+    const auto frame_start = std::chrono::steady_clock::now();
+    const QualitySettings quality = quality_governor.getSettings();
+    const BlockIndex view_distance = std::min(quality.view_distance, MAX_VIEW_DISTANCE);
+    const float lod_cell_pixels = quality.lod_cell_pixels;
+    setTessellationBudget(quality.tessellation_budget);
+
     auto player_coordinates = g_player_coordinates.read();
     double player_direction = player_coordinates.direction * GKM_GRAD_TO_RAD;
     double player_pitch = player_coordinates.pitch * GKM_GRAD_TO_RAD;
@@ -282,27 +503,29 @@ void Renderer::render(int window_width, int window_height) {
     double at_y_pos = player_coordinates.y + cos(player_direction) * xy_offset;
     double at_z_pos = sin(player_pitch) * 100.0;
 
+    // Used by the view matrix and by level of detail selection.
+    const bx::Vec3 eye(
+        static_cast<float>(player_coordinates.x),
+        static_cast<float>(player_coordinates.y),
+        PLAYER_EYE_Z);
     float view_matrix[16];
     bx::mtxLookAt(
         view_matrix,
-        bx::Vec3(
-            static_cast<float>(player_coordinates.x),
-            static_cast<float>(player_coordinates.y),
-            TopLevelBlock::SIZE + 160.0f),
+        eye,
         bx::Vec3(
             static_cast<float>(at_x_pos),
             static_cast<float>(at_y_pos),
-            static_cast<float>(at_z_pos) + TopLevelBlock::SIZE + 160.0f), // Player's eyes height is 160 centimeters
+            static_cast<float>(at_z_pos) + eye.z),
         bx::Vec3(0.0f, 0.0f, 1.0f),
         bx::Handedness::Right
     );
 
     float projection_matrix[16];
     bx::mtxProj(
-        projection_matrix, 30.0f,
+        projection_matrix, FIELD_OF_VIEW,
         static_cast<float>(window_width) / static_cast<float>(window_height),
         1.0f,
-        VIEW_DISTANCE * TopLevelBlock::SIZE,
+        view_distance * TopLevelBlock::SIZE,
         bgfx::getCaps()->homogeneousDepth,
         bx::Handedness::Right
     );
@@ -318,7 +541,6 @@ void Renderer::render(int window_width, int window_height) {
     const bgfx::Caps* caps = bgfx::getCaps();
     const bool instancing_supported = 0 != (BGFX_CAPS_INSTANCING & caps->supported);
     if (instancing_supported) {
-        TopLevelBlockInstanceRenderInfo info;
         BlockIndex local_x;
         BlockIndex local_y;
         BlockIndex local_z;
@@ -327,17 +549,17 @@ void Renderer::render(int window_width, int window_height) {
         const BlockIndex block_x_index = coordToBlockIndex<TOP_LEVEL>(player_x, local_x);
         const BlockIndex block_y_index = coordToBlockIndex<TOP_LEVEL>(player_y, local_y);
         const BlockIndex block_z_index = coordToBlockIndex<TOP_LEVEL>(TopLevelBlock::SIZE, local_z);
-        BlockIndex start_block_x_index = block_x_index - VIEW_DISTANCE;
-        BlockIndex start_block_y_index = block_y_index - VIEW_DISTANCE;
-        BlockIndex finish_block_x_index = block_x_index + VIEW_DISTANCE;
-        BlockIndex finish_block_y_index = block_y_index + VIEW_DISTANCE;
+        BlockIndex start_block_x_index = block_x_index - view_distance;
+        BlockIndex start_block_y_index = block_y_index - view_distance;
+        BlockIndex finish_block_x_index = block_x_index + view_distance;
+        BlockIndex finish_block_y_index = block_y_index + view_distance;
 
         constexpr BlockIndex NORTH_EAST = 45;
         constexpr BlockIndex SOUTH_EAST = 135;
         constexpr BlockIndex SOUTH_WEST = 225;
         constexpr BlockIndex NORTH_WEST = 315;
 
-        // By default draw all blocks which are nearer than VIEW_DISTANCE distance.
+        // By default draw all blocks which are nearer than view distance.
         // & - means the player position
         //
         // +------+------+
@@ -394,22 +616,246 @@ void Renderer::render(int window_width, int window_height) {
             // +------+------+
         }
 
-        for (BlockIndex x = start_block_x_index; x <= finish_block_x_index; ++x) {
-            WorldLineY::Ptr cur_world_line = g_world->getLineByAbsoluteIndex(x);
-            if (cur_world_line) {
-                for (BlockIndex y = start_block_y_index; y <= finish_block_y_index; ++y) {
-                    WorldColumn::Ptr cur_world_column = cur_world_line->getColumnByAbsoluteIndex(y);
-                    if (cur_world_column) {
-                        for (BlockIndex z = 0; z < WORLD_BLOCK_HEIGHT; ++z) {
-                            TopLevelBlock::Ptr block = cur_world_column->getBlock(z);
-                            collectInstances<TOP_LEVEL>(info, block, x * TopLevelBlock::SIZE, y * TopLevelBlock::SIZE, z * TopLevelBlock::SIZE);
+        float view_projection_matrix[16];
+        bx::mtxMul(view_projection_matrix, view_matrix, projection_matrix);
+        Frustum frustum;
+        frustum.update(view_projection_matrix, caps->homogeneousDepth);
+
+        // Workers check which top-level blocks were changed or became visible and collect their instances again.
+        const std::uint64_t generation = g_draw_info_generation.load();
+        const bool view_area_changed = !has_visible_set ||
+            start_block_x_index != last_start_block_x_index ||
+            start_block_y_index != last_start_block_y_index;
+        const float eye_x = eye.x;
+        const float eye_y = eye.y;
+        const float eye_z = eye.z;
+        const float pixels_per_unit = static_cast<float>(window_height) / (2.0f * bx::tan(bx::toRad(FIELD_OF_VIEW) * 0.5f));
+        // The whole view area is taken from one world version, so changes are never seen half-applied.
+        // Visible set entries keep their blocks alive, the version itself is kept by the reader until the end of the frame.
+        WorldReader world_reader;
+        const World* world = world_reader.get();
+        // Loaded after the reader entered, so children paged out after this load are released after the frame.
+        const std::uint64_t eviction_generation = g_block_eviction_generation.load();
+
+        // The view area is split into square tiles, workers take tiles one by one.
+        const BlockIndex tiles_x = (finish_block_x_index - start_block_x_index + TRAVERSAL_TILE_SIZE) / TRAVERSAL_TILE_SIZE;
+        const BlockIndex tiles_y = (finish_block_y_index - start_block_y_index + TRAVERSAL_TILE_SIZE) / TRAVERSAL_TILE_SIZE;
+        const BlockIndex tile_count = tiles_x * tiles_y;
+        std::atomic<BlockIndex> next_tile = 0;
+        auto forEachTileEntry = [&](auto&& function) {
+            for (BlockIndex tile = next_tile++; tile < tile_count; tile = next_tile++) {
+                const BlockIndex tile_start_x = start_block_x_index + (tile % tiles_x) * TRAVERSAL_TILE_SIZE;
+                const BlockIndex tile_start_y = start_block_y_index + (tile / tiles_x) * TRAVERSAL_TILE_SIZE;
+                const BlockIndex tile_finish_x = std::min(tile_start_x + TRAVERSAL_TILE_SIZE - 1, finish_block_x_index);
+                const BlockIndex tile_finish_y = std::min(tile_start_y + TRAVERSAL_TILE_SIZE - 1, finish_block_y_index);
+                for (BlockIndex x = tile_start_x; x <= tile_finish_x; ++x) {
+                    for (BlockIndex y = tile_start_y; y <= tile_finish_y; ++y) {
+                        function(x, y);
+                    }
+                }
+            }
+        };
+
+        auto traverse = [&](unsigned worker_index) {
+            if (worker_index != 0) {
+                GKM_PROFILE_THREAD("Render worker");
+            }
+            RenderWorker& worker = *render_workers[worker_index];
+            worker.visible_set_changed = false;
+            worker.collected_blocks = 0;
+            worker.culled_blocks = 0;
+            worker.lod_blocks = 0;
+            worker.incomplete_blocks = 0;
+            worker.frame_allocations = 0;
+            forEachTileEntry([&](BlockIndex x, BlockIndex y) {
+                const WorldColumn* cur_world_column = world ? world->getColumn(x, y) : nullptr;
+                for (BlockIndex z = 0; z < WORLD_BLOCK_HEIGHT; ++z) {
+                    const TopLevelBlock::Ptr& block = cur_world_column ? cur_world_column->getBlock(z) : WorldColumn::getNullBlock();
+                    const float min_x = static_cast<float>(x * TopLevelBlock::SIZE);
+                    const float min_y = static_cast<float>(y * TopLevelBlock::SIZE);
+                    const float min_z = static_cast<float>(z * TopLevelBlock::SIZE);
+                    const float max_x = static_cast<float>((x + 1) * TopLevelBlock::SIZE);
+                    const float max_y = static_cast<float>((y + 1) * TopLevelBlock::SIZE);
+                    const float max_z = static_cast<float>((z + 1) * TopLevelBlock::SIZE);
+                    // Distance to the nearest point of the block, so the whole block gets at least the required detail
+                    const float distance_x = std::max({ min_x - eye_x, 0.0f, eye_x - max_x });
+                    const float distance_y = std::max({ min_y - eye_y, 0.0f, eye_y - max_y });
+                    const float distance_z = std::max({ min_z - eye_z, 0.0f, eye_z - max_z });
+                    const float distance = bx::sqrt(distance_x * distance_x + distance_y * distance_y + distance_z * distance_z);
+                    const std::uint8_t lod_level = selectLodLevel(distance, pixels_per_unit, lod_cell_pixels);
+
+                    VisibleSetEntry& entry = visible_set_cache.getEntry(x, y, z);
+                    const bool dirty = entry.update(x, y, z, block, generation, eviction_generation, lod_level);
+                    bool visible = false;
+                    if (block) {
+                        visible = frustum.isBoxVisible(min_x, min_y, min_z, max_x, max_y, max_z);
+                        if (!visible) {
+                            ++worker.culled_blocks;
+                        } else {
+                            // Children of visible blocks are not paged out.
+                            touchBlock(*block);
+                            if (lod_level != 0) {
+                                ++worker.lod_blocks;
+                            }
+                        }
+                    }
+                    if (visible != entry.visible || (visible && dirty)) {
+                        worker.visible_set_changed = true;
+                    }
+                    entry.visible = visible;
+                    if (!visible) {
+                        continue;
+                    }
+                    if (dirty) {
+                        if (collectEntryInstances(entry, generation, eviction_generation)) {
+                            ++worker.frame_allocations;
+                        }
+                        ++worker.collected_blocks;
+                    }
+                    if (!entry.complete) {
+                        ++worker.incomplete_blocks;
+                    }
+                }
+            });
+        };
+        worker_pool.run(traverse);
+
+        bool visible_set_changed = view_area_changed;
+        for (const auto& worker : render_workers) {
+            visible_set_changed = visible_set_changed || worker->visible_set_changed;
+        }
+        last_start_block_x_index = start_block_x_index;
+        last_start_block_y_index = start_block_y_index;
+        has_visible_set = true;
+
+        // Nothing was changed since the last frame, so the same instances are submitted again.
+        if (visible_set_changed) {
+            next_tile = 0;
+            auto gather = [&](unsigned worker_index) {
+                RenderWorker& worker = *render_workers[worker_index];
+                worker.frame_arena.reset();
+                InstanceRecords records(worker.frame_arena);
+                forEachTileEntry([&](BlockIndex x, BlockIndex y) {
+                    for (BlockIndex z = 0; z < WORLD_BLOCK_HEIGHT; ++z) {
+                        const VisibleSetEntry& entry = visible_set_cache.getEntry(x, y, z);
+                        if (entry.visible) {
+                            for (const auto& record : entry.records) {
+                                records.push_back(record);
+                            }
                         }
                     }
+                });
+                sortInstances(records.begin(), records.end());
+                worker.batch_begin = records.begin();
+                worker.batch_end = records.end();
+                worker.instances = static_cast<std::uint32_t>(records.size());
+                worker.frame_allocations += worker.frame_arena.getFrameAllocations();
+            };
+            worker_pool.run(gather);
+        }
+
+        // Every worker submits a range of blocks from sorted instances of all workers, so every block is submitted once.
+        // Bounds of the ranges are sampled from the largest run.
+        const unsigned worker_count = worker_pool.getWorkerCount();
+        const RenderWorker* largest_run = render_workers.front().get();
+        for (const auto& worker : render_workers) {
+            if (worker->instances > largest_run->instances) {
+                largest_run = worker.get();
+            }
+        }
+        const BlockDrawInfo* range_bounds[MAX_RENDER_WORKERS];
+        for (unsigned i = 0; i < worker_count; ++i) {
+            const std::size_t bound_index = static_cast<std::size_t>(largest_run->instances) * i / worker_count;
+            range_bounds[i] = largest_run->instances > 0 ? largest_run->batch_begin[bound_index].draw_info : nullptr;
+        }
+
+        auto submit = [&](unsigned worker_index) {
+            RenderWorker& worker = *render_workers[worker_index];
+            worker.draw_counters = DrawCounters();
+            InstanceRuns runs;
+            for (const auto& run_worker : render_workers) {
+                const InstanceRecord* begin = run_worker->batch_begin;
+                const InstanceRecord* end = run_worker->batch_end;
+                if (worker_index != 0) {
+                    begin = findInstances(begin, end, range_bounds[worker_index]);
+                }
+                if (worker_index + 1 != worker_count) {
+                    end = findInstances(begin, end, range_bounds[worker_index + 1]);
                 }
+                runs.add(begin, end);
+            }
+            if (runs.count == 0) {
+                return;
+            }
+            // Render thread submits by the main encoder, other workers need their own encoders.
+            bgfx::Encoder* encoder = bgfx::begin(worker_index != 0);
+            if (encoder) {
+                worker.draw_counters = drawInstances(encoder, draw_info, runs);
+                bgfx::end(encoder);
+            } else {
+                worker.draw_counters.truncated_instances = runs.getInstanceCount();
             }
+        };
+        worker_pool.run(submit);
+
+        std::uint32_t instances = 0;
+        DrawCounters draw_counters;
+        std::uint32_t collected_blocks = 0;
+        std::uint32_t culled_blocks = 0;
+        std::uint32_t lod_blocks = 0;
+        std::uint32_t incomplete_blocks = 0;
+        std::uint32_t frame_allocations = 0;
+        std::size_t frame_arena_size = 0;
+        for (auto& worker : render_workers) {
+            instances += worker->instances;
+            draw_counters.block_types += worker->draw_counters.block_types;
+            draw_counters.draw_calls += worker->draw_counters.draw_calls;
+            draw_counters.truncated_instances += worker->draw_counters.truncated_instances;
+            collected_blocks += worker->collected_blocks;
+            culled_blocks += worker->culled_blocks;
+            lod_blocks += worker->lod_blocks;
+            incomplete_blocks += worker->incomplete_blocks;
+            frame_allocations += worker->frame_allocations;
+            frame_arena_size += worker->frame_arena.getCapacity();
         }
-        drawInstances<TOP_LEVEL>(draw_info, info);
+        g_render_statistics.instances = instances;
+        g_render_statistics.block_types = draw_counters.block_types;
+        g_render_statistics.draw_calls = draw_counters.draw_calls;
+        g_render_statistics.truncated_instances = draw_counters.truncated_instances;
+        g_render_statistics.collected_blocks = collected_blocks;
+        g_render_statistics.culled_blocks = culled_blocks;
+        g_render_statistics.lod_blocks = lod_blocks;
+        g_render_statistics.incomplete_blocks = incomplete_blocks;
+        g_render_statistics.visible_set_reused = !visible_set_changed;
+        g_render_statistics.frame_allocations = frame_allocations;
+        g_render_statistics.frame_arena_size = static_cast<std::uint32_t>(frame_arena_size);
+        g_render_statistics.render_workers = worker_pool.getWorkerCount();
     }
 
-    bgfx::frame();
+    // bgfx::frame() could wait for the GPU, so the wait is not counted as CPU time of the frame.
+    const std::chrono::duration<float, std::milli> cpu_time = std::chrono::steady_clock::now() - frame_start;
+    {
+        GKM_PROFILE_ZONE("bgfx::frame");
+        bgfx::frame();
+    }
+
+    const bgfx::Stats* stats = bgfx::getStats();
+    float gpu_ms = 0.0f;
+    if (stats->gpuTimerFreq > 0) {
+        gpu_ms = static_cast<float>(static_cast<double>(stats->gpuTimeEnd - stats->gpuTimeBegin) * 1000.0 / static_cast<double>(stats->gpuTimerFreq));
+    }
+    quality_governor.update(cpu_time.count(), gpu_ms);
+    g_render_statistics.cpu_frame_ms = cpu_time.count();
+    g_render_statistics.quality_level = quality_governor.getQualityLevel();
+    g_render_statistics.view_distance = view_distance;
+    g_render_statistics.lod_cell_pixels = lod_cell_pixels;
+    g_render_statistics.tessellation_budget = quality.tessellation_budget;
+    g_render_statistics.governor_cpu_ms = quality_governor.getSmoothedCpuMs();
+    g_render_statistics.governor_gpu_ms = quality_governor.getSmoothedGpuMs();
+    g_render_statistics.governor_decision = quality_governor.getLastDecision();
+    g_render_statistics.governor_bound = quality_governor.getBound();
+
+    g_render_statistics.released_resources = g_release_queue.drain(MAX_RELEASES_PER_FRAME);
+    g_render_statistics.pending_releases = g_release_queue.getPendingCount();
+    g_render_statistics.peak_pending_releases = g_release_queue.getPeakPendingCount();
 }
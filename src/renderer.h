@@ -6,6 +6,9 @@
 #include <cstdint>
 #include <cstddef>
 #include <memory>
+#include <atomic>
+#include "quality_governor.h"
+#include "frame_pacer.h"
 #include "win_api.h"
 #include "bgfx_api.h"
 #include "shader.h"
@@ -14,5 +17,55 @@
 #include "world.h"
 #include "flat_terrain.h"
 
-void initializeRenderer(HWND hwnd);
+struct RenderStatistics {
+    // Block instances drawn during the last frame.
+    std::atomic<std::uint32_t> instances = 0;
+    // Different block types (instanced draw groups) drawn during the last frame.
+    std::atomic<std::uint32_t> block_types = 0;
+    std::atomic<std::uint32_t> draw_calls = 0;
+    // Instances which were not drawn during the last frame because the transient buffer memory was exhausted.
+    std::atomic<std::uint32_t> truncated_instances = 0;
+    // Top-level blocks which instances were collected again during the last frame.
+    std::atomic<std::uint32_t> collected_blocks = 0;
+    // Top-level blocks rejected by frustum culling during the last frame.
+    std::atomic<std::uint32_t> culled_blocks = 0;
+    // Visible top-level blocks drawn with level of detail meshes during the last frame.
+    std::atomic<std::uint32_t> lod_blocks = 0;
+    // Visible top-level blocks which still wait for tessellation, 0 means the view is fully meshed.
+    std::atomic<std::uint32_t> incomplete_blocks = 0;
+    // True if nothing was changed and instances of the previous frame were submitted again.
+    std::atomic<bool> visible_set_reused = false;
+    // Heap allocations made by instance collection during the last frame, should be 0 in steady state.
+    std::atomic<std::uint32_t> frame_allocations = 0;
+    std::atomic<std::uint32_t> frame_arena_size = 0;
+    std::atomic<std::uint32_t> render_workers = 0;
+    // Time of the last frame on the render thread from the start of the scene traversal to the end of bgfx::frame().
+    std::atomic<float> cpu_frame_ms = 0.0f;
+    // GPU resources released after the last frame and still waiting in the release queue.
+    std::atomic<std::uint32_t> released_resources = 0;
+    std::atomic<std::uint32_t> pending_releases = 0;
+    std::atomic<std::uint32_t> peak_pending_releases = 0;
+    // Current decisions of the quality governor.
+    std::atomic<std::uint32_t> quality_level = 0;
+    std::atomic<std::int32_t> view_distance = 0;
+    std::atomic<float> lod_cell_pixels = 0.0f;
+    std::atomic<std::uint32_t> tessellation_budget = 0;
+    std::atomic<float> governor_cpu_ms = 0.0f;
+    std::atomic<float> governor_gpu_ms = 0.0f;
+    std::atomic<EGovernorDecision> governor_decision = EGovernorDecision::Keep;
+    std::atomic<EFrameBound> governor_bound = EFrameBound::Cpu;
+};
+
+extern RenderStatistics g_render_statistics;
+// Intervals between frame starts, it is used only by the render thread.
+extern FrameTimeHistogram g_frame_time_histogram;
+
+void initializeRenderer(void* native_window_handle);
 void shutdownRenderer();
+
+// Headless mode renders by the Noop renderer without a window, the calling thread becomes the render thread.
+// Quality level is fixed, so results of different runs are comparable.
+void initializeHeadlessRenderer(std::uint32_t width, std::uint32_t height, unsigned quality_level);
+void renderHeadlessFrame();
+// Waits for tessellation and block operation threads, g_is_running should be false.
+void shutdownHeadlessRenderer();
@@ -3,46 +3,207 @@
 
 #pragma once
 
-#include <cassert>
 #include <cstdint>
+#include <atomic>
+#include <thread>
+#include <utility>
 #include <mutex>
 #include <condition_variable>
-#include "spin_lock.h"
+#include "queue_statistics.h"
 
+enum class EPushPolicy {
+    // Waits while the queue is full.
+    Block,
+    // Drops the request if the queue is full, the overflow is counted in the queue statistics.
+    Drop
+};
+
+// Bounded multi-producer multi-consumer queue, every cell has a sequence number (D. Vyukov's bounded MPMC queue).
+// Push and pop take no locks. Threads park on a condition variable only after a short spin,
+// and they are notified only if somebody is parked, so the mutexes are not touched while requests flow.
 template <class RequestType, std::uint32_t BufferSize = 1024>
 class RequestQueue {
-    mutable std::mutex wait_mutex;
-    mutable std::condition_variable new_requests;
-    mutable std::atomic<bool> locked_flag = false;
-    std::uint32_t head_index = 0;
-    std::uint32_t tail_index = 0;
-    std::uint32_t size = 0;
-    RequestType requests[BufferSize];
+    static_assert(BufferSize >= 2 && (BufferSize & (BufferSize - 1)) == 0, "Buffer size should be a power of two");
+
+    constexpr static std::uint32_t SPIN_COUNT = 64;
+    constexpr static std::size_t CACHE_LINE_SIZE = 64;
+
+    struct Cell {
+        std::atomic<std::uint64_t> sequence;
+        RequestType request;
+#ifdef GKM_QUEUE_STATISTICS
+        std::uint64_t push_time;
+#endif
+    };
+
+    alignas(CACHE_LINE_SIZE) std::atomic<std::uint64_t> enqueue_position = 0;
+    alignas(CACHE_LINE_SIZE) std::atomic<std::uint64_t> dequeue_position = 0;
+    alignas(CACHE_LINE_SIZE) std::atomic<std::uint32_t> parked_consumers = 0;
+    std::atomic<std::uint32_t> parked_producers = 0;
+    // Consumers lock the producer mutex to notify parked producers while they hold the consumer mutex, never vice versa.
+    std::mutex consumer_mutex;
+    std::mutex producer_mutex;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+    Cell cells[BufferSize];
+#ifdef GKM_QUEUE_STATISTICS
+    RequestQueueStatistics statistics;
+#endif
+
+    std::uint32_t getSize() const noexcept {
+        const std::uint64_t dequeue = dequeue_position.load(std::memory_order_relaxed);
+        const std::uint64_t enqueue = enqueue_position.load(std::memory_order_relaxed);
+        return enqueue > dequeue ? static_cast<std::uint32_t>(enqueue - dequeue) : 0;
+    }
+
+    bool tryPush(const RequestType& new_request) noexcept {
+        std::uint64_t position = enqueue_position.load(std::memory_order_relaxed);
+        for (;;) {
+            Cell& cell = cells[position & (BufferSize - 1)];
+            const std::uint64_t sequence = cell.sequence.load(std::memory_order_acquire);
+            if (sequence == position) {
+                if (enqueue_position.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    cell.request = new_request;
+#ifdef GKM_QUEUE_STATISTICS
+                    cell.push_time = RequestQueueStatistics::getTime();
+                    statistics.onPush(getSize());
+#endif
+                    cell.sequence.store(position + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (sequence < position) {
+                // The cell still has a request from the previous round, so the queue is full.
+                return false;
+            } else {
+                position = enqueue_position.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Wakes a parked thread up if there is any, the fence orders the preceding push or pop before the check.
+    static void notifyParked(std::atomic<std::uint32_t>& parked, std::mutex& mutex, std::condition_variable& condition) noexcept {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (parked.load(std::memory_order_relaxed) > 0) {
+            std::lock_guard lock(mutex);
+            condition.notify_all();
+        }
+    }
 
 public:
-    void waitForNewRequests(RequestType& request) noexcept {
-        std::unique_lock wait_lock(wait_mutex);
-        while (!pop(request)) {
-            new_requests.wait(wait_lock);
+    // The name identifies the queue in the queue statistics.
+#ifdef GKM_QUEUE_STATISTICS
+    explicit RequestQueue(const char* name) : statistics(name) {
+#else
+    explicit RequestQueue(const char*) {
+#endif
+        for (std::uint32_t i = 0; i < BufferSize; ++i) {
+            cells[i].sequence.store(i, std::memory_order_relaxed);
         }
     }
+    RequestQueue(const RequestQueue&) = delete;
+    RequestQueue& operator=(const RequestQueue&) = delete;
+
+    // Pops up to max_count requests without waiting, returns count of popped requests.
+    // All requests are claimed by one compare and exchange if they are ready.
+    std::uint32_t popBatch(RequestType* requests, std::uint32_t max_count) noexcept {
+        std::uint64_t position = dequeue_position.load(std::memory_order_relaxed);
+        std::uint32_t count = 0;
+        for (;;) {
+            count = 0;
+            while (count < max_count) {
+                const Cell& cell = cells[(position + count) & (BufferSize - 1)];
+                if (cell.sequence.load(std::memory_order_acquire) != position + count + 1) {
+                    break;
+                }
+                ++count;
+            }
+            if (count == 0) {
+                const Cell& cell = cells[position & (BufferSize - 1)];
+                const std::uint64_t sequence = cell.sequence.load(std::memory_order_acquire);
+                if (sequence < position + 1) {
+                    // Empty, or the producer of the first request did not finish it yet.
+                    return 0;
+                }
+                // Another consumer took the first request.
+                position = dequeue_position.load(std::memory_order_relaxed);
+                continue;
+            }
+            if (dequeue_position.compare_exchange_weak(position, position + count, std::memory_order_relaxed)) {
+                break;
+            }
+        }
+        for (std::uint32_t i = 0; i < count; ++i) {
+            Cell& cell = cells[(position + i) & (BufferSize - 1)];
+            // Moving out releases resources held by the request, for example block pointers.
+            requests[i] = std::move(cell.request);
+#ifdef GKM_QUEUE_STATISTICS
+            statistics.onPop(getSize(), cell.push_time);
+#endif
+            cell.sequence.store(position + i + BufferSize, std::memory_order_release);
+        }
+        notifyParked(parked_producers, producer_mutex, not_full);
+        return count;
+    }
     bool pop(RequestType& request) noexcept {
-        SpinLock lock(locked_flag);
-        if (size == 0) {
-            return false;
+        return popBatch(&request, 1) == 1;
+    }
+
+    // Waits until at least one request is available, returns count of popped requests.
+    std::uint32_t waitForNewRequests(RequestType* requests, std::uint32_t max_count) noexcept {
+        std::uint32_t count = 0;
+        for (std::uint32_t spin = 0; spin < SPIN_COUNT; ++spin) {
+            count = popBatch(requests, max_count);
+            if (count > 0) {
+                return count;
+            }
+            std::this_thread::yield();
         }
-        request = requests[head_index];
-        head_index = static_cast<std::uint32_t>((head_index + 1) % BufferSize);
-        --size;
-        return true;
+        std::unique_lock lock(consumer_mutex);
+        parked_consumers.fetch_add(1, std::memory_order_seq_cst);
+        // Pairs with the fence of notifyParked: either the producer sees this consumer parked or the check below sees its request.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        while ((count = popBatch(requests, max_count)) == 0) {
+#ifdef GKM_QUEUE_STATISTICS
+            statistics.onBlockingWait();
+#endif
+            not_empty.wait(lock);
+        }
+        parked_consumers.fetch_sub(1, std::memory_order_relaxed);
+        return count;
+    }
+    void waitForNewRequests(RequestType& request) noexcept {
+        waitForNewRequests(&request, 1);
     }
-    void push(const RequestType& new_request) noexcept {
-        SpinLock lock(locked_flag);
-        assert(size < BufferSize);
-        requests[tail_index] = new_request;
-        tail_index = (tail_index + 1) % BufferSize;
-        ++size;
-        lock.unlock();
-        new_requests.notify_one();
+
+    // Returns false if the request was dropped.
+    bool push(const RequestType& new_request, EPushPolicy policy = EPushPolicy::Block) noexcept {
+        if (!tryPush(new_request)) {
+            if (policy == EPushPolicy::Drop) {
+#ifdef GKM_QUEUE_STATISTICS
+                statistics.onOverflow();
+#endif
+                return false;
+            }
+            bool pushed = false;
+            for (std::uint32_t spin = 0; spin < SPIN_COUNT && !pushed; ++spin) {
+                std::this_thread::yield();
+                pushed = tryPush(new_request);
+            }
+            if (!pushed) {
+                std::unique_lock lock(producer_mutex);
+                parked_producers.fetch_add(1, std::memory_order_seq_cst);
+                // Pairs with the fence of notifyParked: either the consumer sees this producer parked or the push below sees the freed cell.
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                while (!tryPush(new_request)) {
+#ifdef GKM_QUEUE_STATISTICS
+                    statistics.onBlockingWait();
+#endif
+                    not_full.wait(lock);
+                }
+                parked_producers.fetch_sub(1, std::memory_order_relaxed);
+            }
+        }
+        notifyParked(parked_consumers, consumer_mutex, not_empty);
+        return true;
     }
 };
@@ -0,0 +1,67 @@
+// Copyright 2023 Petr Petrov. All rights reserved.
+// License: https://github.com/PetrPPetrov/gkm-local/blob/main/LICENSE
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+#include <type_traits>
+#include "spin_lock.h"
+
+// Sequence lock for small trivially copyable read-mostly values.
+// The writer never waits, readers never block the writer and retry if the value was changed during the read.
+// The value is kept in atomic words, so concurrent reading and writing is not a data race.
+// Only one thread should write at a time.
+template <class ValueType>
+class SeqLocked {
+    static_assert(std::is_trivially_copyable_v<ValueType>, "SeqLocked requires a trivially copyable type");
+
+    constexpr static std::size_t WORD_COUNT = (sizeof(ValueType) + sizeof(std::uint64_t) - 1) / sizeof(std::uint64_t);
+
+    // Odd while the value is being written
+    std::atomic<std::uint32_t> sequence = 0;
+    std::atomic<std::uint64_t> words[WORD_COUNT];
+
+public:
+    SeqLocked() noexcept {
+        write(ValueType());
+    }
+    SeqLocked(const ValueType& init) noexcept {
+        write(init);
+    }
+    SeqLocked(const SeqLocked&) = delete;
+    SeqLocked& operator=(const SeqLocked&) = delete;
+
+    ValueType read() const noexcept {
+        std::uint64_t buffer[WORD_COUNT];
+        for (;;) {
+            const std::uint32_t sequence_before = sequence.load(std::memory_order_acquire);
+            if (sequence_before & 1) {
+                cpuPause();
+                continue;
+            }
+            for (std::size_t i = 0; i < WORD_COUNT; ++i) {
+                buffer[i] = words[i].load(std::memory_order_relaxed);
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (sequence.load(std::memory_order_relaxed) == sequence_before) {
+                break;
+            }
+        }
+        ValueType result;
+        std::memcpy(&result, buffer, sizeof(ValueType));
+        return result;
+    }
+    void write(const ValueType& new_value) noexcept {
+        std::uint64_t buffer[WORD_COUNT] = {};
+        std::memcpy(buffer, &new_value, sizeof(ValueType));
+        const std::uint32_t sequence_before = sequence.load(std::memory_order_relaxed);
+        sequence.store(sequence_before + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        for (std::size_t i = 0; i < WORD_COUNT; ++i) {
+            words[i].store(buffer[i], std::memory_order_relaxed);
+        }
+        sequence.store(sequence_before + 2, std::memory_order_release);
+    }
+};
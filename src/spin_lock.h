@@ -5,28 +5,72 @@
 
 #include <cstdint>
 #include <atomic>
+#include <thread>
+#include <typeinfo>
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#endif
+#include "lock_statistics.h"
 
 static_assert(std::atomic<bool>::is_always_lock_free);
 
+// Hints the CPU that the thread is in a spin-wait loop, it saves power and lets the sibling hyper-thread run.
+inline void cpuPause() noexcept {
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+    _mm_pause();
+#elif defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+// Test-and-test-and-set lock. Waiting threads spin on a plain load, so the cache line is not bounced between cores,
+// with exponential backoff of CPU pauses. After the backoff limit they yield the rest of their time slice.
 class SpinLock {
+    constexpr static std::uint32_t MAX_BACKOFF_PAUSES = 64;
+
     std::atomic<bool>& locked_flag;
 
-public:
-    SpinLock(std::atomic<bool>& locked_flag_) noexcept : locked_flag(locked_flag_) {
-        bool cur_locked_value = false;
+    void lockContended(SpinLockSite* site) noexcept {
+        std::uint32_t spins = 0;
+        std::uint32_t yields = 0;
+        std::uint32_t backoff_pauses = 1;
         do {
-            cur_locked_value = false;
-            if (locked_flag.compare_exchange_strong(cur_locked_value, true)) {
-                break;
+            while (locked_flag.load(std::memory_order_relaxed)) {
+                if (backoff_pauses <= MAX_BACKOFF_PAUSES) {
+                    for (std::uint32_t i = 0; i < backoff_pauses; ++i) {
+                        cpuPause();
+                    }
+                    backoff_pauses *= 2;
+                    ++spins;
+                } else {
+                    std::this_thread::yield();
+                    ++yields;
+                }
             }
-        } while (cur_locked_value); // Spin (wait) in loop while locked_flag is still locked.
+        } while (locked_flag.exchange(true, std::memory_order_acquire));
+        if (site) {
+            site->onContendedAcquired(spins, yields);
+        }
     }
-    ~SpinLock() noexcept {
-        locked_flag = false;
+
+public:
+    // Site is GKM_SPIN_LOCK_SITE("name") or nullptr, contention is counted per site.
+    SpinLock(std::atomic<bool>& locked_flag_, SpinLockSite* site = nullptr) noexcept : locked_flag(locked_flag_) {
+        if (!locked_flag.exchange(true, std::memory_order_acquire)) {
+            if (site) {
+                site->onAcquired();
+            }
+            return;
+        }
+        lockContended(site);
     }
-    void unlock() noexcept {
-        locked_flag = false;
+    ~SpinLock() noexcept {
+        locked_flag.store(false, std::memory_order_release);
     }
+    SpinLock(const SpinLock&) = delete;
+    SpinLock& operator=(const SpinLock&) = delete;
 };
 
 template <class ValueType>
@@ -34,6 +78,11 @@ class SpinLocked {
     mutable std::atomic<bool> locked_flag = false;
     ValueType value;
 
+    // All values of the same type share one site, for example, all children pointers of one block level.
+    static SpinLockSite* getSite() noexcept {
+        return GKM_SPIN_LOCK_SITE(typeid(ValueType).name());
+    }
+
 public:
     SpinLocked() noexcept {
         value = ValueType();
@@ -42,11 +91,11 @@ public:
         value = init;
     }
     ValueType read() const noexcept {
-        SpinLock lock(locked_flag);
+        SpinLock lock(locked_flag, getSite());
         return value;
     }
     void write(const ValueType& new_value) noexcept {
-        SpinLock lock(locked_flag);
+        SpinLock lock(locked_flag, getSite());
         value = new_value;
     }
 };
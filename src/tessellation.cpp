@@ -3,12 +3,26 @@
 
 #include <cstdint>
 #include <thread>
+#include <chrono>
+#include <limits>
+#include <vector>
 #include "main.h"
 #include "world.h"
 #include "request_queue.h"
+#include "profiler.h"
+#include "draw_info.h"
+#include "block_mesh.h"
 #include "tessellation.h"
 
-constexpr std::uint32_t TESSELLATION_REQUEST_BUFFER_SIZE = WORLD_BLOCK_SIZE_X * WORLD_BLOCK_HEIGHT * WORLD_BLOCK_HEIGHT;
+std::atomic<std::uint64_t> g_draw_info_generation = 0;
+
+// Unlimited until the first frame
+static std::atomic<std::int32_t> g_tessellation_tokens = std::numeric_limits<std::int32_t>::max();
+
+// Power of two, it is about count of top-level blocks in the whole view area.
+constexpr std::uint32_t TESSELLATION_REQUEST_BUFFER_SIZE = 16384;
+static_assert(TESSELLATION_REQUEST_BUFFER_SIZE >= (2 * MAX_VIEW_DISTANCE) * (2 * MAX_VIEW_DISTANCE) * WORLD_BLOCK_HEIGHT);
+constexpr std::uint32_t TESSELLATION_BATCH_SIZE = 32;
 
 template <std::uint8_t Level>
 static std::unique_ptr<std::thread>& getTessellationThread() {
@@ -21,192 +35,186 @@ using TessellationRequestsQueue = RequestQueue<TessellationRequest<Level>, TESSE
 
 template <std::uint8_t Level>
 static TessellationRequestsQueue<Level>& getTessellationRequestQueue() {
-    static TessellationRequestsQueue<Level> tessellation_request_queue;
+    constexpr static const char* QUEUE_NAMES[] = { "tessellation_level0", "tessellation_level1", "tessellation_level2", "tessellation_level3" };
+    static_assert(std::size(QUEUE_NAMES) == TOP_LEVEL + 1);
+    static TessellationRequestsQueue<Level> tessellation_request_queue(QUEUE_NAMES[Level]);
     return tessellation_request_queue;
 }
 
-static inline BlockDrawInfo::Ptr getEmptyTessellation() {
-    static BlockDrawInfo::Ptr empty_tessellation = nullptr;
-    if (!empty_tessellation) {
-        empty_tessellation = std::make_shared<BlockDrawInfo>();
-    }
-    return empty_tessellation;
+static inline void setDrawInfo(BlockBase& block, const BlockDrawInfo::Ptr& draw_info) {
+    block.draw_info.write(draw_info);
+    ++g_draw_info_generation;
 }
 
-template <BlockIndex Size>
-void addSimpleCube(BgfxVertex* vbo, unsigned& vbo_index, BlockIndex base_x, BlockIndex base_y, BlockIndex base_z) {
-    constexpr static BlockIndex SIZE = Size;
-    constexpr static BlockIndex coords[8][3] = {
-        { 0, 0, 0 },
-        { 1, 0, 0 },
-        { 1, 1, 0 },
-        { 0, 1, 0 },
-        { 0, 0, 1 },
-        { 1, 0, 1 },
-        { 1, 1, 1 },
-        { 0, 1, 1 }
-    };
-    constexpr static std::int16_t indices[12][5] = {
-        { 0, 3, 1,  1, 2 },
-        { 3, 2, 1,  1, 2 },
-        { 4, 5, 7,  1, 2 },
-        { 7, 5, 6,  1, 2 },
-        { 0, 1, 4,  1, 3 },
-        { 4, 1, 5,  1, 3 },
-        { 1, 2, 5,  2, 3 },
-        { 5, 2, 6,  2, 3 },
-        { 2, 3, 6, -1, 3 },
-        { 3, 7, 6, -1, 3 },
-        { 3, 0, 4, -2, 3 },
-        { 3, 4, 7, -2, 3 }
-    };
-    constexpr static std::int16_t TEX_COORD_SIZE = static_cast<std::int16_t>(SIZE * TEX_COORD_RATIO);
+static inline void setLodDrawInfo(BlockBase& block, const BlockDrawInfo::Ptr& lod_draw_info) {
+    block.lod_draw_info.write(lod_draw_info);
+    ++g_draw_info_generation;
+}
 
-    const std::int16_t offsets[3] = {
-        (base_x % StandardBlock::SIZE) * TEX_COORD_RATIO,
-        (base_y % StandardBlock::SIZE) * TEX_COORD_RATIO,
-        (base_z % StandardBlock::SIZE) * TEX_COORD_RATIO,
-    };
+void setTessellationBudget(std::uint32_t meshes_per_frame) {
+    g_tessellation_tokens = static_cast<std::int32_t>(meshes_per_frame);
+}
 
-    for (unsigned i = 0; i < std::size(indices); ++i) {
-        std::uint16_t u_index = std::abs(indices[i][3]) - 1;
-        std::uint16_t v_index = std::abs(indices[i][4]) - 1;
-        for (unsigned j = 0; j < 3; ++j) {
-            vbo[vbo_index].x = static_cast<float>(base_x + coords[indices[i][j]][0] * SIZE);
-            vbo[vbo_index].y = static_cast<float>(base_y + coords[indices[i][j]][1] * SIZE);
-            vbo[vbo_index].z = static_cast<float>(base_z + coords[indices[i][j]][2] * SIZE);
-            std::int16_t u = coords[indices[i][j]][u_index] * TEX_COORD_SIZE;
-            std::int16_t v = coords[indices[i][j]][v_index] * TEX_COORD_SIZE;
-            if (indices[i][3] > 0) {
-                u += offsets[u_index];
-            } else {
-                u = TEXTURE_SIZE - u - offsets[u_index];
-            }
-            if (indices[i][4] > 0) {
-                v += offsets[v_index];
-            } else {
-                v = TEXTURE_SIZE - v - offsets[v_index];
-            }
-            vbo[vbo_index].u = u;
-            vbo[vbo_index].v = v;
-            vbo[vbo_index].offset_u_mode = indices[i][3];
-            vbo[vbo_index].offset_v_mode = indices[i][4];
-            ++vbo_index;
+// Waits for the tessellation budget, allocates the mesh and uploads the vertices written by the builder.
+// Vertex memory is allocated only for a valid range, the range is not valid if the mesh heap is full.
+template <class Builder>
+static MeshRange uploadMesh(std::uint32_t vertex_count, const Builder& builder) {
+    while (g_tessellation_tokens.fetch_sub(1) <= 0) {
+        g_tessellation_tokens.fetch_add(1);
+        if (!g_is_running) {
+            break;
         }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
     }
+    MeshRange mesh = g_mesh_heap->allocate(vertex_count);
+    if (mesh.isValid()) {
+        const bgfx::Memory* vertex_buffer = bgfx::alloc(static_cast<std::uint32_t>(sizeof(BgfxVertex) * vertex_count));
+        builder(reinterpret_cast<BgfxVertex*>(vertex_buffer->data));
+        bgfx::update(mesh.getVertexBuffer(), mesh.getStart(), vertex_buffer);
+    }
+    return mesh;
 }
 
-template <std::uint16_t Level>
-void tessellateBySimpleCube(const typename Block<Level>::Ptr block) {
-    const bgfx::Memory* vertex_buffer = bgfx::alloc(static_cast<std::uint32_t>(sizeof(BgfxVertex) * 6 * 2 * 3));
-    auto vbo = reinterpret_cast<BgfxVertex*>(vertex_buffer->data);
-    unsigned vbo_index = 0;
+static inline BlockDrawInfo::Ptr getEmptyTessellation() {
+    static BlockDrawInfo::Ptr empty_tessellation = nullptr;
+    if (!empty_tessellation) {
+        empty_tessellation = std::make_shared<BlockDrawInfo>();
+    }
+    return empty_tessellation;
+}
 
-    addSimpleCube<Block<Level>::SIZE>(vbo, vbo_index, 0, 0, 0);
+// Returns false if the mesh heap is full, the block is not tessellated then.
+template <std::uint16_t Level>
+bool tessellateBySimpleCube(const typename Block<Level>::Ptr block) {
+    MeshRange mesh = uploadMesh(VERTICES_PER_CUBE, [&](BgfxVertex* vbo) {
+        unsigned vbo_index = 0;
+        addSimpleCube<Block<Level>::SIZE>(vbo, vbo_index, 0, 0, 0, block->material);
+    });
+    if (!mesh.isValid()) {
+        return false;
+    }
 
-    MaterialDrawInfo entire_material_draw_info;
-    entire_material_draw_info.material = block->material;
-    entire_material_draw_info.vertex_buffer = makeBgfxSharedPtr(bgfx::createVertexBuffer(vertex_buffer, BgfxVertex::ms_layout));
     auto block_draw_info = std::make_shared<BlockDrawInfo>();
-    block_draw_info->commands.push_back(std::move(entire_material_draw_info));
-    block->draw_info.write(block_draw_info);
+    block_draw_info->mesh = std::move(mesh);
+    block_draw_info->mesh_memory = MemoryRecord(g_memory_statistics.levels[Level].vertex_bytes, sizeof(BgfxVertex) * VERTICES_PER_CUBE);
+    setDrawInfo(*block, block_draw_info);
+    return true;
 }
 
 template <std::uint8_t Level>
-void tessellateBlock(const typename Block<Level>::Ptr block) {
-    std::uint32_t count_per_material[MATERIAL_MAX] = { 0 };
-    for (unsigned z = 0; z < Block<Level>::SIZE; ++z) {
-        for (unsigned y = 0; y < Block<Level>::SIZE; ++y) {
-            for (unsigned x = 0; x < Block<Level>::SIZE; ++x) {
-                BlockMaterial cur_material = block->getMaterial(x, y, z);
-                if (cur_material != 0) {
-                    ++count_per_material[cur_material];
-                }
-            }
-        }
+bool tessellateBlock(const typename Block<Level>::Ptr block) {
+    const std::uint32_t block_count = countBlockCubes<Level>(*block);
+    if (block_count == 0) {
+        setDrawInfo(*block, getEmptyTessellation());
+        return true;
     }
 
-    const bgfx::Memory* vertex_buffers[MATERIAL_MAX] = { nullptr };
-    BgfxVertex* vbos[MATERIAL_MAX] = { nullptr };
-    for (unsigned cur_material = 1; cur_material < MATERIAL_MAX; ++cur_material) {
-        const auto cur_block_count = count_per_material[cur_material];
-        if (cur_block_count > 0) {
-            const std::uint32_t triangle_count = cur_block_count * 12;
-            const std::uint32_t vertex_count = triangle_count * 3;
-            const bgfx::Memory* vertex_buffer = bgfx::alloc(static_cast<std::uint32_t>(sizeof(BgfxVertex) * vertex_count));
-            vertex_buffers[cur_material] = vertex_buffer;
-            vbos[cur_material] = reinterpret_cast<BgfxVertex*>(vertex_buffer->data);
-        }
+    const std::uint32_t vertex_count = block_count * VERTICES_PER_CUBE;
+    MeshRange mesh = uploadMesh(vertex_count, [&](BgfxVertex* vbo) {
+        buildBlockMesh<Level>(*block, vbo);
+    });
+    if (!mesh.isValid()) {
+        return false;
     }
 
-    unsigned vbo_indices[MATERIAL_MAX] = { 0 };
-    for (unsigned z = 0; z < Block<Level>::SIZE; ++z) {
-        for (unsigned y = 0; y < Block<Level>::SIZE; ++y) {
-            for (unsigned x = 0; x < Block<Level>::SIZE; ++x) {
-                BlockMaterial cur_material = block->getMaterial(x, y, z);
-                if (cur_material != 0) {
-                    addSimpleCube<1>(vbos[cur_material], vbo_indices[cur_material], x, y, z);
-                }
-            }
-        }
+    auto block_draw_info = std::make_shared<BlockDrawInfo>();
+    block_draw_info->mesh = std::move(mesh);
+    block_draw_info->mesh_memory = MemoryRecord(g_memory_statistics.levels[Level].vertex_bytes, sizeof(BgfxVertex) * vertex_count);
+    setDrawInfo(*block, block_draw_info);
+    return true;
+}
+
+// Builds one cube per child from the representative materials of children.
+template <std::uint8_t Level>
+bool tessellateLod(const typename Block<Level>::Ptr block) {
+    const std::uint32_t cell_count = countLodCubes<Level>(*block);
+    if (cell_count == 0) {
+        setLodDrawInfo(*block, getEmptyTessellation());
+        return true;
     }
 
-    auto block_draw_info = std::make_shared<BlockDrawInfo>();
-    for (unsigned cur_material = 1; cur_material < MATERIAL_MAX; ++cur_material) {
-        if (count_per_material[cur_material] > 0) {
-            MaterialDrawInfo material_draw_info;
-            material_draw_info.material = static_cast<BlockMaterial>(cur_material);
-            material_draw_info.vertex_buffer = makeBgfxSharedPtr(bgfx::createVertexBuffer(vertex_buffers[cur_material], BgfxVertex::ms_layout));
-            block_draw_info->commands.push_back(std::move(material_draw_info));
-        }
+    const std::uint32_t vertex_count = cell_count * VERTICES_PER_CUBE;
+    MeshRange mesh = uploadMesh(vertex_count, [&](BgfxVertex* vbo) {
+        buildLodMesh<Level>(*block, vbo);
+    });
+    if (!mesh.isValid()) {
+        return false;
     }
-    block->draw_info.write(block_draw_info);
+
+    auto lod_draw_info = std::make_shared<BlockDrawInfo>();
+    lod_draw_info->mesh = std::move(mesh);
+    lod_draw_info->mesh_memory = MemoryRecord(g_memory_statistics.levels[Level].lod_vertex_bytes, sizeof(BgfxVertex) * vertex_count);
+    setLodDrawInfo(*block, lod_draw_info);
+    return true;
 }
 
 template <std::uint8_t Level>
 void processTessellationRequest(const TessellationRequest<Level>& request) {
+    GKM_PROFILE_ZONE("processTessellationRequest");
     BlockMaterial material = request.block->material;
     auto& block = request.block;
+    bool tessellated = true;
     if (!block->draw_info.read()) {
         if (block->entire) {
             if (block->material == 0) {
                 // Add empty tessellation.
-                block->draw_info.write(getEmptyTessellation());
+                setDrawInfo(*block, getEmptyTessellation());
             } else {
                 // Simple tessellation by cube.
-                tessellateBySimpleCube<Level>(block);
+                tessellated = tessellateBySimpleCube<Level>(block);
             }
         } else {
             if constexpr (Level > 0) {
+                // Level of detail mesh is cheap, so build it first to show far blocks early
+                if (!block->lod_draw_info.read()) {
+                    tessellated = tessellateLod<Level>(block);
+                }
+                // Paged out children are requested by the renderer when they are paged in.
                 for (std::int32_t i = 0; i < Block<Level>::CHILDREN_COUNT; ++i) {
                     TessellationRequest<Level - 1> new_request;
-                    new_request.block = block->children[i].read();
-                    postBlockTessellationRequest(new_request);
+                    new_request.block = block->children[i].lock();
+                    if (new_request.block) {
+                        postBlockTessellationRequest(new_request);
+                    }
                 }
             }
             if constexpr (Level <= 1) {
-                tessellateBlock<Level>(block);
+                tessellated = tessellateBlock<Level>(block) && tessellated;
             }
         }
     }
+    if (!tessellated) {
+        // The mesh heap is full, the renderer draws level of detail meanwhile and requests the block again after meshes are freed.
+        block->tessellation_request = false;
+    }
 }
 
 template <std::uint8_t Level>
 static void tessellationThread() {
-    SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN);
+    beginBackgroundThread();
+    constexpr static const char* THREAD_NAMES[] = { "Tessellation level 0", "Tessellation level 1", "Tessellation level 2", "Tessellation level 3" };
+    static_assert(std::size(THREAD_NAMES) == TOP_LEVEL + 1);
+    GKM_PROFILE_THREAD(THREAD_NAMES[Level]);
 
+    auto& queue = getTessellationRequestQueue<Level>();
+    std::vector<TessellationRequest<Level>> requests(TESSELLATION_BATCH_SIZE);
     while (g_is_running) {
-        TessellationRequest<Level> request;
-        getTessellationRequestQueue<Level>().waitForNewRequests(request);
-        do {
-            if (!g_is_running || request.finish) {
-                return;
+        std::uint32_t count = queue.waitForNewRequests(requests.data(), TESSELLATION_BATCH_SIZE);
+        while (count > 0) {
+            for (std::uint32_t i = 0; i < count; ++i) {
+                if (!g_is_running || requests[i].finish) {
+                    return;
+                }
+                --g_memory_statistics.levels[Level].pending_tessellations;
+                processTessellationRequest<Level>(requests[i]);
+                // Do not hold the block until the batch is overwritten.
+                requests[i].block = nullptr;
             }
-            processTessellationRequest<Level>(request);
-        } while (getTessellationRequestQueue<Level>().pop(request));
+            count = queue.popBatch(requests.data(), TESSELLATION_BATCH_SIZE);
+        }
     }
 
-    SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_END);
+    endBackgroundThread();
 }
 
 template <std::uint8_t Level>
@@ -238,31 +246,22 @@ void finishTessellationThreads() {
 template <std::uint8_t Level>
 void postBlockTessellationRequest(const TessellationRequest<Level>& request) {
     if (request.finish) {
-        getTessellationRequestQueue<Level>().push(request);
+        // Full queue means that the thread is busy, it checks g_is_running after every request.
+        getTessellationRequestQueue<Level>().push(request, EPushPolicy::Drop);
         return;
     }
-    if (!request.block->tessellation_request) {
-        request.block->tessellation_request = true;
-        getTessellationRequestQueue<Level>().push(request);
+    // Several render workers could request the same block, so only the first request is posted.
+    if (!request.block->tessellation_request.exchange(true)) {
+        ++g_memory_statistics.levels[Level].pending_tessellations;
+        if (!getTessellationRequestQueue<Level>().push(request, EPushPolicy::Drop)) {
+            // The queue is full, the renderer requests the block again later.
+            --g_memory_statistics.levels[Level].pending_tessellations;
+            request.block->tessellation_request = false;
+        }
     }
 }
 
-template <std::uint8_t Level>
-struct PostBlockTessellationRequstInstantiation;
-
-template <>
-struct PostBlockTessellationRequstInstantiation<0> {
-    static void instantiate() {
-        postBlockTessellationRequest<0>(TessellationRequest<0>());
-    }
-};
-
-template <std::uint8_t Level>
-struct PostBlockTessellationRequstInstantiation {
-    static void instantiate() {
-        postBlockTessellationRequest<Level>(TessellationRequest<Level>());
-        PostBlockTessellationRequstInstantiation<Level - 1>::instantiate();
-    }
-};
-
-template struct PostBlockTessellationRequstInstantiation<TOP_LEVEL>;
+template void postBlockTessellationRequest<0>(const TessellationRequest<0>& request);
+template void postBlockTessellationRequest<1>(const TessellationRequest<1>& request);
+template void postBlockTessellationRequest<2>(const TessellationRequest<2>& request);
+template void postBlockTessellationRequest<3>(const TessellationRequest<3>& request);
@@ -3,6 +3,8 @@
 
 #pragma once
 
+#include <cstdint>
+#include <atomic>
 #include "block.h"
 
 template <std::uint8_t Level>
@@ -11,6 +13,12 @@ struct TessellationRequest {
     typename Block<Level>::Ptr block;
 };
 
+// Incremented every time when some block gets its draw info.
+extern std::atomic<std::uint64_t> g_draw_info_generation;
+
+// Limits count of meshes which tessellation threads upload until the next call, the render thread calls it every frame.
+void setTessellationBudget(std::uint32_t meshes_per_frame);
+
 void startTessellationThreads();
 void finishTessellationThreads();
 
@@ -8,6 +8,8 @@
 #include <stdexcept>
 #include "turbojpeg.h"
 #include "fnv_hash.h"
+#include "profiler.h"
+#include "memory_statistics.h"
 #include "texture_cache.h"
 
 struct TurboJpegHandleHolder {
@@ -26,6 +28,39 @@ private:
     tjhandle tj_handle;
 };
 
+std::vector<std::uint8_t> TextureCache::decodeJpegRgba(const std::vector<std::uint8_t>& data, int& image_width, int& image_height) {
+    GKM_PROFILE_ZONE("decodeJpegRgba");
+    TurboJpegHandleHolder decompressor(tjInitDecompress());
+    int image_jpeg_subsamp = 0;
+    int image_color_space = 0;
+    int error_code = tjDecompressHeader3(
+        decompressor,
+        &data[0], static_cast<unsigned long>(data.size()),
+        &image_width, &image_height, &image_jpeg_subsamp, &image_color_space);
+    if (error_code) {
+        throw std::runtime_error("Can not decompressed Jpeg header");
+    }
+    if (image_width == 0 || image_height == 0) {
+        throw std::runtime_error("Jpeg image is empty");
+    }
+    if (image_width > MAX_TEXTURE_SIZE) {
+        throw std::runtime_error("Jpeg image is too wide");
+    }
+    if (image_height > MAX_TEXTURE_SIZE) {
+        throw std::runtime_error("Jpeg image is too tall");
+    }
+    std::vector<std::uint8_t> rgba8_buffer(static_cast<size_t>(image_width) * static_cast<size_t>(image_height) * 4);
+    error_code = tjDecompress2(
+        decompressor,
+        &data[0], static_cast<unsigned long>(data.size()),
+        &rgba8_buffer[0],
+        image_width, 0, image_height, TJPF_RGBA, 0);
+    if (error_code) {
+        throw std::runtime_error("Can not decompressed Jpeg image data");
+    }
+    return rgba8_buffer;
+}
+
 BgfxTexturePtr TextureCache::loadJpegRgbTexture(const std::vector<std::uint8_t>& data, const std::string& file_name) {
     // TODO: throw an exception if texture could not be loaded or use some default texture image
 
@@ -160,6 +195,7 @@ BgfxTexturePtr TextureCache::loadJpegRgbTexture(const std::vector<std::uint8_t>&
         output->m_data,
         output->m_size
     );
+    addMemory(g_memory_statistics.texture_bytes, output->m_size);
     BgfxTexturePtr result_texture = makeBgfxSharedPtr(bgfx::createTexture2D(
         static_cast<std::uint16_t>(output->m_width),
         static_cast<std::uint16_t>(output->m_height),
@@ -176,32 +212,107 @@ BgfxTexturePtr TextureCache::loadJpegRgbTexture(const std::vector<std::uint8_t>&
 
 TextureCache::TextureCache(const std::string& texture_cache_dir_) : texture_cache_dir(texture_cache_dir_) {}
 
+std::string TextureCache::getFileName(std::uint16_t texture_id) const {
+    std::stringstream file_name_in_cache;
+    file_name_in_cache << texture_cache_dir << "/" << std::setw(8) << std::setfill('0') << texture_id << ".jpg";
+    return file_name_in_cache.str();
+}
+
+bool TextureCache::readTextureFile(const std::string& file_name, std::vector<std::uint8_t>& buffer) const {
+    std::ifstream input_file(file_name, std::ifstream::binary);
+    if (!input_file) {
+        return false;
+    }
+    input_file.seekg(0, input_file.end);
+    std::size_t length = input_file.tellg();
+    input_file.seekg(0, input_file.beg);
+    if (length == 0) {
+        return false;
+    }
+    buffer.resize(length);
+    input_file.read(reinterpret_cast<char*>(&buffer[0]), length);
+    return true;
+}
+
 TextureInfo TextureCache::getTexture(std::uint16_t texture_id) {
     auto find_it = id_to_texture_info.find(texture_id);
     if (find_it == id_to_texture_info.end()) {
         TextureInfo result;
-        std::stringstream file_name_in_cache;
-        file_name_in_cache << texture_cache_dir << "/" << std::setw(8) << std::setfill('0') << texture_id << ".jpg";
-
-        std::ifstream input_file(file_name_in_cache.str(), std::ifstream::binary);
-        if (input_file) {
-            input_file.seekg(0, input_file.end);
-            std::size_t length = input_file.tellg();
-            input_file.seekg(0, input_file.beg);
-
-            if (length > 0) {
-                std::vector<std::uint8_t> buffer(length);
-                input_file.read(reinterpret_cast<char*>(&buffer[0]), length);
-                input_file.close();
-
-                FnvHash fnv_hash;
-                fnv_hash.update(&buffer[0], length);
-                result.texture_hash = fnv_hash.getHash();
-                result.texture_id = texture_id;
-                result.bgfx_texture = loadJpegRgbTexture(buffer, file_name_in_cache.str());
-            }
+        const std::string file_name = getFileName(texture_id);
+        std::vector<std::uint8_t> buffer;
+        if (readTextureFile(file_name, buffer)) {
+            FnvHash fnv_hash;
+            fnv_hash.update(&buffer[0], buffer.size());
+            result.texture_hash = fnv_hash.getHash();
+            result.texture_id = texture_id;
+            result.bgfx_texture = loadJpegRgbTexture(buffer, file_name);
         }
         find_it = id_to_texture_info.emplace(texture_id, result).first;
     }
     return find_it->second;
 }
+
+TextureArrayInfo TextureCache::loadTextureArray(const std::vector<std::uint16_t>& texture_ids, std::uint16_t layer_size) {
+    GKM_PROFILE_ZONE("loadTextureArray");
+    TextureArrayInfo result;
+    std::vector<std::vector<std::uint8_t>> layers;
+    for (auto texture_id : texture_ids) {
+        std::vector<std::uint8_t> buffer;
+        if (!readTextureFile(getFileName(texture_id), buffer)) {
+            continue;
+        }
+        int image_width = 0;
+        int image_height = 0;
+        std::vector<std::uint8_t> rgba = decodeJpegRgba(buffer, image_width, image_height);
+        while (image_width > layer_size && image_height > layer_size) {
+            bimg::imageRgba8Downsample2x2(
+                &rgba[0],
+                static_cast<std::uint32_t>(image_width),
+                static_cast<std::uint32_t>(image_height),
+                1,
+                static_cast<std::uint32_t>(image_width) * 4,
+                static_cast<std::uint32_t>(image_width / 2) * 4,
+                &rgba[0]
+            );
+            image_width /= 2;
+            image_height /= 2;
+        }
+        if (image_width != layer_size || image_height != layer_size) {
+            throw std::runtime_error("Texture size does not match texture array layer size");
+        }
+        result.layer_texture_ids.push_back(texture_id);
+        layers.push_back(std::move(rgba));
+    }
+    if (layers.empty()) {
+        return result;
+    }
+
+    result.bgfx_texture = makeBgfxSharedPtr(bgfx::createTexture2D(
+        layer_size,
+        layer_size,
+        true,
+        static_cast<std::uint16_t>(layers.size()),
+        bgfx::TextureFormat::RGBA8,
+        0,
+        nullptr
+    ));
+    for (std::uint16_t layer = 0; layer < layers.size(); ++layer) {
+        std::vector<std::uint8_t>& rgba = layers[layer];
+        std::uint32_t mip_size = layer_size;
+        for (std::uint8_t mip = 0; mip_size > 0; ++mip) {
+            const std::uint32_t mip_memory_size = mip_size * mip_size * 4;
+            bgfx::updateTexture2D(
+                *result.bgfx_texture, layer, mip, 0, 0,
+                static_cast<std::uint16_t>(mip_size), static_cast<std::uint16_t>(mip_size),
+                bgfx::copy(&rgba[0], mip_memory_size)
+            );
+            result.memory_size += mip_memory_size;
+            if (mip_size > 1) {
+                bimg::imageRgba8Downsample2x2(&rgba[0], mip_size, mip_size, 1, mip_size * 4, mip_size / 2 * 4, &rgba[0]);
+            }
+            mip_size /= 2;
+        }
+    }
+    addMemory(g_memory_statistics.texture_bytes, result.memory_size);
+    return result;
+}
@@ -16,15 +16,29 @@ struct TextureInfo {
     std::uint64_t texture_hash = 0;
 };
 
+// All layers of a texture array have the same size and mips.
+struct TextureArrayInfo {
+    BgfxTexturePtr bgfx_texture;
+    // Texture id of every layer
+    std::vector<std::uint16_t> layer_texture_ids;
+    std::uint32_t memory_size = 0;
+};
+
 class TextureCache {
     static const int MAX_TEXTURE_SIZE = 4096;
     BgfxTexturePtr loadJpegRgbTexture(const std::vector<std::uint8_t>& data, const std::string& file_name);
+    std::vector<std::uint8_t> decodeJpegRgba(const std::vector<std::uint8_t>& data, int& image_width, int& image_height);
+    std::string getFileName(std::uint16_t texture_id) const;
+    bool readTextureFile(const std::string& file_name, std::vector<std::uint8_t>& buffer) const;
 
 public:
     typedef std::unique_ptr<TextureCache> Ptr;
 
     TextureCache(const std::string& texture_cache_dir);
     TextureInfo getTexture(std::uint16_t texture_id);
+    // Loads the existing textures from texture_ids into one RGBA8 texture array with layer_size x layer_size layers.
+    // Bigger textures are downsampled, smaller textures are not supported.
+    TextureArrayInfo loadTextureArray(const std::vector<std::uint16_t>& texture_ids, std::uint16_t layer_size);
 
 private:
     const std::string texture_cache_dir;
@@ -1,9 +1,103 @@
 // Copyright 2023 Petr Petrov. All rights reserved.
 // License: https://github.com/PetrPPetrov/gkm-local/blob/main/LICENSE
 
+#include <cstring>
+#include <algorithm>
+#include <vector>
 #include "main.h"
+#include "renderer.h"
+#include "mesh_heap.h"
+#include "fnv_hash.h"
+#include "profiler.h"
+#include "memory_statistics.h"
+#include "queue_statistics.h"
+#include "lock_statistics.h"
+#include "world_streaming.h"
+#include "world_store.h"
+#include "block_paging.h"
 #include "user_interface.h"
 
+constexpr std::uint64_t PROFILER_TIMELINE_NS = 100'000'000;
+
+static ImU32 getZoneColor(const char* name) {
+    FnvHash fnv_hash;
+    fnv_hash.update(reinterpret_cast<const std::uint8_t*>(name), std::strlen(name));
+    const std::uint64_t hash = fnv_hash.getHash();
+    return IM_COL32(96 + hash % 128, 96 + (hash >> 8) % 128, 96 + (hash >> 16) % 128, 255);
+}
+
+// Nanoseconds from the timeline begin, absolute times are subtracted as integers,
+// so zones are not quantized by float precision after long uptime. Zones started before the timeline begin are clamped to it.
+static float getTimelineOffset(std::uint64_t time_ns, std::uint64_t timeline_begin) {
+    return time_ns > timeline_begin ? static_cast<float>(time_ns - timeline_begin) : 0.0f;
+}
+
+// Draws zones of the last 100 ms, one row per thread and one lane per nesting depth.
+static void drawProfilerWindow(int window_width, int window_height) {
+    static std::vector<ProfileThreadEvents> threads;
+    static std::uint64_t timeline_end = 0;
+    static bool paused = false;
+
+    if (!paused) {
+        timeline_end = getProfileTime();
+        collectProfileEvents(threads, timeline_end > PROFILER_TIMELINE_NS ? timeline_end - PROFILER_TIMELINE_NS : 0);
+    }
+    const std::uint64_t timeline_begin = timeline_end > PROFILER_TIMELINE_NS ? timeline_end - PROFILER_TIMELINE_NS : 0;
+
+    const float profiler_height = 400.0f;
+    ImGui::SetNextWindowSize(ImVec2(static_cast<float>(window_width), profiler_height), ImGuiCond_Once);
+    ImGui::SetNextWindowPos(ImVec2(0.0f, window_height - profiler_height), ImGuiCond_Once);
+    bool profiler_open = true;
+    ImGui::Begin("Profiler", &profiler_open);
+    g_profiler_open = profiler_open;
+
+    ImGui::Checkbox("Pause", &paused);
+    ImGui::SameLine();
+    if (ImGui::Button("Dump trace")) {
+        g_profiler_dump_requested = true;
+    }
+    ImGui::SameLine();
+    ImGui::Text("Last %llu ms, F9 writes trace.json", static_cast<unsigned long long>(PROFILER_TIMELINE_NS / 1'000'000));
+
+    ImDrawList* draw_list = ImGui::GetWindowDrawList();
+    const float lane_height = ImGui::GetTextLineHeightWithSpacing();
+    const float label_width = 160.0f;
+    const ImVec2 origin = ImGui::GetCursorScreenPos();
+    const float timeline_width = std::max(ImGui::GetContentRegionAvail().x - label_width, 1.0f);
+    const float ns_to_pixels = timeline_width / PROFILER_TIMELINE_NS;
+    float row_y = origin.y;
+    for (const auto& thread : threads) {
+        std::uint32_t max_depth = 0;
+        for (const auto& event : thread.events) {
+            max_depth = std::max(max_depth, event.depth);
+        }
+        draw_list->AddText(ImVec2(origin.x, row_y), IM_COL32(255, 255, 255, 255), thread.name);
+        const float timeline_x = origin.x + label_width;
+        draw_list->PushClipRect(ImVec2(timeline_x, row_y), ImVec2(timeline_x + timeline_width, row_y + (max_depth + 1) * lane_height), true);
+        for (const auto& event : thread.events) {
+            if (event.end_ns < timeline_begin) {
+                continue;
+            }
+            const float start_x = timeline_x + getTimelineOffset(event.start_ns, timeline_begin) * ns_to_pixels;
+            const float end_x = std::max(timeline_x + getTimelineOffset(event.end_ns, timeline_begin) * ns_to_pixels, start_x + 1.0f);
+            const float top_y = row_y + event.depth * lane_height;
+            const ImVec2 zone_min(start_x, top_y);
+            const ImVec2 zone_max(end_x, top_y + lane_height - 1.0f);
+            draw_list->AddRectFilled(zone_min, zone_max, getZoneColor(event.name));
+            if (end_x - start_x > 40.0f) {
+                draw_list->AddText(ImVec2(start_x + 2.0f, top_y), IM_COL32(0, 0, 0, 255), event.name);
+            }
+            if (ImGui::IsMouseHoveringRect(zone_min, zone_max)) {
+                ImGui::SetTooltip("%s\n%.3f ms", event.name, (event.end_ns - event.start_ns) / 1'000'000.0);
+            }
+        }
+        draw_list->PopClipRect();
+        row_y += (max_depth + 1) * lane_height + 4.0f;
+    }
+    ImGui::Dummy(ImVec2(label_width + timeline_width, row_y - origin.y));
+    ImGui::End();
+}
+
 void drawUserInterface(int window_width, int window_height, bool main_menu_open) {
     imguiBeginFrame(
         g_current_mouse_x,
@@ -22,7 +116,7 @@ void drawUserInterface(int window_width, int window_height, bool main_menu_open)
 
     if (main_menu_open) {
         const float menu_width = 300.0f;
-        const float menu_height = 240.0f;
+        const float menu_height = 500.0f;
         ImGui::SetNextWindowSize(ImVec2(menu_width, menu_height), ImGuiCond_Once);
         ImGui::SetNextWindowPos(ImVec2((window_width - menu_width) / 2.0f, (window_height - menu_height) / 2.0f), ImGuiCond_Once);
 
@@ -46,11 +140,234 @@ void drawUserInterface(int window_width, int window_height, bool main_menu_open)
             ImGui::Text("GPU mem: %s / %s", tmp0, tmp1);
         }
 
+        ImGui::Text("Instances %u, block types %u, draw calls %u"
+                    , g_render_statistics.instances.load()
+                    , g_render_statistics.block_types.load()
+                    , g_render_statistics.draw_calls.load()
+        );
+        ImGui::Text("Truncated instances %u", g_render_statistics.truncated_instances.load());
+        ImGui::Text("Visible set %s, collected %u, culled %u, LOD %u"
+                    , g_render_statistics.visible_set_reused ? "reused" : "rebuilt"
+                    , g_render_statistics.collected_blocks.load()
+                    , g_render_statistics.culled_blocks.load()
+                    , g_render_statistics.lod_blocks.load()
+        );
+        ImGui::Text("Frame allocations %u (arena %u KB), workers %u"
+                    , g_render_statistics.frame_allocations.load()
+                    , g_render_statistics.frame_arena_size.load() / 1024
+                    , g_render_statistics.render_workers.load()
+        );
+        const MeshHeapStatistics mesh_heap_statistics = g_mesh_heap->getStatistics();
+        ImGui::Text("Mesh heap %u pages, %llu / %llu KB, %u meshes"
+                    , mesh_heap_statistics.pages
+                    , mesh_heap_statistics.used_vertices * sizeof(BgfxVertex) / 1024
+                    , mesh_heap_statistics.capacity_vertices * sizeof(BgfxVertex) / 1024
+                    , mesh_heap_statistics.allocations
+        );
+        ImGui::Text("Mesh heap free ranges %u, fragmentation %.2f, failed allocations %u"
+                    , mesh_heap_statistics.free_ranges
+                    , mesh_heap_statistics.fragmentation
+                    , mesh_heap_statistics.failed_allocations
+        );
+        ImGui::Text("Releases %u, pending %u (peak %u)"
+                    , g_render_statistics.released_resources.load()
+                    , g_render_statistics.pending_releases.load()
+                    , g_render_statistics.peak_pending_releases.load()
+        );
+        const EGovernorDecision governor_decision = g_render_statistics.governor_decision;
+        ImGui::Text("Quality %u (%s, %s bound), CPU %.2f ms, GPU %.2f ms"
+                    , g_render_statistics.quality_level.load()
+                    , governor_decision == EGovernorDecision::Lower ? "lowered" : governor_decision == EGovernorDecision::Raise ? "raised" : "default"
+                    , g_render_statistics.governor_bound == EFrameBound::Gpu ? "GPU" : "CPU"
+                    , g_render_statistics.governor_cpu_ms.load()
+                    , g_render_statistics.governor_gpu_ms.load()
+        );
+        ImGui::Text("View distance %d, LOD cell %.1f px, tessellation %u/frame"
+                    , g_render_statistics.view_distance.load()
+                    , g_render_statistics.lod_cell_pixels.load()
+                    , g_render_statistics.tessellation_budget.load()
+        );
+
+        ImGui::Text("Frame p50 %.1f, p95 %.1f, p99 %.1f, worst %.1f ms (%llu frames)"
+                    , g_frame_time_histogram.getPercentile(0.5f)
+                    , g_frame_time_histogram.getPercentile(0.95f)
+                    , g_frame_time_histogram.getPercentile(0.99f)
+                    , g_frame_time_histogram.getWorstMs()
+                    , static_cast<unsigned long long>(g_frame_time_histogram.getFrameCount())
+        );
+        if (ImGui::Button("Reset frame times")) {
+            g_frame_time_histogram.reset();
+        }
+        ImGui::SameLine();
+        if (ImGui::Button("Dump frame times")) {
+            g_frame_time_histogram.dump("frame_times.txt");
+        }
+
+        if (ImGui::CollapsingHeader("Memory")) {
+            for (std::uint8_t level = 0; level < BLOCK_LEVEL_COUNT; ++level) {
+                const LevelMemoryStatistics& statistics = g_memory_statistics.levels[level];
+                ImGui::Text("L%u blocks %lld, refs %lld (x%.1f), %lld KB"
+                            , static_cast<unsigned>(level)
+                            , static_cast<long long>(statistics.unique_blocks)
+                            , static_cast<long long>(statistics.referenced_blocks)
+                            , statistics.getDeduplicationRatio()
+                            , static_cast<long long>(statistics.block_bytes / 1024)
+                );
+                ImGui::Text("   cache %lld, tombstones %lld, hits %.0f%%"
+                            , static_cast<long long>(statistics.cache_entries)
+                            , static_cast<long long>(statistics.getCacheTombstones())
+                            , statistics.getCacheHitRate() * 100.0
+                );
+                ImGui::Text("   meshes %lld KB, LOD %lld KB, pending %lld"
+                            , static_cast<long long>(statistics.vertex_bytes / 1024)
+                            , static_cast<long long>(statistics.lod_vertex_bytes / 1024)
+                            , static_cast<long long>(statistics.pending_tessellations)
+                );
+            }
+            ImGui::Text("Textures %lld KB", static_cast<long long>(g_memory_statistics.texture_bytes / 1024));
+            ImGui::Text("World tiles %lld, columns %lld"
+                        , static_cast<long long>(g_memory_statistics.world_tiles)
+                        , static_cast<long long>(g_memory_statistics.world_columns)
+            );
+            if (ImGui::Button("Dump memory")) {
+                dumpMemoryStatistics("memory.json");
+            }
+        }
+
+        if (ImGui::CollapsingHeader("Streaming")) {
+            int load_radius = g_world_streaming_settings.load_radius;
+            if (ImGui::SliderInt("Load radius", &load_radius, 1, 16)) {
+                g_world_streaming_settings.load_radius = load_radius;
+            }
+            int unload_radius = g_world_streaming_settings.unload_radius;
+            if (ImGui::SliderInt("Unload radius", &unload_radius, load_radius, 32)) {
+                g_world_streaming_settings.unload_radius = unload_radius;
+            }
+            int memory_budget_mb = static_cast<int>(g_world_streaming_settings.memory_budget / (1024 * 1024));
+            if (ImGui::SliderInt("Budget MB", &memory_budget_mb, 1, 1024)) {
+                g_world_streaming_settings.memory_budget = static_cast<std::int64_t>(memory_budget_mb) * 1024 * 1024;
+            }
+            ImGui::Text("Resident tiles %u (modified %u), %lld KB, pending %u"
+                        , g_world_streaming_statistics.resident_tiles.load()
+                        , g_world_streaming_statistics.modified_tiles.load()
+                        , static_cast<long long>(g_world_streaming_statistics.resident_bytes / 1024)
+                        , g_world_streaming_statistics.pending_tiles.load()
+            );
+            ImGui::Text("Loaded %llu, evicted %llu tiles"
+                        , static_cast<unsigned long long>(g_world_streaming_statistics.loaded_tiles)
+                        , static_cast<unsigned long long>(g_world_streaming_statistics.evicted_tiles)
+            );
+        }
+
+        if (ImGui::CollapsingHeader("World store")) {
+            ImGui::Text("Stored tiles %u, block store %lld KB"
+                        , g_world_store_statistics.stored_tiles.load()
+                        , static_cast<long long>(g_world_store_statistics.block_store_bytes / 1024)
+            );
+            ImGui::Text("Loaded %llu tiles, %llu blocks"
+                        , static_cast<unsigned long long>(g_world_store_statistics.loaded_tiles)
+                        , static_cast<unsigned long long>(g_world_store_statistics.loaded_blocks)
+            );
+            ImGui::Text("Saves %llu of %llu requests, last save %.1f ms"
+                        , static_cast<unsigned long long>(g_world_store_statistics.saves)
+                        , static_cast<unsigned long long>(g_world_store_statistics.save_requests)
+                        , g_world_store_statistics.last_save_us / 1000.0
+            );
+            ImGui::Text("Written %llu tiles, %llu blocks, reused %llu blocks"
+                        , static_cast<unsigned long long>(g_world_store_statistics.written_tiles)
+                        , static_cast<unsigned long long>(g_world_store_statistics.written_blocks)
+                        , static_cast<unsigned long long>(g_world_store_statistics.reused_blocks)
+            );
+            if (g_world_store_statistics.rejected_store) {
+                ImGui::Text("The saved world could not be opened, it is kept and changes are not saved");
+            }
+            bool autosave = g_world_store_settings.autosave;
+            if (ImGui::Checkbox("Autosave", &autosave)) {
+                g_world_store_settings.autosave = autosave;
+            }
+            int autosave_period_s = g_world_store_settings.autosave_period_s;
+            if (ImGui::SliderInt("Autosave period s", &autosave_period_s, 5, 600)) {
+                g_world_store_settings.autosave_period_s = autosave_period_s;
+            }
+            if (ImGui::Button("Save world")) {
+                postWorldSave();
+            }
+        }
+
+        if (ImGui::CollapsingHeader("Paging")) {
+            bool page_out = g_block_paging_settings.page_out;
+            if (ImGui::Checkbox("Page out", &page_out)) {
+                g_block_paging_settings.page_out = page_out;
+            }
+            int memory_budget_mb = static_cast<int>(g_block_paging_settings.memory_budget / (1024 * 1024));
+            if (ImGui::SliderInt("Block budget MB", &memory_budget_mb, 16, 8192)) {
+                g_block_paging_settings.memory_budget = static_cast<std::int64_t>(memory_budget_mb) * 1024 * 1024;
+            }
+            ImGui::Text("Resident blocks %lld KB, pageable children %u"
+                        , static_cast<long long>(g_block_paging_statistics.resident_bytes / 1024)
+                        , g_block_paging_statistics.pageable_children.load()
+            );
+            ImGui::Text("Paged in %llu children by %llu requests, loaded %llu by block operations"
+                        , static_cast<unsigned long long>(g_block_paging_statistics.paged_in_children)
+                        , static_cast<unsigned long long>(g_block_paging_statistics.page_in_requests)
+                        , static_cast<unsigned long long>(g_block_paging_statistics.loaded_children)
+            );
+            ImGui::Text("Paged out %llu children by %llu evictions, last eviction %.1f ms"
+                        , static_cast<unsigned long long>(g_block_paging_statistics.paged_out_children)
+                        , static_cast<unsigned long long>(g_block_paging_statistics.evictions)
+                        , g_block_paging_statistics.last_eviction_us / 1000.0
+            );
+        }
+
+        if (ImGui::CollapsingHeader("Queues")) {
+            static std::vector<RequestQueueSnapshot> queues;
+            collectRequestQueueStatistics(queues);
+            if (queues.empty()) {
+                ImGui::TextUnformatted("Queue statistics are disabled");
+            }
+            for (const auto& queue : queues) {
+                ImGui::Text("%s: %u (max %u), waits %llu, overflows %llu"
+                            , queue.name
+                            , queue.size
+                            , queue.high_water_mark
+                            , static_cast<unsigned long long>(queue.blocking_waits)
+                            , static_cast<unsigned long long>(queue.overflows)
+                );
+                ImGui::Text("   push %.0f/s, pop %.0f/s, latency p50 %llu us, p99 %llu us"
+                            , queue.push_rate
+                            , queue.pop_rate
+                            , static_cast<unsigned long long>(queue.getLatencyPercentileUs(0.5f))
+                            , static_cast<unsigned long long>(queue.getLatencyPercentileUs(0.99f))
+                );
+            }
+        }
+
+        if (ImGui::CollapsingHeader("Locks")) {
+            static std::vector<SpinLockSiteSnapshot> lock_sites;
+            collectSpinLockStatistics(lock_sites);
+            if (lock_sites.empty()) {
+                ImGui::TextUnformatted("Spin lock statistics are disabled");
+            }
+            for (const auto& site : lock_sites) {
+                ImGui::TextUnformatted(site.name.c_str());
+                ImGui::Text("   %llu locks, %.2f%% contended, %llu spins, %llu yields"
+                            , static_cast<unsigned long long>(site.acquisitions)
+                            , site.acquisitions ? 100.0 * site.contended_acquisitions / site.acquisitions : 0.0
+                            , static_cast<unsigned long long>(site.spins)
+                            , static_cast<unsigned long long>(site.yields)
+                );
+            }
+        }
+
         if (ImGui::Button("Exit")) {
             g_is_running = false;
         }
         ImGui::End();
     }
 
+    if (g_profiler_open) {
+        drawProfilerWindow(window_width, window_height);
+    }
+
     imguiEndFrame();
 }
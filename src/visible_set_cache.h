@@ -0,0 +1,71 @@
+// Copyright 2023 Petr Petrov. All rights reserved.
+// License: https://github.com/PetrPPetrov/gkm-local/blob/main/LICENSE
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "block.h"
+#include "world.h"
+#include "draw_info.h"
+
+// The draw info is owned by a block of the entry hierarchy, so it lives as long as the entry keeps the top-level block
+// and no children of the hierarchy are paged out.
+struct InstanceRecord {
+    const BlockDrawInfo* draw_info;
+    DrawInstanceInfo position;
+};
+
+// Block instances collected for one top-level block of the world.
+struct VisibleSetEntry {
+    BlockIndex x = 0;
+    BlockIndex y = 0;
+    BlockIndex z = 0;
+    // The top-level block which instances were collected for. It also keeps the block hierarchy alive.
+    TopLevelBlock::Ptr block;
+    // Value of g_draw_info_generation at the moment of collection.
+    std::uint64_t generation = 0;
+    // Value of g_block_eviction_generation at the moment of collection.
+    std::uint64_t eviction_generation = 0;
+    // Level where level of detail meshes are used instead of children, 0 means full detail.
+    std::uint8_t lod_level = 0;
+    // False if some blocks did not have draw info yet, so instances should be collected again when new draw info appears.
+    bool complete = false;
+    bool dirty = true;
+    bool visible = false;
+    std::vector<InstanceRecord> records;
+
+    // Returns true if instances should be collected again.
+    bool update(BlockIndex x_, BlockIndex y_, BlockIndex z_, const TopLevelBlock::Ptr& block_, std::uint64_t generation_, std::uint64_t eviction_generation_, std::uint8_t lod_level_) {
+        if (x != x_ || y != y_ || z != z_ || block != block_ || lod_level != lod_level_ || eviction_generation != eviction_generation_) {
+            x = x_;
+            y = y_;
+            z = z_;
+            block = block_;
+            lod_level = lod_level_;
+            dirty = true;
+        } else if (!complete && generation != generation_) {
+            dirty = true;
+        }
+        return dirty;
+    }
+};
+
+// Toroidal grid of entries around the player. Entries are reused when the player moves.
+class VisibleSetCache {
+    BlockIndex grid_size;
+    std::vector<VisibleSetEntry> entries;
+
+    BlockIndex wrap(BlockIndex value) const {
+        BlockIndex result = value % grid_size;
+        return result < 0 ? result + grid_size : result;
+    }
+
+public:
+    VisibleSetCache(BlockIndex grid_size_) : grid_size(grid_size_), entries(static_cast<std::size_t>(grid_size_ * grid_size_ * WORLD_BLOCK_HEIGHT)) {
+    }
+
+    VisibleSetEntry& getEntry(BlockIndex x, BlockIndex y, BlockIndex z) {
+        return entries[(wrap(x) * grid_size + wrap(y)) * WORLD_BLOCK_HEIGHT + z];
+    }
+};
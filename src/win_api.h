@@ -3,6 +3,8 @@
 
 #pragma once
 
+#ifdef _WIN32
+
 #include <Windows.h>
 #include <Windowsx.h>
 
@@ -15,3 +17,32 @@
 #ifdef GetObject
 #undef GetObject
 #endif
+
+#endif
+
+// Background threads have low priority, so they do not steal time from the render thread.
+// Other platforms keep the default priority.
+inline void beginBackgroundThread() {
+#ifdef _WIN32
+    SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN);
+#endif
+}
+
+inline void endBackgroundThread() {
+#ifdef _WIN32
+    SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_END);
+#endif
+}
+
+// Default Windows timer resolution is too coarse for frame deadlines, other platforms have precise sleep.
+inline void beginPreciseTimer() {
+#ifdef _WIN32
+    timeBeginPeriod(1);
+#endif
+}
+
+inline void endPreciseTimer() {
+#ifdef _WIN32
+    timeEndPeriod(1);
+#endif
+}
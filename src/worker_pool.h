@@ -0,0 +1,94 @@
+// Copyright 2023 Petr Petrov. All rights reserved.
+// License: https://github.com/PetrPPetrov/gkm-local/blob/main/LICENSE
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// Fork-join pool of worker threads.
+// run() executes the job on every worker and returns when all workers are finished.
+// The calling thread participates in the job as worker 0.
+class WorkerPool {
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable start_condition;
+    std::condition_variable finish_condition;
+    std::uint64_t generation = 0;
+    unsigned running_workers = 0;
+    bool finishing = false;
+    void (*job_function)(void* context, unsigned worker_index) = nullptr;
+    void* job_context = nullptr;
+
+    template <class Function>
+    static void invoke(void* context, unsigned worker_index) {
+        (*static_cast<Function*>(context))(worker_index);
+    }
+
+    void workerThread(unsigned worker_index) {
+        std::uint64_t last_generation = 0;
+        std::unique_lock lock(mutex);
+        while (true) {
+            start_condition.wait(lock, [&] { return finishing || generation != last_generation; });
+            if (finishing) {
+                return;
+            }
+            last_generation = generation;
+            auto function = job_function;
+            auto context = job_context;
+            lock.unlock();
+            function(context, worker_index);
+            lock.lock();
+            if (--running_workers == 0) {
+                finish_condition.notify_one();
+            }
+        }
+    }
+
+    void dispatch(void (*function)(void*, unsigned), void* context) {
+        {
+            std::lock_guard lock(mutex);
+            job_function = function;
+            job_context = context;
+            running_workers = static_cast<unsigned>(threads.size());
+            ++generation;
+        }
+        start_condition.notify_all();
+        function(context, 0);
+        std::unique_lock lock(mutex);
+        finish_condition.wait(lock, [&] { return running_workers == 0; });
+    }
+
+public:
+    WorkerPool(unsigned thread_count) {
+        threads.reserve(thread_count);
+        for (unsigned i = 0; i < thread_count; ++i) {
+            threads.emplace_back(&WorkerPool::workerThread, this, i + 1);
+        }
+    }
+    ~WorkerPool() {
+        {
+            std::lock_guard lock(mutex);
+            finishing = true;
+        }
+        start_condition.notify_all();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    // Returns the number of workers including the calling thread.
+    unsigned getWorkerCount() const {
+        return static_cast<unsigned>(threads.size()) + 1;
+    }
+
+    template <class Function>
+    void run(Function& function) {
+        dispatch(&invoke<Function>, &function);
+    }
+};
@@ -1,41 +1,194 @@
 // Copyright 2023 Petr Petrov. All rights reserved.
 // License: https://github.com/PetrPPetrov/gkm-local/blob/main/LICENSE
 
+#include <atomic>
+#include <algorithm>
+#include <mutex>
 #include "block_operation.h"
 #include "game_logic.h"
 #include "tessellation.h"
 #include "world.h"
+#include "world_store.h"
 
-World::Ptr g_world = nullptr;
+// Owner of the current version, it is changed only by writers, initialization and shutdown.
+static World::Ptr g_world = nullptr;
+static std::atomic<const World*> g_current_world = nullptr;
+static std::mutex g_world_writer_mutex;
 
-WorldLineY::WorldLineY() {
-    for (BlockIndex x = 0; x < WORLD_BLOCK_SIZE_Y; ++x) {
-        columns.push_back(std::make_shared<WorldColumn>());
+static void publishWorld(World::Ptr new_world) {
+    World::Ptr old_world = std::move(g_world);
+    g_world = std::move(new_world);
+    g_current_world.store(g_world.get(), std::memory_order_seq_cst);
+    retireAfterReaders(std::move(old_world));
+}
+
+WorldReader::WorldReader() noexcept : world(g_current_world.load(std::memory_order_seq_cst)) {
+}
+
+// Only writers retire versions and they are serialized, so the base version is alive without an epoch guard.
+WorldWriter::WorldWriter() : writer_lock(g_world_writer_mutex), base(g_current_world.load(std::memory_order_acquire)) {
+}
+
+WorldTileBucket& WorldWriter::getOwnBucket(BlockIndex tile_x, BlockIndex tile_y) {
+    if (!changed_world) {
+        changed_world = std::make_shared<World>(*base);
+    }
+    auto& bucket = changed_world->buckets[changed_world->getBucketIndex(tile_x, tile_y)];
+    if (bucket) {
+        makeOwn(bucket);
+    } else {
+        bucket = std::make_shared<WorldTileBucket>();
+        copied.insert(bucket.get());
+    }
+    return *bucket;
+}
+
+void WorldWriter::growBuckets() {
+    World& world = *changed_world;
+    const std::vector<std::shared_ptr<WorldTileBucket>> old_buckets = std::move(world.buckets);
+    world.buckets.assign(old_buckets.size() * 2, nullptr);
+    ++world.bucket_bits;
+    for (const auto& old_bucket : old_buckets) {
+        if (old_bucket) {
+            // Own buckets of this writer are released, so their addresses could be reused by other objects.
+            copied.erase(old_bucket.get());
+            for (const auto& tile : *old_bucket) {
+                getOwnBucket(tile->getTileX(), tile->getTileY()).push_back(tile);
+            }
+        }
     }
 }
 
-World::World() {
-    for (BlockIndex x = 0; x < WORLD_BLOCK_SIZE_X; ++x) {
-        lines.push_back(std::make_shared<WorldLineY>());
+const TopLevelBlock::Ptr& WorldWriter::getBlock(BlockIndex x, BlockIndex y, BlockIndex z) {
+    if (!base) {
+        return WorldColumn::getNullBlock();
+    }
+    BlockIndex local_x;
+    BlockIndex local_y;
+    const BlockIndex tile_x = columnToTileIndex(x, local_x);
+    const BlockIndex tile_y = columnToTileIndex(y, local_y);
+    if (!(changed_world ? changed_world.get() : base)->getTile(tile_x, tile_y)) {
+        addTile(loadWorldTile(tile_x, tile_y));
+    }
+    return (changed_world ? changed_world.get() : base)->getBlock(x, y, z);
+}
+
+bool WorldWriter::setBlock(BlockIndex x, BlockIndex y, BlockIndex z, const TopLevelBlock::Ptr& block) {
+    if (!base || z < 0 || z >= WORLD_BLOCK_HEIGHT) {
+        return false;
+    }
+    BlockIndex local_x;
+    BlockIndex local_y;
+    const BlockIndex tile_x = columnToTileIndex(x, local_x);
+    const BlockIndex tile_y = columnToTileIndex(y, local_y);
+    if (!(changed_world ? changed_world.get() : base)->getTile(tile_x, tile_y)) {
+        addTile(loadWorldTile(tile_x, tile_y));
+    }
+    WorldTileBucket& bucket = getOwnBucket(tile_x, tile_y);
+    auto tile = std::find_if(bucket.begin(), bucket.end(), [&](const WorldTile::Ptr& cur_tile) {
+        return cur_tile->isAt(tile_x, tile_y);
+    });
+    makeOwn(*tile);
+    (*tile)->modified = true;
+    auto& column = (*tile)->columns[local_y * WORLD_TILE_SIZE + local_x];
+    if (column) {
+        makeOwn(column);
+    } else {
+        column = std::make_shared<WorldColumn>(*changed_world->default_column);
+        copied.insert(column.get());
+    }
+    column->setBlock(z, block);
+    return true;
+}
+
+bool WorldWriter::addTile(const WorldTile::Ptr& tile) {
+    if (!base) {
+        return false;
+    }
+    const World* world = changed_world ? changed_world.get() : base;
+    if (world->getTile(tile->getTileX(), tile->getTileY())) {
+        return false;
+    }
+    getOwnBucket(tile->getTileX(), tile->getTileY()).push_back(tile);
+    // The tile is not published yet, so it is changed in place.
+    copied.insert(tile.get());
+    ++changed_world->tile_count;
+    if (changed_world->tile_count > WORLD_TILE_MAX_BUCKET_LOAD * changed_world->buckets.size()) {
+        growBuckets();
     }
+    return true;
 }
 
-static World::Ptr createFlatWorld() {
+bool WorldWriter::markTileSaved(const WorldTile* saved_tile) {
+    if (!base) {
+        return false;
+    }
+    const BlockIndex tile_x = saved_tile->getTileX();
+    const BlockIndex tile_y = saved_tile->getTileY();
+    if ((changed_world ? changed_world.get() : base)->getTile(tile_x, tile_y) != saved_tile) {
+        return false;
+    }
+    WorldTileBucket& bucket = getOwnBucket(tile_x, tile_y);
+    auto tile = std::find_if(bucket.begin(), bucket.end(), [&](const WorldTile::Ptr& cur_tile) {
+        return cur_tile->isAt(tile_x, tile_y);
+    });
+    makeOwn(*tile);
+    (*tile)->modified = false;
+    return true;
+}
+
+bool WorldWriter::removeTile(BlockIndex tile_x, BlockIndex tile_y) {
+    if (!base) {
+        return false;
+    }
+    const World* world = changed_world ? changed_world.get() : base;
+    const WorldTile* tile = world->getTile(tile_x, tile_y);
+    if (!tile || tile->isModified()) {
+        return false;
+    }
+    WorldTileBucket& bucket = getOwnBucket(tile_x, tile_y);
+    bucket.erase(std::find_if(bucket.begin(), bucket.end(), [&](const WorldTile::Ptr& cur_tile) {
+        return cur_tile->isAt(tile_x, tile_y);
+    }));
+    --changed_world->tile_count;
+    return true;
+}
+
+void WorldWriter::publish() {
+    if (changed_world) {
+        base = changed_world.get();
+        publishWorld(std::move(changed_world));
+        changed_world = nullptr;
+        copied.clear();
+    }
+}
+
+// The world is flat, so generated columns are the default column and the generated tile has no own columns.
+static WorldTile::Ptr generateWorldTile(BlockIndex tile_x, BlockIndex tile_y) {
+    return std::make_shared<WorldTile>(tile_x, tile_y);
+}
+
+WorldTile::Ptr loadWorldTile(BlockIndex tile_x, BlockIndex tile_y) {
+    WorldStore::Ptr world_store = getWorldStore();
+    WorldTile::Ptr tile = world_store ? world_store->loadTile(tile_x, tile_y) : nullptr;
+    return tile ? tile : generateWorldTile(tile_x, tile_y);
+}
+
+static void createFlatWorld() {
     auto empty_block = getBlockCached<TOP_LEVEL>(std::make_shared<TopLevelBlock>(0));
     auto empty_block0 = getBlockCached<0>(std::make_shared<Block<0>>(0));
     auto empty_block1 = getBlockCached<1>(std::make_shared<Block<1>>(0));
     auto empty_block2 = getBlockCached<2>(std::make_shared<Block<2>>(0));
     auto ground_block = getBlockCached<TOP_LEVEL>(std::make_shared<TopLevelBlock>(1));
-    World::Ptr new_world = std::make_shared<World>();
-    for (BlockIndex x = 0; x < WORLD_BLOCK_SIZE_X; ++x) {
-        auto line = new_world->getLine(x);
-        for (BlockIndex y = 0; y < WORLD_BLOCK_SIZE_Y; ++y) {
-            auto column = line->getColumn(y);
-            column->setBlock(0, ground_block);
-            for (BlockIndex z = 1; z < WORLD_BLOCK_HEIGHT; ++z) {
-                column->setBlock(z, empty_block);
-            }
-        }
+    auto flat_column = std::make_shared<WorldColumn>();
+    flat_column->setBlock(0, ground_block);
+    for (BlockIndex z = 1; z < WORLD_BLOCK_HEIGHT; ++z) {
+        flat_column->setBlock(z, empty_block);
+    }
+    // Columns get own storage when they are changed.
+    {
+        std::lock_guard lock(g_world_writer_mutex);
+        publishWorld(std::make_shared<World>(flat_column));
     }
 
     BlockOperation brick;
@@ -117,10 +270,17 @@ static World::Ptr createFlatWorld() {
     brick3.y = Block<3>::SIZE;
     brick3.z = TopLevelBlock::SIZE;
     postBlockOperation(brick3);
-
-    return new_world;
 }
 
 void intializeWorld() {
-    g_world = createFlatWorld();
+    createFlatWorld();
+}
+
+void shutdownWorld() {
+    {
+        std::lock_guard lock(g_world_writer_mutex);
+        publishWorld(nullptr);
+    }
+    releaseAllRetired();
+    closeWorldStore();
 }
@@ -4,127 +4,286 @@
 #pragma once
 
 #include <cstdint>
-#include <atomic>
 #include <memory>
-#include <deque>
+#include <mutex>
+#include <vector>
+#include <unordered_set>
 #include "block.h"
-#include "spin_lock.h"
+#include "epoch.h"
 
 constexpr BlockIndex WORLD_BLOCK_HEIGHT = 16;
-constexpr BlockIndex WORLD_BLOCK_SIZE_X = 64;
-constexpr BlockIndex WORLD_BLOCK_SIZE_Y = 64;
-constexpr BlockIndex VIEW_DISTANCE = 8;
+// Columns are stored in square tiles of this size, a tile is created by the first change of any its column.
+constexpr BlockIndex WORLD_TILE_SIZE = 8;
+// The hash grid starts with this count of buckets, the count is doubled when buckets have more tiles than the load on average.
+constexpr std::uint32_t WORLD_TILE_INITIAL_BUCKET_BITS = 8;
+constexpr std::uint32_t WORLD_TILE_MAX_BUCKET_LOAD = 2;
+// View distance in top-level blocks is selected at runtime by the quality governor up to this value.
+constexpr BlockIndex MAX_VIEW_DISTANCE = 16;
 
-class WorldColumn {
-    static_assert(std::atomic<bool>::is_always_lock_free);
+// The world is a sparse hash grid of column tiles, it is unbounded horizontally.
+// Columns which were never changed have no storage, they are the default column of the world (generated terrain).
+// The world is published as immutable versions: tiles and columns do not change after publication,
+// and versions share all buckets, tiles and columns which were not changed.
+// Buckets have at most WORLD_TILE_MAX_BUCKET_LOAD tiles on average, so a lookup and a copy of a changed bucket do not depend on the world size.
+// A writer copies the bucket directory once per version, it is a pointer per bucket; the directory grows and never shrinks.
+// Readers access the current version by WorldReader without locks, old versions are released by epoch-based reclamation.
+// The world is changed by WorldWriter, writers are serialized, every writer publishes all its changes at once.
+// Tiles are loaded and evicted by world streaming, tiles changed by block operations are not evicted until they are saved.
+// Block operations load the tile they change if it is not resident, so saved changes are not lost.
 
-    SpinLocked<TopLevelBlock::Ptr> blocks[WORLD_BLOCK_HEIGHT];
+class WorldColumn {
+    TopLevelBlock::Ptr blocks[WORLD_BLOCK_HEIGHT];
 
 public:
     typedef std::shared_ptr<WorldColumn> Ptr;
 
-    TopLevelBlock::Ptr getBlock(BlockIndex z) const {
-        TopLevelBlock::Ptr result = nullptr;
+    WorldColumn() {
+        addMemory(g_memory_statistics.world_columns, 1);
+    }
+    // Top-level references are counted per column, columns of versions waiting for reclamation are counted too.
+    WorldColumn(const WorldColumn& other) : WorldColumn() {
+        for (BlockIndex z = 0; z < WORLD_BLOCK_HEIGHT; ++z) {
+            setBlock(z, other.blocks[z]);
+        }
+    }
+    WorldColumn& operator=(const WorldColumn&) = delete;
+    ~WorldColumn() {
+        for (BlockIndex z = 0; z < WORLD_BLOCK_HEIGHT; ++z) {
+            if (blocks[z]) {
+                --g_memory_statistics.levels[TOP_LEVEL].referenced_blocks;
+            }
+        }
+        addMemory(g_memory_statistics.world_columns, -1);
+    }
+
+    static const TopLevelBlock::Ptr& getNullBlock() {
+        static const TopLevelBlock::Ptr null_block;
+        return null_block;
+    }
+
+    // The reference is valid while the column is alive.
+    const TopLevelBlock::Ptr& getBlock(BlockIndex z) const {
         if (z >= 0 && z < WORLD_BLOCK_HEIGHT) {
-            result = blocks[z].read();
+            return blocks[z];
         }
-        return result;
+        return getNullBlock();
     }
+    // Only for columns which are not published yet.
     void setBlock(BlockIndex z, const TopLevelBlock::Ptr& block) {
         if (z >= 0 && z < WORLD_BLOCK_HEIGHT) {
-            blocks[z].write(block);
+            const std::int64_t old_reference = blocks[z] ? 1 : 0;
+            blocks[z] = block;
+            g_memory_statistics.levels[TOP_LEVEL].referenced_blocks += (block ? 1 : 0) - old_reference;
         }
     }
 };
 
-class WorldLineY {
-    static_assert(std::atomic<bool>::is_always_lock_free);
+// Tile coordinates packed into a 64-bit key.
+inline std::uint64_t getWorldTileKey(BlockIndex tile_x, BlockIndex tile_y) {
+    return (static_cast<std::uint64_t>(static_cast<std::uint32_t>(tile_x)) << 32) | static_cast<std::uint32_t>(tile_y);
+}
 
-    BlockIndex base_y = -WORLD_BLOCK_SIZE_Y / 2;
-    mutable std::atomic<bool> columns_locked;
-    std::deque<WorldColumn::Ptr> columns;
+// Returns index of the tile which contains the column, local is the index of the column inside of the tile.
+inline BlockIndex columnToTileIndex(BlockIndex value, BlockIndex& local) {
+    BlockIndex result;
+    if (value < 0) {
+        result = (value + 1) / WORLD_TILE_SIZE - 1;
+    } else {
+        result = value / WORLD_TILE_SIZE;
+    }
+    local = value - result * WORLD_TILE_SIZE;
+    return result;
+}
 
-public:
-    typedef std::shared_ptr<WorldLineY> Ptr;
+class WorldTile {
+    friend class WorldWriter;
 
-    WorldLineY();
+    BlockIndex tile_x = 0;
+    BlockIndex tile_y = 0;
+    // Indicates that a column of the tile was changed by block operations after the tile was saved,
+    // so the tile could not be loaded again.
+    bool modified = false;
+    // Null column means the default column of the world.
+    WorldColumn::Ptr columns[WORLD_TILE_SIZE * WORLD_TILE_SIZE];
 
-    WorldColumn::Ptr getColumnByAbsoluteIndex(BlockIndex y) const {
-        WorldColumn::Ptr result = nullptr;
-        SpinLock columns_lock(columns_locked);
-        const BlockIndex index_y = y - base_y;
-        if (index_y >= 0 && index_y < columns.size()) {
-            result = columns[index_y];
-        }
-        return result;
+public:
+    typedef std::shared_ptr<WorldTile> Ptr;
+
+    WorldTile(BlockIndex tile_x_, BlockIndex tile_y_) : tile_x(tile_x_), tile_y(tile_y_) {
+        addMemory(g_memory_statistics.world_tiles, 1);
     }
-    void setColumnByAbsoluteIndex(BlockIndex y, const WorldColumn::Ptr& column) {
-        SpinLock columns_lock(columns_locked);
-        const BlockIndex index_y = y - base_y;
-        if (index_y >= 0 && index_y < columns.size()) {
-            columns[index_y] = column;
+    WorldTile(const WorldTile& other) : WorldTile(other.tile_x, other.tile_y) {
+        modified = other.modified;
+        for (BlockIndex i = 0; i < WORLD_TILE_SIZE * WORLD_TILE_SIZE; ++i) {
+            columns[i] = other.columns[i];
         }
     }
-    WorldColumn::Ptr getColumn(BlockIndex index_y) const {
-        WorldColumn::Ptr result = nullptr;
-        SpinLock columns_lock(columns_locked);
-        if (index_y >= 0 && index_y < columns.size()) {
-            result = columns[index_y];
+    WorldTile& operator=(const WorldTile&) = delete;
+    ~WorldTile() {
+        addMemory(g_memory_statistics.world_tiles, -1);
+    }
+
+    bool isAt(BlockIndex x, BlockIndex y) const {
+        return tile_x == x && tile_y == y;
+    }
+    BlockIndex getTileX() const {
+        return tile_x;
+    }
+    BlockIndex getTileY() const {
+        return tile_y;
+    }
+    bool isModified() const {
+        return modified;
+    }
+    // Columns could be shared with other tiles, so it is an upper estimate.
+    std::size_t getMemorySize() const {
+        std::size_t result = sizeof(WorldTile);
+        for (const auto& column : columns) {
+            result += column ? sizeof(WorldColumn) : 0;
         }
         return result;
     }
-    void setColumn(BlockIndex index_y, const WorldColumn::Ptr& column) {
-        SpinLock columns_lock(columns_locked);
-        if (index_y >= 0 && index_y < columns.size()) {
-            columns[index_y] = column;
-        }
+
+    // Returns nullptr for the default column.
+    const WorldColumn* getColumn(BlockIndex local_x, BlockIndex local_y) const {
+        return columns[local_y * WORLD_TILE_SIZE + local_x].get();
+    }
+    // Only for tiles which are not published yet.
+    void setColumn(BlockIndex local_x, BlockIndex local_y, const WorldColumn::Ptr& column) {
+        columns[local_y * WORLD_TILE_SIZE + local_x] = column;
     }
 };
 
+// Tiles with the same hash, buckets are copied on change as tiles are.
+typedef std::vector<WorldTile::Ptr> WorldTileBucket;
+
 class World {
-    static_assert(std::atomic<bool>::is_always_lock_free);
+    friend class WorldWriter;
 
-    BlockIndex base_x = -WORLD_BLOCK_SIZE_X / 2;
-    mutable std::atomic<bool> lines_locked;
-    std::deque<WorldLineY::Ptr> lines;
+    WorldColumn::Ptr default_column;
+    // 2^bucket_bits buckets, null bucket has no tiles.
+    std::uint32_t bucket_bits = WORLD_TILE_INITIAL_BUCKET_BITS;
+    std::vector<std::shared_ptr<WorldTileBucket>> buckets;
+    std::size_t tile_count = 0;
 
 public:
     typedef std::shared_ptr<World> Ptr;
 
-    World();
+    // The default column is every column which was not changed yet.
+    explicit World(const WorldColumn::Ptr& default_column_) : default_column(default_column_), buckets(std::size_t(1) << WORLD_TILE_INITIAL_BUCKET_BITS) {
+    }
 
-    WorldLineY::Ptr getLineByAbsoluteIndex(BlockIndex x) const {
-        WorldLineY::Ptr result = nullptr;
-        SpinLock lines_lock(lines_locked);
-        const BlockIndex index_x = x - base_x;
-        if (index_x >= 0 && index_x < lines.size()) {
-            result = lines[index_x];
-        }
-        return result;
+    // Upper bits of the hashed tile key select the bucket.
+    std::size_t getBucketIndex(BlockIndex tile_x, BlockIndex tile_y) const {
+        const std::uint64_t key = getWorldTileKey(tile_x, tile_y);
+        return static_cast<std::size_t>((key * 0x9E3779B97F4A7C15ull) >> (64 - bucket_bits));
     }
-    void setLineByAbsoluteIndex(BlockIndex x, const WorldLineY::Ptr& line) {
-        SpinLock lines_lock(lines_locked);
-        const BlockIndex index_x = x - base_x;
-        if (index_x >= 0 && index_x < lines.size()) {
-            lines[index_x] = line;
+    std::size_t getBucketCount() const {
+        return buckets.size();
+    }
+    std::size_t getTileCount() const {
+        return tile_count;
+    }
+
+    template <class Function>
+    void forEachTile(Function function) const {
+        for (const auto& bucket : buckets) {
+            if (bucket) {
+                for (const auto& tile : *bucket) {
+                    function(tile);
+                }
+            }
         }
     }
-    WorldLineY::Ptr getLine(BlockIndex index_x) const {
-        WorldLineY::Ptr result = nullptr;
-        SpinLock lines_lock(lines_locked);
-        if (index_x >= 0 && index_x < lines.size()) {
-            result = lines[index_x];
+    const WorldTile* getTile(BlockIndex tile_x, BlockIndex tile_y) const {
+        const WorldTileBucket* bucket = buckets[getBucketIndex(tile_x, tile_y)].get();
+        if (bucket) {
+            for (const auto& tile : *bucket) {
+                if (tile->isAt(tile_x, tile_y)) {
+                    return tile.get();
+                }
+            }
         }
-        return result;
+        return nullptr;
+    }
+    // Every column of the world exists, the pointer is valid while the version is alive.
+    const WorldColumn* getColumn(BlockIndex x, BlockIndex y) const {
+        BlockIndex local_x;
+        BlockIndex local_y;
+        const WorldTile* tile = getTile(columnToTileIndex(x, local_x), columnToTileIndex(y, local_y));
+        const WorldColumn* column = tile ? tile->getColumn(local_x, local_y) : nullptr;
+        return column ? column : default_column.get();
+    }
+    const TopLevelBlock::Ptr& getBlock(BlockIndex x, BlockIndex y, BlockIndex z) const {
+        return getColumn(x, y)->getBlock(z);
     }
-    void setLine(BlockIndex index_x, const WorldLineY::Ptr& line) {
-        SpinLock lines_lock(lines_locked);
-        if (index_x >= 0 && index_x < lines.size()) {
-            lines[index_x] = line;
+};
+
+// Keeps the current world version alive while it exists. Readers should not keep it for long,
+// because versions retired meanwhile are not released.
+class WorldReader {
+    EpochGuard epoch_guard;
+    const World* world;
+
+public:
+    WorldReader() noexcept;
+    WorldReader(const WorldReader&) = delete;
+    WorldReader& operator=(const WorldReader&) = delete;
+
+    // Returns nullptr if the world is not initialized.
+    const World* get() const noexcept {
+        return world;
+    }
+    const TopLevelBlock::Ptr& getBlock(BlockIndex x, BlockIndex y, BlockIndex z) const {
+        return world ? world->getBlock(x, y, z) : WorldColumn::getNullBlock();
+    }
+};
+
+// Collects changes of the current world version, the first change of a bucket, a tile or a column copies it.
+// Writers wait for each other, so a writer should not live longer than one batch of changes.
+class WorldWriter {
+    std::unique_lock<std::mutex> writer_lock;
+    const World* base = nullptr;
+    World::Ptr changed_world = nullptr;
+    // Buckets, tiles and columns created by this writer, they are not published yet, so they are changed in place.
+    std::unordered_set<const void*> copied;
+
+    // Returns the own bucket for the tile.
+    WorldTileBucket& getOwnBucket(BlockIndex tile_x, BlockIndex tile_y);
+    // Doubles the count of buckets of the changed version and distributes tiles to new own buckets, tiles are shared.
+    void growBuckets();
+
+    template <class ObjectType>
+    void makeOwn(std::shared_ptr<ObjectType>& object) {
+        if (copied.count(object.get()) == 0) {
+            object = std::make_shared<ObjectType>(*object);
+            copied.insert(object.get());
         }
     }
+
+public:
+    WorldWriter();
+    WorldWriter(const WorldWriter&) = delete;
+    WorldWriter& operator=(const WorldWriter&) = delete;
+
+    // Returns the block with all changes of this writer applied.
+    // The tile of the block is loaded if it is not resident, so changes start from the saved block.
+    const TopLevelBlock::Ptr& getBlock(BlockIndex x, BlockIndex y, BlockIndex z);
+    // Returns false if the world is not initialized or z is outside of the world height.
+    bool setBlock(BlockIndex x, BlockIndex y, BlockIndex z, const TopLevelBlock::Ptr& block);
+    // Adds the loaded or generated tile, returns false if the world already has a tile at its coordinates.
+    // The tile should not be shared, it is changed in place until the writer publishes it.
+    bool addTile(const WorldTile::Ptr& tile);
+    // Clears the modified flag if the tile was not changed after it was saved, returns false otherwise.
+    bool markTileSaved(const WorldTile* saved_tile);
+    // Removes the tile if it was not modified, returns false if the tile was not removed.
+    bool removeTile(BlockIndex tile_x, BlockIndex tile_y);
+    // Makes all changes visible to readers at once, does nothing if there were no changes.
+    void publish();
 };
 
 void intializeWorld();
-
-extern World::Ptr g_world;
+// Loads the saved tile from the world store, tiles which were not saved are generated.
+WorldTile::Ptr loadWorldTile(BlockIndex tile_x, BlockIndex tile_y);
+// Should be called when the world is not used by other threads anymore.
+void shutdownWorld();
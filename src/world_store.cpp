@@ -0,0 +1,712 @@
+// Copyright 2023 Petr Petrov. All rights reserved.
+// License: https://github.com/PetrPPetrov/gkm-local/blob/main/LICENSE
+
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <thread>
+#include "main.h"
+#include "profiler.h"
+#include "world_store.h"
+
+WorldStoreSettings g_world_store_settings;
+WorldStoreStatistics g_world_store_statistics;
+
+constexpr const char* BLOCK_STORE_FILE_NAME = "blocks.gkm";
+constexpr const char* INDEX_FILE_NAME = "columns.gkm";
+constexpr const char* NEW_INDEX_FILE_NAME = "columns.gkm.new";
+// Records have representative materials since this version, so children of loaded blocks could be paged in later.
+constexpr std::uint32_t REPRESENTATIVE_MATERIAL_VERSION = 2;
+constexpr std::uint32_t STORED_BLOCK_CELLS = NESTED_BLOCKS * NESTED_BLOCKS * NESTED_BLOCKS;
+// Expired entries of loaded and persisted blocks are removed when their count grows by this value.
+constexpr std::size_t LOADED_BLOCKS_CLEANING_STEP = 4096;
+constexpr std::chrono::milliseconds SAVING_PERIOD(100);
+
+static_assert(Block<0>::MATERIAL_COUNT == STORED_BLOCK_CELLS && TopLevelBlock::CHILDREN_COUNT == STORED_BLOCK_CELLS);
+
+static std::mutex g_world_store_mutex;
+static WorldStore::Ptr g_world_store = nullptr;
+static std::string g_world_store_directory;
+static std::unique_ptr<std::thread> g_world_saving_thread = nullptr;
+static std::atomic<bool> g_world_save_requested = false;
+
+static std::string getFilePath(const std::string& directory, const char* file_name) {
+    return (std::filesystem::path(directory) / file_name).string();
+}
+
+static std::size_t getRecordSize(const StoredBlockHeader& header) {
+    const std::size_t run_size = header.level == 0 ? sizeof(StoredMaterialRun) : sizeof(StoredChildRun);
+    const std::size_t size = sizeof(StoredBlockHeader) + header.run_count * run_size;
+    return (size + 7) & ~static_cast<std::size_t>(7);
+}
+
+// Checks the header of a record which takes at most available_size bytes, the level is checked by the caller.
+static bool isValidRecordHeader(const StoredBlockHeader& header, std::uint64_t available_size) {
+    if (header.level >= BLOCK_LEVEL_COUNT || header.run_count > STORED_BLOCK_CELLS || (header.entire != 0) != (header.run_count == 0)) {
+        return false;
+    }
+    return getRecordSize(header) <= available_size;
+}
+
+static std::uint32_t getColumnCount(std::uint64_t column_mask) {
+    std::uint32_t result = 0;
+    for (; column_mask; column_mask &= column_mask - 1) {
+        ++result;
+    }
+    return result;
+}
+
+// Store files which exist but could not be opened should not be replaced by a new store.
+static bool hasStoreFiles(const std::string& directory) {
+    std::error_code error;
+    const bool has_block_store = std::filesystem::exists(getFilePath(directory, BLOCK_STORE_FILE_NAME), error);
+    if (error) {
+        return true;
+    }
+    const bool has_index = std::filesystem::exists(getFilePath(directory, INDEX_FILE_NAME), error);
+    return has_block_store || has_index || error;
+}
+
+static bool isTileLess(const StoredTile& left, const StoredTile& right) {
+    return left.tile_x < right.tile_x || (left.tile_x == right.tile_x && left.tile_y < right.tile_y);
+}
+
+WorldStore::Ptr WorldStore::open(const std::string& directory) {
+    GKM_PROFILE_ZONE("openWorldStore");
+    const std::string index_file_name = getFilePath(directory, INDEX_FILE_NAME);
+    std::ifstream index_file(index_file_name, std::ios::binary);
+    if (!index_file) {
+        return nullptr;
+    }
+    const StoredIndexHeader expected_header;
+    StoredIndexHeader header;
+    index_file.read(reinterpret_cast<char*>(&header), sizeof(header));
+    if (!index_file || std::memcmp(header.magic, expected_header.magic, sizeof(header.magic)) != 0 ||
+        header.version < MIN_WORLD_STORE_VERSION || header.version > WORLD_STORE_VERSION || header.block_store_size < sizeof(StoredBlockStoreHeader)) {
+        return nullptr;
+    }
+    // Counts are checked by the file size before anything is allocated.
+    std::error_code error;
+    const std::uint64_t index_size = std::filesystem::file_size(index_file_name, error);
+    if (error || header.column_count > index_size / sizeof(StoredColumn) ||
+        index_size != sizeof(header) + header.tile_count * sizeof(StoredTile) + header.column_count * sizeof(StoredColumn)) {
+        return nullptr;
+    }
+    auto store = std::make_shared<WorldStore>();
+    store->directory = directory;
+    store->version = header.version;
+    store->tiles.resize(header.tile_count);
+    store->columns.resize(static_cast<std::size_t>(header.column_count));
+    index_file.read(reinterpret_cast<char*>(store->tiles.data()), store->tiles.size() * sizeof(StoredTile));
+    index_file.read(reinterpret_cast<char*>(store->columns.data()), store->columns.size() * sizeof(StoredColumn));
+    if (!index_file || !std::is_sorted(store->tiles.begin(), store->tiles.end(), isTileLess)) {
+        return nullptr;
+    }
+    for (const auto& tile : store->tiles) {
+        if (tile.first_column > header.column_count || getColumnCount(tile.column_mask) > header.column_count - tile.first_column) {
+            return nullptr;
+        }
+    }
+    if (!store->block_store.open(getFilePath(directory, BLOCK_STORE_FILE_NAME), static_cast<std::size_t>(header.block_store_size))) {
+        return nullptr;
+    }
+    const StoredBlockStoreHeader expected_block_store_header;
+    const auto* block_store_header = reinterpret_cast<const StoredBlockStoreHeader*>(store->block_store.getData());
+    if (std::memcmp(block_store_header->magic, expected_block_store_header.magic, sizeof(block_store_header->magic)) != 0 ||
+        block_store_header->version != header.version) {
+        return nullptr;
+    }
+    g_world_store_statistics.stored_tiles = header.tile_count;
+    g_world_store_statistics.block_store_bytes = static_cast<std::int64_t>(header.block_store_size);
+    return store;
+}
+
+const StoredBlockHeader* WorldStore::getRecord(StoredBlockId id, std::uint8_t level) const {
+    const std::uint64_t size = block_store.getSize();
+    if (id % 8 != 0 || id < sizeof(StoredBlockStoreHeader) || id > size - sizeof(StoredBlockHeader)) {
+        return nullptr;
+    }
+    const auto* header = reinterpret_cast<const StoredBlockHeader*>(block_store.getData() + id);
+    if (header->level != level || !isValidRecordHeader(*header, size - id)) {
+        return nullptr;
+    }
+    return header;
+}
+
+const StoredTile* WorldStore::findTile(BlockIndex tile_x, BlockIndex tile_y) const {
+    StoredTile key;
+    key.tile_x = tile_x;
+    key.tile_y = tile_y;
+    auto found = std::lower_bound(tiles.begin(), tiles.end(), key, isTileLess);
+    if (found != tiles.end() && found->tile_x == tile_x && found->tile_y == tile_y) {
+        return &*found;
+    }
+    return nullptr;
+}
+
+template <std::uint8_t Level>
+typename Block<Level>::Ptr WorldStore::findLoadedBlock(StoredBlockId id) {
+    std::lock_guard lock(loaded_blocks_mutex);
+    auto found = loaded_blocks[Level].find(id);
+    if (found != loaded_blocks[Level].end()) {
+        return std::static_pointer_cast<Block<Level>>(found->second.lock());
+    }
+    return nullptr;
+}
+
+// Other worker could load the same block meanwhile, then its block is used.
+template <std::uint8_t Level>
+typename Block<Level>::Ptr WorldStore::addLoadedBlock(StoredBlockId id, const typename Block<Level>::Ptr& block) {
+    std::lock_guard lock(loaded_blocks_mutex);
+    auto& loaded = loaded_blocks[Level][id];
+    auto existing = std::static_pointer_cast<Block<Level>>(loaded.lock());
+    if (existing) {
+        return existing;
+    }
+    loaded = block;
+
+    std::size_t size = 0;
+    for (const auto& level_blocks : loaded_blocks) {
+        size += level_blocks.size();
+    }
+    if (size > loaded_blocks_cleaning_size + LOADED_BLOCKS_CLEANING_STEP) {
+        for (auto& level_blocks : loaded_blocks) {
+            for (auto it = level_blocks.begin(); it != level_blocks.end();) {
+                it = it->second.expired() ? level_blocks.erase(it) : std::next(it);
+            }
+        }
+        loaded_blocks_cleaning_size = 0;
+        for (const auto& level_blocks : loaded_blocks) {
+            loaded_blocks_cleaning_size += level_blocks.size();
+        }
+    }
+    return block;
+}
+
+// Children are loaded before their parent, loaded blocks are published as blocks of block operations are.
+template <std::uint8_t Level>
+typename Block<Level>::Ptr WorldStore::loadBlock(StoredBlockId id) {
+    if (id == NULL_STORED_BLOCK) {
+        return nullptr;
+    }
+    auto loaded = findLoadedBlock<Level>(id);
+    if (loaded) {
+        return loaded;
+    }
+    const StoredBlockHeader* header = getRecord(id, Level);
+    if (!header) {
+        return nullptr;
+    }
+    auto block = std::make_shared<Block<Level>>(header->material);
+    block->entire = header->entire != 0;
+    if (!block->entire) {
+        std::uint32_t cell = 0;
+        if constexpr (Level == 0) {
+            const auto* runs = reinterpret_cast<const StoredMaterialRun*>(header + 1);
+            for (std::uint32_t i = 0; i < header->run_count; ++i) {
+                if (runs[i].count > STORED_BLOCK_CELLS - cell) {
+                    return nullptr;
+                }
+                std::fill(block->materials + cell, block->materials + cell + runs[i].count, runs[i].material);
+                cell += runs[i].count;
+            }
+        } else {
+            const auto* runs = reinterpret_cast<const StoredChildRun*>(header + 1);
+            for (std::uint32_t i = 0; i < header->run_count; ++i) {
+                if (runs[i].count > STORED_BLOCK_CELLS - cell) {
+                    return nullptr;
+                }
+                typename Block<Level - 1>::Ptr child = nullptr;
+                BlockMaterial child_material = 0;
+                if constexpr (Level > STANDARD_LEVEL) {
+                    // Alive children are shared, other children are paged in on demand unless they are entire.
+                    const StoredBlockHeader* child_header = getRecord(runs[i].child, Level - 1);
+                    if (!child_header) {
+                        return nullptr;
+                    }
+                    child = findLoadedBlock<Level - 1>(runs[i].child);
+                    if (!child && (child_header->entire || version < REPRESENTATIVE_MATERIAL_VERSION)) {
+                        child = loadBlock<Level - 1>(runs[i].child);
+                        if (!child) {
+                            return nullptr;
+                        }
+                    }
+                    child_material = child_header->representative_material;
+                } else {
+                    child = loadBlock<Level - 1>(runs[i].child);
+                    if (!child) {
+                        return nullptr;
+                    }
+                }
+                for (std::uint32_t j = cell; j < cell + runs[i].count; ++j) {
+                    block->children[j].set(child, runs[i].child);
+                    block->lod_materials[j] = child_material;
+                }
+                cell += runs[i].count;
+            }
+        }
+        if (cell != STORED_BLOCK_CELLS) {
+            return nullptr;
+        }
+    }
+    block->updateLod();
+    block->onPublished();
+    ++g_world_store_statistics.loaded_blocks;
+    return addLoadedBlock<Level>(id, block);
+}
+
+template Block<0>::Ptr WorldStore::loadBlock<0>(StoredBlockId id);
+template Block<1>::Ptr WorldStore::loadBlock<1>(StoredBlockId id);
+template Block<2>::Ptr WorldStore::loadBlock<2>(StoredBlockId id);
+template Block<3>::Ptr WorldStore::loadBlock<3>(StoredBlockId id);
+
+WorldTile::Ptr WorldStore::loadTile(BlockIndex tile_x, BlockIndex tile_y) {
+    const StoredTile* stored_tile = findTile(tile_x, tile_y);
+    if (!stored_tile) {
+        return nullptr;
+    }
+    GKM_PROFILE_ZONE("loadStoredTile");
+    auto tile = std::make_shared<WorldTile>(tile_x, tile_y);
+    std::uint64_t column_index = stored_tile->first_column;
+    for (BlockIndex i = 0; i < WORLD_TILE_SIZE * WORLD_TILE_SIZE; ++i) {
+        if ((stored_tile->column_mask & (1ull << i)) == 0) {
+            continue;
+        }
+        const StoredColumn& stored_column = columns[static_cast<std::size_t>(column_index++)];
+        auto column = std::make_shared<WorldColumn>();
+        for (BlockIndex z = 0; z < WORLD_BLOCK_HEIGHT; ++z) {
+            auto block = loadBlock<TOP_LEVEL>(stored_column.blocks[z]);
+            if (!block && stored_column.blocks[z] != NULL_STORED_BLOCK) {
+                return nullptr;
+            }
+            column->setBlock(z, block);
+        }
+        tile->setColumn(i % WORLD_TILE_SIZE, i / WORLD_TILE_SIZE, column);
+    }
+    ++g_world_store_statistics.loaded_tiles;
+    return tile;
+}
+
+// The hash index of the store is built once by scanning record headers, records are not decoded.
+// Records after the first invalid header are not indexed, so they are never reused by saves.
+WorldStoreWriter::WorldStoreWriter(const std::string& directory_, const WorldStore::Ptr& store_) : directory(directory_), store(store_) {
+    if (!store) {
+        return;
+    }
+    GKM_PROFILE_ZONE("indexWorldStore");
+    const std::uint64_t size = store->getBlockStoreSize();
+    std::uint64_t id = sizeof(StoredBlockStoreHeader);
+    while (size - id >= sizeof(StoredBlockHeader)) {
+        const auto* header = reinterpret_cast<const StoredBlockHeader*>(store->block_store.getData() + id);
+        if (!isValidRecordHeader(*header, size - id)) {
+            break;
+        }
+        records.emplace(header->hash, id);
+        id += getRecordSize(*header);
+    }
+}
+
+std::uint64_t WorldStoreWriter::getStoreSize() const {
+    const std::uint64_t committed_size = store ? store->getBlockStoreSize() : sizeof(StoredBlockStoreHeader);
+    return committed_size + pending.size();
+}
+
+const std::uint8_t* WorldStoreWriter::getRecordData(StoredBlockId id) const {
+    const std::uint64_t committed_size = store ? store->getBlockStoreSize() : sizeof(StoredBlockStoreHeader);
+    if (id < committed_size) {
+        return store->block_store.getData() + id;
+    }
+    return pending.data() + (id - committed_size);
+}
+
+// The record is in the scratch buffer without its hash, equal records of the store are compared byte by byte.
+StoredBlockId WorldStoreWriter::writeRecord() {
+    FnvHash hash;
+    hash.update(record.data() + sizeof(FnvHash::Hash), record.size() - sizeof(FnvHash::Hash));
+    const FnvHash::Hash record_hash = hash.getHash();
+    std::memcpy(record.data(), &record_hash, sizeof(record_hash));
+    auto range = records.equal_range(record_hash);
+    for (auto it = range.first; it != range.second; ++it) {
+        const std::uint8_t* existing = getRecordData(it->second);
+        if (getRecordSize(*reinterpret_cast<const StoredBlockHeader*>(existing)) == record.size() &&
+            std::memcmp(existing, record.data(), record.size()) == 0) {
+            ++g_world_store_statistics.reused_blocks;
+            return it->second;
+        }
+    }
+    const StoredBlockId id = getStoreSize();
+    pending.insert(pending.end(), record.begin(), record.end());
+    records.emplace(record_hash, id);
+    ++g_world_store_statistics.written_blocks;
+    return id;
+}
+
+template <class RunType>
+static void appendRun(std::vector<std::uint8_t>& record, const RunType& run) {
+    const auto* bytes = reinterpret_cast<const std::uint8_t*>(&run);
+    record.insert(record.end(), bytes, bytes + sizeof(RunType));
+}
+
+template <std::uint8_t Level>
+StoredBlockId WorldStoreWriter::writeBlock(const typename Block<Level>::Ptr& block) {
+    if (!block) {
+        return NULL_STORED_BLOCK;
+    }
+    // The persisted block is alive, so its address was not reused by another block.
+    auto found = persisted_blocks.find(block.get());
+    if (found != persisted_blocks.end() && !found->second.block.expired()) {
+        return found->second.id;
+    }
+    StoredBlockHeader header;
+    header.level = Level;
+    header.entire = block->entire ? 1 : 0;
+    header.material = block->entire ? block->material : 0;
+    header.representative_material = block->representative_material;
+    if constexpr (Level == 0) {
+        record.assign(sizeof(StoredBlockHeader), 0);
+        if (!block->entire) {
+            StoredMaterialRun run;
+            for (std::uint32_t i = 0; i < STORED_BLOCK_CELLS; ++i) {
+                if (run.count > 0 && block->materials[i] != run.material) {
+                    appendRun(record, run);
+                    ++header.run_count;
+                    run.count = 0;
+                }
+                run.material = block->materials[i];
+                ++run.count;
+            }
+            appendRun(record, run);
+            ++header.run_count;
+        }
+    } else {
+        // Children use the scratch buffer, so the record is built after all of them are written.
+        // Children which have records are not visited, paged out children are not paged in.
+        StoredBlockId child_ids[STORED_BLOCK_CELLS];
+        if (!block->entire) {
+            bool new_children = false;
+            for (std::uint32_t i = 0; i < STORED_BLOCK_CELLS; ++i) {
+                child_ids[i] = block->children[i].getStoredId();
+                if (child_ids[i] == NULL_STORED_BLOCK) {
+                    child_ids[i] = writeBlock<Level - 1>(block->children[i].lock());
+                    new_children = true;
+                }
+            }
+            if (new_children) {
+                written_parents.emplace_back(block, Level);
+            }
+        }
+        record.assign(sizeof(StoredBlockHeader), 0);
+        if (!block->entire) {
+            StoredChildRun run;
+            for (std::uint32_t i = 0; i < STORED_BLOCK_CELLS; ++i) {
+                if (run.count > 0 && child_ids[i] != run.child) {
+                    appendRun(record, run);
+                    ++header.run_count;
+                    run.count = 0;
+                }
+                run.child = child_ids[i];
+                ++run.count;
+            }
+            appendRun(record, run);
+            ++header.run_count;
+        }
+    }
+    std::memcpy(record.data(), &header, sizeof(header));
+    record.resize(getRecordSize(header), 0);
+    PersistedBlock persisted_block;
+    persisted_block.block = block;
+    persisted_block.id = writeRecord();
+    persisted_blocks[block.get()] = persisted_block;
+    return persisted_block.id;
+}
+
+// Tiles of the store which are not saved again keep their columns.
+void WorldStoreWriter::keepStoreTile(const StoredTile& store_tile) {
+    saved_tiles.push_back(store_tile);
+    saved_tiles.back().first_column = saved_columns.size();
+    const std::uint32_t column_count = getColumnCount(store_tile.column_mask);
+    for (std::uint32_t i = 0; i < column_count; ++i) {
+        saved_columns.push_back(store->columns[static_cast<std::size_t>(store_tile.first_column + i)]);
+    }
+}
+
+// Expired entries are removed when their count could exceed the count of alive entries.
+void WorldStoreWriter::cleanUpPersistedBlocks() {
+    if (persisted_blocks.size() <= 2 * persisted_blocks_cleaning_size + LOADED_BLOCKS_CLEANING_STEP) {
+        return;
+    }
+    for (auto it = persisted_blocks.begin(); it != persisted_blocks.end();) {
+        it = it->second.block.expired() ? persisted_blocks.erase(it) : std::next(it);
+    }
+    for (auto it = persisted_tiles.begin(); it != persisted_tiles.end();) {
+        it = it->second.expired() ? persisted_tiles.erase(it) : std::next(it);
+    }
+    persisted_blocks_cleaning_size = persisted_blocks.size();
+}
+
+// Children of the block which were written by this save are resident, they could not be paged out without ids.
+template <std::uint8_t Level>
+void WorldStoreWriter::setChildIds(Block<Level>& block) {
+    for (BlockIndex i = 0; i < Block<Level>::CHILDREN_COUNT; ++i) {
+        auto& child = block.children[i];
+        if (child.getStoredId() == NULL_STORED_BLOCK) {
+            auto found = persisted_blocks.find(child.get());
+            if (found != persisted_blocks.end() && !found->second.block.expired()) {
+                child.setStoredId(found->second.id);
+            }
+        }
+    }
+}
+
+// Records are appended after the committed size, then the new index is written and replaces the old one.
+// Both files are synced before the replacement, so the index never refers to records which are not on the disk.
+bool WorldStoreWriter::commit() {
+    GKM_PROFILE_ZONE("commitWorldStore");
+    std::error_code error;
+    std::filesystem::create_directories(directory, error);
+    if (error) {
+        return false;
+    }
+    const std::string block_store_file_name = getFilePath(directory, BLOCK_STORE_FILE_NAME);
+    const std::string new_index_file_name = getFilePath(directory, NEW_INDEX_FILE_NAME);
+    {
+        std::fstream block_store_file;
+        if (store) {
+            block_store_file.open(block_store_file_name, std::ios::binary | std::ios::in | std::ios::out);
+            block_store_file.seekp(static_cast<std::streamoff>(store->getBlockStoreSize()));
+        } else {
+            // Store files which could not be opened are kept, they could be saved by another version of the game.
+            if (hasStoreFiles(directory)) {
+                g_world_store_statistics.rejected_store = true;
+                return false;
+            }
+            const StoredBlockStoreHeader block_store_header;
+            block_store_file.open(block_store_file_name, std::ios::binary | std::ios::out | std::ios::trunc);
+            block_store_file.write(reinterpret_cast<const char*>(&block_store_header), sizeof(block_store_header));
+        }
+        block_store_file.write(reinterpret_cast<const char*>(pending.data()), static_cast<std::streamsize>(pending.size()));
+        block_store_file.flush();
+        if (!block_store_file) {
+            return false;
+        }
+    }
+    {
+        StoredIndexHeader header;
+        header.version = store ? store->getVersion() : WORLD_STORE_VERSION;
+        header.tile_count = static_cast<std::uint32_t>(saved_tiles.size());
+        header.column_count = saved_columns.size();
+        header.block_store_size = getStoreSize();
+        std::ofstream index_file(new_index_file_name, std::ios::binary | std::ios::trunc);
+        index_file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        index_file.write(reinterpret_cast<const char*>(saved_tiles.data()), saved_tiles.size() * sizeof(StoredTile));
+        index_file.write(reinterpret_cast<const char*>(saved_columns.data()), saved_columns.size() * sizeof(StoredColumn));
+        index_file.flush();
+        if (!index_file) {
+            return false;
+        }
+    }
+    if (!syncFile(block_store_file_name) || !syncFile(new_index_file_name)) {
+        return false;
+    }
+    return replaceFile(new_index_file_name, getFilePath(directory, INDEX_FILE_NAME));
+}
+
+WorldStore::Ptr WorldStoreWriter::save(const std::vector<WorldTile::Ptr>& tiles) {
+    GKM_PROFILE_ZONE("saveWorldStore");
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<const WorldTile*> sorted_tiles;
+    for (const auto& tile : tiles) {
+        sorted_tiles.push_back(tile.get());
+    }
+    std::sort(sorted_tiles.begin(), sorted_tiles.end(), [](const WorldTile* left, const WorldTile* right) {
+        return left->getTileX() < right->getTileX() || (left->getTileX() == right->getTileX() && left->getTileY() < right->getTileY());
+    });
+
+    // Saved tiles of the store are merged with the new tiles, both are sorted.
+    saved_tiles.clear();
+    saved_columns.clear();
+    static const std::vector<StoredTile> no_tiles;
+    const std::vector<StoredTile>& store_tiles = store ? store->tiles : no_tiles;
+    auto store_tile = store_tiles.begin();
+    for (const WorldTile* tile : sorted_tiles) {
+        StoredTile saved_tile;
+        saved_tile.tile_x = tile->getTileX();
+        saved_tile.tile_y = tile->getTileY();
+        for (; store_tile != store_tiles.end() && isTileLess(*store_tile, saved_tile); ++store_tile) {
+            keepStoreTile(*store_tile);
+        }
+        const bool stored = store_tile != store_tiles.end() && !isTileLess(saved_tile, *store_tile);
+        if (stored) {
+            // The tile was not changed after the previous save.
+            auto persisted_tile = persisted_tiles.find(getWorldTileKey(saved_tile.tile_x, saved_tile.tile_y));
+            const bool persisted = persisted_tile != persisted_tiles.end() && persisted_tile->second.lock().get() == tile;
+            if (persisted) {
+                keepStoreTile(*store_tile++);
+                continue;
+            }
+            ++store_tile;
+        }
+        ++g_world_store_statistics.written_tiles;
+        saved_tile.first_column = saved_columns.size();
+        for (BlockIndex i = 0; i < WORLD_TILE_SIZE * WORLD_TILE_SIZE; ++i) {
+            const WorldColumn* column = tile->getColumn(i % WORLD_TILE_SIZE, i / WORLD_TILE_SIZE);
+            if (column) {
+                StoredColumn saved_column;
+                for (BlockIndex z = 0; z < WORLD_BLOCK_HEIGHT; ++z) {
+                    saved_column.blocks[z] = writeBlock<TOP_LEVEL>(column->getBlock(z));
+                }
+                saved_tile.column_mask |= 1ull << i;
+                saved_columns.push_back(saved_column);
+            }
+        }
+        saved_tiles.push_back(saved_tile);
+    }
+    for (; store_tile != store_tiles.end(); ++store_tile) {
+        keepStoreTile(*store_tile);
+    }
+
+    // Pending records and written parents are kept if commit failed, the next save appends them at the same ids.
+    if (!commit()) {
+        return nullptr;
+    }
+    pending.clear();
+    // Appended ids are valid only after the committed size, so the store is opened again before the writer uses them.
+    WorldStore::Ptr new_store = WorldStore::open(directory);
+    if (!new_store) {
+        // Without the committed size the writer could append over committed records, so all known ids are dropped.
+        // Store files are kept, so the writer refuses to save until the store is opened again.
+        g_world_store_statistics.rejected_store = true;
+        store = nullptr;
+        records.clear();
+        persisted_blocks.clear();
+        persisted_blocks_cleaning_size = 0;
+        written_parents.clear();
+        persisted_tiles.clear();
+        return nullptr;
+    }
+    // Records are committed, so the block pager could page out written children now.
+    for (const auto& [parent, level] : written_parents) {
+        if (level == 1) {
+            setChildIds(static_cast<Block<1>&>(*parent));
+        } else if (level == 2) {
+            setChildIds(static_cast<Block<2>&>(*parent));
+        } else {
+            setChildIds(static_cast<Block<3>&>(*parent));
+        }
+    }
+    written_parents.clear();
+    for (const auto& tile : tiles) {
+        persisted_tiles[getWorldTileKey(tile->getTileX(), tile->getTileY())] = tile;
+    }
+    cleanUpPersistedBlocks();
+    // Ids do not change by appending, so loaded blocks are shared with the new store.
+    if (store) {
+        std::lock_guard lock(store->loaded_blocks_mutex);
+        for (std::uint8_t level = 0; level < BLOCK_LEVEL_COUNT; ++level) {
+            new_store->loaded_blocks[level] = store->loaded_blocks[level];
+        }
+    }
+    store = new_store;
+    ++g_world_store_statistics.saves;
+    g_world_store_statistics.last_save_us = static_cast<std::uint64_t>(
+        std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+    return store;
+}
+
+void openWorldStore(const std::string& directory) {
+    WorldStore::Ptr store = WorldStore::open(directory);
+    g_world_store_statistics.rejected_store = !store && hasStoreFiles(directory);
+    std::lock_guard lock(g_world_store_mutex);
+    g_world_store_directory = directory;
+    g_world_store = store;
+}
+
+WorldStore::Ptr getWorldStore() {
+    std::lock_guard lock(g_world_store_mutex);
+    return g_world_store;
+}
+
+void closeWorldStore() {
+    std::lock_guard lock(g_world_store_mutex);
+    g_world_store = nullptr;
+}
+
+// Tiles which were changed during the save stay modified, they are saved by the next save.
+static bool saveWorld(WorldStoreWriter& writer) {
+    GKM_PROFILE_ZONE("saveWorld");
+    // Tiles are immutable, so they are saved after the version is released.
+    std::vector<WorldTile::Ptr> tiles;
+    {
+        WorldReader world_reader;
+        if (!world_reader.get()) {
+            return false;
+        }
+        world_reader.get()->forEachTile([&](const WorldTile::Ptr& tile) {
+            if (tile->isModified()) {
+                tiles.push_back(tile);
+            }
+        });
+    }
+    if (tiles.empty()) {
+        return true;
+    }
+    WorldStore::Ptr store = writer.save(tiles);
+    if (!store) {
+        return false;
+    }
+    {
+        std::lock_guard lock(g_world_store_mutex);
+        g_world_store = store;
+    }
+    WorldWriter world_writer;
+    for (const auto& tile : tiles) {
+        world_writer.markTileSaved(tile.get());
+    }
+    world_writer.publish();
+    return true;
+}
+
+static void worldSavingThread() {
+    beginBackgroundThread();
+    GKM_PROFILE_THREAD("World saving");
+
+    std::string directory;
+    {
+        std::lock_guard lock(g_world_store_mutex);
+        directory = g_world_store_directory;
+    }
+    WorldStoreWriter writer(directory, getWorldStore());
+    auto last_save = std::chrono::steady_clock::now();
+    while (g_is_running) {
+        std::this_thread::sleep_for(SAVING_PERIOD);
+        const bool autosave = g_world_store_settings.autosave &&
+            std::chrono::steady_clock::now() - last_save >= std::chrono::seconds(g_world_store_settings.autosave_period_s.load());
+        if (g_world_save_requested.exchange(false) || autosave) {
+            saveWorld(writer);
+            last_save = std::chrono::steady_clock::now();
+        }
+    }
+    if (g_world_store_settings.autosave || g_world_save_requested.exchange(false)) {
+        saveWorld(writer);
+    }
+
+    endBackgroundThread();
+}
+
+void startWorldSavingThread() {
+    g_world_saving_thread = std::make_unique<std::thread>(&worldSavingThread);
+}
+
+void finishWorldSavingThread() {
+    if (g_world_saving_thread) {
+        g_world_saving_thread->join();
+        g_world_saving_thread.reset();
+    }
+}
+
+void postWorldSave() {
+    ++g_world_store_statistics.save_requests;
+    g_world_save_requested = true;
+}
@@ -0,0 +1,218 @@
+// Copyright 2023 Petr Petrov. All rights reserved.
+// License: https://github.com/PetrPPetrov/gkm-local/blob/main/LICENSE
+
+#pragma once
+
+#include <cstdint>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "fnv_hash.h"
+#include "block.h"
+#include "world.h"
+#include "mapped_file.h"
+
+// Persistent world format mirrors the hash-consed block hierarchy, it is a directory with two files.
+// blocks.gkm is an append-only block store, every unique block is written once and its id is the offset of its record.
+// Leaf records are runs of materials, other records are runs of child ids, so children are written before their parent
+// and equal blocks have equal records. Writers find existing records by hash of their content.
+// columns.gkm is the column index: the committed size of the block store and top-level block ids of saved columns
+// grouped by tiles. Appended records and the new index are synced to the disk before the index is replaced at once,
+// so the store stays consistent if saving was interrupted by a crash or a power loss.
+// The block store is memory mapped, blocks are decoded from the mapping only when their tile is loaded,
+// children of levels 1 and 2 are decoded even later, when they are paged in (see block_paging.h).
+
+constexpr std::uint32_t WORLD_STORE_VERSION = 2;
+// Records of version 1 have no representative material, so children of their blocks are loaded with the parent.
+// Saves keep the version of an opened store, new stores are created with the current version.
+constexpr std::uint32_t MIN_WORLD_STORE_VERSION = 1;
+constexpr const char* WORLD_STORE_DIRECTORY = "world";
+
+struct StoredBlockStoreHeader {
+    char magic[8] = { 'G', 'K', 'M', 'B', 'L', 'O', 'C', 'K' };
+    std::uint32_t version = WORLD_STORE_VERSION;
+    std::uint32_t reserved = 0;
+};
+
+// Records are aligned by 8 bytes, they are followed by run_count runs.
+struct StoredBlockHeader {
+    // Hash of the record after this field.
+    FnvHash::Hash hash = 0;
+    std::uint8_t level = 0;
+    std::uint8_t entire = 1;
+    BlockMaterial material = 0;
+    // Parents know level of detail of their children without decoding them.
+    BlockMaterial representative_material = 0;
+    std::uint32_t run_count = 0;
+};
+
+struct StoredMaterialRun {
+    BlockMaterial material = 0;
+    std::uint8_t reserved = 0;
+    std::uint16_t count = 0;
+};
+
+struct StoredChildRun {
+    StoredBlockId child = NULL_STORED_BLOCK;
+    std::uint32_t count = 0;
+    std::uint32_t reserved = 0;
+};
+
+struct StoredIndexHeader {
+    char magic[8] = { 'G', 'K', 'M', 'I', 'N', 'D', 'E', 'X' };
+    std::uint32_t version = WORLD_STORE_VERSION;
+    std::uint32_t tile_count = 0;
+    std::uint64_t column_count = 0;
+    // Records after this size are not committed, they are overwritten by the next save.
+    std::uint64_t block_store_size = 0;
+};
+
+// Tiles are sorted by coordinates, columns of a tile follow each other in the order of bits of the column mask.
+// Columns which are not in the mask are the default column of the world.
+struct StoredTile {
+    BlockIndex tile_x = 0;
+    BlockIndex tile_y = 0;
+    std::uint64_t column_mask = 0;
+    std::uint64_t first_column = 0;
+};
+
+struct StoredColumn {
+    StoredBlockId blocks[WORLD_BLOCK_HEIGHT] = { NULL_STORED_BLOCK };
+};
+
+static_assert(WORLD_TILE_SIZE * WORLD_TILE_SIZE == 64, "Column mask has a bit per column of a tile");
+static_assert(sizeof(StoredBlockStoreHeader) % 8 == 0 && sizeof(StoredBlockHeader) % 8 == 0);
+static_assert(sizeof(StoredChildRun) % 8 == 0 && 8 % sizeof(StoredMaterialRun) == 0);
+
+struct WorldStoreStatistics {
+    std::atomic<std::uint32_t> stored_tiles = 0;
+    std::atomic<std::int64_t> block_store_bytes = 0;
+    std::atomic<std::uint64_t> loaded_tiles = 0;
+    // Records decoded by loading, blocks shared by loaded tiles are decoded once while they are alive.
+    std::atomic<std::uint64_t> loaded_blocks = 0;
+    std::atomic<std::uint64_t> save_requests = 0;
+    std::atomic<std::uint64_t> saves = 0;
+    // Tiles which were changed after the previous save.
+    std::atomic<std::uint64_t> written_tiles = 0;
+    std::atomic<std::uint64_t> written_blocks = 0;
+    // Changed blocks which were found in the store by hash.
+    std::atomic<std::uint64_t> reused_blocks = 0;
+    std::atomic<std::uint64_t> last_save_us = 0;
+    // The directory has store files which could not be opened, they are never overwritten, so saving is disabled.
+    std::atomic<bool> rejected_store = false;
+};
+
+extern WorldStoreStatistics g_world_store_statistics;
+
+// Opened store, it does not change. Every save opens a new store with the new index.
+class WorldStore {
+    friend class WorldStoreWriter;
+
+    std::string directory;
+    std::uint32_t version = WORLD_STORE_VERSION;
+    MappedFile block_store;
+    std::vector<StoredTile> tiles;
+    std::vector<StoredColumn> columns;
+    // Alive loaded blocks by id, so loaded tiles share them as saved tiles did.
+    std::mutex loaded_blocks_mutex;
+    std::unordered_map<StoredBlockId, std::weak_ptr<BlockBase>> loaded_blocks[BLOCK_LEVEL_COUNT];
+    std::size_t loaded_blocks_cleaning_size = 0;
+
+    template <std::uint8_t Level>
+    typename Block<Level>::Ptr findLoadedBlock(StoredBlockId id);
+    template <std::uint8_t Level>
+    typename Block<Level>::Ptr addLoadedBlock(StoredBlockId id, const typename Block<Level>::Ptr& block);
+
+public:
+    typedef std::shared_ptr<WorldStore> Ptr;
+
+    // Returns nullptr if the directory has no valid store.
+    static Ptr open(const std::string& directory);
+
+    // Returns the record if the id is a valid record of the level, records are valid while the store is alive.
+    const StoredBlockHeader* getRecord(StoredBlockId id, std::uint8_t level) const;
+    const StoredTile* findTile(BlockIndex tile_x, BlockIndex tile_y) const;
+    // Returns nullptr if the tile is not saved or its records are corrupted.
+    WorldTile::Ptr loadTile(BlockIndex tile_x, BlockIndex tile_y);
+    // Returns nullptr for the null id and for corrupted records. Children which are not entire are not loaded
+    // for levels above 1, they are paged in later. Records do not change, so any opened store loads the id.
+    template <std::uint8_t Level>
+    typename Block<Level>::Ptr loadBlock(StoredBlockId id);
+
+    std::uint64_t getBlockStoreSize() const {
+        return block_store.getSize();
+    }
+    std::uint32_t getVersion() const {
+        return version;
+    }
+};
+
+// Writes saved tiles to the store, the store is opened again after every commit.
+// The writer lives between saves, it remembers which blocks and tiles are already in the store,
+// so a save writes only blocks and tiles which were changed after the previous save.
+class WorldStoreWriter {
+    struct PersistedBlock {
+        std::weak_ptr<const BlockBase> block;
+        StoredBlockId id = NULL_STORED_BLOCK;
+    };
+
+    std::string directory;
+    WorldStore::Ptr store;
+    // Records written after the committed size of the store, they are appended to the block store on commit.
+    std::vector<std::uint8_t> pending;
+    // Ids of all records of the store and pending records by hash.
+    std::unordered_multimap<FnvHash::Hash, StoredBlockId> records;
+    // Alive blocks which are in the store, a block is not changed after it is published, so its id is known while it is alive.
+    std::unordered_map<const BlockBase*, PersistedBlock> persisted_blocks;
+    std::size_t persisted_blocks_cleaning_size = 0;
+    // Parents written by the current save, their children get ids when records are committed.
+    std::vector<std::pair<std::shared_ptr<BlockBase>, std::uint8_t>> written_parents;
+    // Saved versions of tiles by tile key, tiles are not changed after they are published.
+    std::unordered_map<std::uint64_t, std::weak_ptr<const WorldTile>> persisted_tiles;
+    std::vector<StoredTile> saved_tiles;
+    std::vector<StoredColumn> saved_columns;
+    std::vector<std::uint8_t> record;
+
+    std::uint64_t getStoreSize() const;
+    const std::uint8_t* getRecordData(StoredBlockId id) const;
+    template <std::uint8_t Level>
+    StoredBlockId writeBlock(const typename Block<Level>::Ptr& block);
+    StoredBlockId writeRecord();
+    void keepStoreTile(const StoredTile& store_tile);
+    void cleanUpPersistedBlocks();
+    template <std::uint8_t Level>
+    void setChildIds(Block<Level>& block);
+    bool commit();
+
+public:
+    // Store could be nullptr if the directory has no store yet.
+    WorldStoreWriter(const std::string& directory, const WorldStore::Ptr& store);
+
+    // Saves the tiles over saved tiles with the same coordinates and commits the store.
+    // Returns nullptr if the store could not be written, the previous store is not changed in this case.
+    // Returns nullptr as well if the committed store could not be opened again, the writer forgets the store then.
+    // Without an opened store a new store is created only if the directory has no store files.
+    WorldStore::Ptr save(const std::vector<WorldTile::Ptr>& tiles);
+};
+
+struct WorldStoreSettings {
+    std::atomic<bool> autosave = true;
+    std::atomic<std::int32_t> autosave_period_s = 30;
+};
+
+extern WorldStoreSettings g_world_store_settings;
+
+// The opened store is used by loading of world tiles.
+void openWorldStore(const std::string& directory);
+WorldStore::Ptr getWorldStore();
+void closeWorldStore();
+// The saving thread saves modified tiles of a world version in the background, the world is not locked while it is written.
+// Save requests and autosaves which come during a save are committed together by the next save.
+// It saves the world once more when it is finished if autosave is on.
+void startWorldSavingThread();
+void finishWorldSavingThread();
+void postWorldSave();
@@ -0,0 +1,249 @@
+// Copyright 2023 Petr Petrov. All rights reserved.
+// License: https://github.com/PetrPPetrov/gkm-local/blob/main/LICENSE
+
+#include <cstdint>
+#include <cstdlib>
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <optional>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "main.h"
+#include "game_logic.h"
+#include "profiler.h"
+#include "request_queue.h"
+#include "world.h"
+#include "world_streaming.h"
+
+WorldStreamingSettings g_world_streaming_settings;
+WorldStreamingStatistics g_world_streaming_statistics;
+
+constexpr std::chrono::milliseconds STREAMING_PERIOD(100);
+constexpr std::uint32_t STREAMING_WORKER_COUNT = 2;
+constexpr std::uint32_t STREAMING_BATCH_SIZE = 16;
+// Estimate of a requested tile, generated tiles have no own columns, only saved tiles have them.
+constexpr std::int64_t REQUESTED_TILE_SIZE = sizeof(WorldTile);
+
+struct WorldTileRequest {
+    bool finish = false;
+    BlockIndex tile_x = 0;
+    BlockIndex tile_y = 0;
+};
+
+struct ResidentTile {
+    BlockIndex tile_x = 0;
+    BlockIndex tile_y = 0;
+    BlockIndex distance = 0;
+    bool modified = false;
+    std::int64_t memory_size = 0;
+};
+
+static std::unique_ptr<std::thread> g_streaming_thread = nullptr;
+static std::vector<std::unique_ptr<std::thread>> g_streaming_worker_threads;
+static RequestQueue<WorldTileRequest> g_world_tile_queue("world_streaming");
+
+// Distance in tiles, radii are square rings around the tile of the player.
+static BlockIndex getTileDistance(BlockIndex tile_x, BlockIndex tile_y, BlockIndex center_x, BlockIndex center_y) {
+    return std::max(std::abs(tile_x - center_x), std::abs(tile_y - center_y));
+}
+
+static void streamingWorkerThread() {
+    beginBackgroundThread();
+    GKM_PROFILE_THREAD("World streaming worker");
+
+    WorldTileRequest requests[STREAMING_BATCH_SIZE];
+    std::vector<WorldTile::Ptr> tiles;
+    while (g_is_running) {
+        std::uint32_t count = g_world_tile_queue.waitForNewRequests(requests, STREAMING_BATCH_SIZE);
+        while (count > 0) {
+            tiles.clear();
+            for (std::uint32_t i = 0; i < count; ++i) {
+                if (!g_is_running || requests[i].finish) {
+                    return;
+                }
+                GKM_PROFILE_ZONE("loadWorldTile");
+                tiles.push_back(loadWorldTile(requests[i].tile_x, requests[i].tile_y));
+            }
+            // Tiles are loaded without the writer lock, they are added by one version.
+            {
+                GKM_PROFILE_ZONE("addWorldTiles");
+                WorldWriter world_writer;
+                for (const auto& tile : tiles) {
+                    if (world_writer.addTile(tile)) {
+                        ++g_world_streaming_statistics.loaded_tiles;
+                    }
+                }
+                world_writer.publish();
+            }
+            count = g_world_tile_queue.popBatch(requests, STREAMING_BATCH_SIZE);
+        }
+    }
+
+    endBackgroundThread();
+}
+
+class WorldStreamer {
+    // Requested tiles which are not resident yet, by tile key.
+    std::unordered_map<std::uint64_t, WorldTileRequest> pending;
+    std::unordered_set<std::uint64_t> resident;
+    std::vector<ResidentTile> resident_tiles;
+    std::vector<ResidentTile> candidates;
+
+public:
+    void update() {
+        GKM_PROFILE_ZONE("updateWorldStreaming");
+        const PlayerCoordinates player_coordinates = g_player_coordinates.read();
+        BlockIndex local;
+        const BlockIndex player_column_x = coordToBlockIndex<TOP_LEVEL>(static_cast<BlockIndex>(player_coordinates.x), local);
+        const BlockIndex player_column_y = coordToBlockIndex<TOP_LEVEL>(static_cast<BlockIndex>(player_coordinates.y), local);
+        const BlockIndex center_x = columnToTileIndex(player_column_x, local);
+        const BlockIndex center_y = columnToTileIndex(player_column_y, local);
+        const BlockIndex load_radius = std::max(g_world_streaming_settings.load_radius.load(), 0);
+        const BlockIndex unload_radius = std::max(g_world_streaming_settings.unload_radius.load(), load_radius);
+        const std::int64_t memory_budget = g_world_streaming_settings.memory_budget;
+
+        resident_tiles.clear();
+        resident.clear();
+        std::int64_t resident_bytes = 0;
+        std::uint32_t modified_tiles = 0;
+        {
+            WorldReader world_reader;
+            if (!world_reader.get()) {
+                return;
+            }
+            world_reader.get()->forEachTile([&](const WorldTile::Ptr& tile) {
+                ResidentTile resident_tile;
+                resident_tile.tile_x = tile->getTileX();
+                resident_tile.tile_y = tile->getTileY();
+                resident_tile.distance = getTileDistance(tile->getTileX(), tile->getTileY(), center_x, center_y);
+                resident_tile.modified = tile->isModified();
+                resident_tile.memory_size = static_cast<std::int64_t>(tile->getMemorySize());
+                resident_tiles.push_back(resident_tile);
+                resident.insert(getWorldTileKey(tile->getTileX(), tile->getTileY()));
+                resident_bytes += resident_tile.memory_size;
+                modified_tiles += tile->isModified() ? 1 : 0;
+            });
+        }
+
+        // Requests of tiles outside the unload radius are forgotten, the tile is evicted if it is added later.
+        for (auto it = pending.begin(); it != pending.end();) {
+            const bool far = getTileDistance(it->second.tile_x, it->second.tile_y, center_x, center_y) > unload_radius;
+            if (far || resident.count(it->first) != 0) {
+                it = pending.erase(it);
+            } else {
+                ++it;
+            }
+        }
+
+        evictTiles(load_radius, unload_radius, memory_budget, resident_bytes);
+        requestTiles(center_x, center_y, load_radius, memory_budget, resident_bytes);
+
+        g_world_streaming_statistics.resident_tiles = static_cast<std::uint32_t>(resident.size());
+        g_world_streaming_statistics.modified_tiles = modified_tiles;
+        g_world_streaming_statistics.resident_bytes = resident_bytes;
+        g_world_streaming_statistics.pending_tiles = static_cast<std::uint32_t>(pending.size());
+    }
+
+private:
+    // Evicts the farthest tiles first, tiles inside the load radius are not evicted even above the memory budget.
+    void evictTiles(BlockIndex load_radius, BlockIndex unload_radius, std::int64_t memory_budget, std::int64_t& resident_bytes) {
+        std::sort(resident_tiles.begin(), resident_tiles.end(), [](const ResidentTile& left, const ResidentTile& right) {
+            return left.distance > right.distance;
+        });
+        // The writer lock is taken only if some tile could be evicted.
+        std::optional<WorldWriter> world_writer;
+        for (const auto& tile : resident_tiles) {
+            if (tile.distance <= load_radius || (tile.distance <= unload_radius && resident_bytes <= memory_budget)) {
+                break;
+            }
+            if (tile.modified) {
+                continue;
+            }
+            if (!world_writer) {
+                world_writer.emplace();
+            }
+            // The tile could be modified after it was collected, the writer checks it again.
+            if (world_writer->removeTile(tile.tile_x, tile.tile_y)) {
+                resident_bytes -= tile.memory_size;
+                resident.erase(getWorldTileKey(tile.tile_x, tile.tile_y));
+                ++g_world_streaming_statistics.evicted_tiles;
+            }
+        }
+        if (world_writer) {
+            GKM_PROFILE_ZONE("publishEvictedWorldTiles");
+            world_writer->publish();
+        }
+    }
+
+    // Requests missing tiles inside the load radius, the nearest first, while they fit into the memory budget.
+    void requestTiles(BlockIndex center_x, BlockIndex center_y, BlockIndex load_radius, std::int64_t memory_budget, std::int64_t resident_bytes) {
+        candidates.clear();
+        for (BlockIndex tile_y = center_y - load_radius; tile_y <= center_y + load_radius; ++tile_y) {
+            for (BlockIndex tile_x = center_x - load_radius; tile_x <= center_x + load_radius; ++tile_x) {
+                const std::uint64_t key = getWorldTileKey(tile_x, tile_y);
+                if (resident.count(key) == 0 && pending.count(key) == 0) {
+                    ResidentTile candidate;
+                    candidate.tile_x = tile_x;
+                    candidate.tile_y = tile_y;
+                    // Squared Euclidean distance, so tiles are requested in rings close to circles.
+                    candidate.distance = (tile_x - center_x) * (tile_x - center_x) + (tile_y - center_y) * (tile_y - center_y);
+                    candidates.push_back(candidate);
+                }
+            }
+        }
+        std::sort(candidates.begin(), candidates.end(), [](const ResidentTile& left, const ResidentTile& right) {
+            return left.distance < right.distance;
+        });
+        for (const auto& candidate : candidates) {
+            if (resident_bytes + static_cast<std::int64_t>(pending.size() + 1) * REQUESTED_TILE_SIZE > memory_budget) {
+                break;
+            }
+            WorldTileRequest request;
+            request.tile_x = candidate.tile_x;
+            request.tile_y = candidate.tile_y;
+            // Full queue means that workers are busy, the tile is requested again by the next update.
+            if (!g_world_tile_queue.push(request, EPushPolicy::Drop)) {
+                break;
+            }
+            pending.emplace(getWorldTileKey(candidate.tile_x, candidate.tile_y), request);
+        }
+    }
+};
+
+static void streamingThread() {
+    beginBackgroundThread();
+    GKM_PROFILE_THREAD("World streaming");
+
+    WorldStreamer streamer;
+    while (g_is_running) {
+        streamer.update();
+        std::this_thread::sleep_for(STREAMING_PERIOD);
+    }
+
+    endBackgroundThread();
+}
+
+void startWorldStreamingThreads() {
+    for (std::uint32_t i = 0; i < STREAMING_WORKER_COUNT; ++i) {
+        g_streaming_worker_threads.push_back(std::make_unique<std::thread>(&streamingWorkerThread));
+    }
+    g_streaming_thread = std::make_unique<std::thread>(&streamingThread);
+}
+
+void finishWorldStreamingThreads() {
+    g_streaming_thread->join();
+    g_streaming_thread.reset();
+    for (std::size_t i = 0; i < g_streaming_worker_threads.size(); ++i) {
+        WorldTileRequest wakeup_and_finish_request;
+        wakeup_and_finish_request.finish = true;
+        // Full queue means that workers are busy, they check g_is_running after every request.
+        g_world_tile_queue.push(wakeup_and_finish_request, EPushPolicy::Drop);
+    }
+    for (auto& worker_thread : g_streaming_worker_threads) {
+        worker_thread->join();
+    }
+    g_streaming_worker_threads.clear();
+}
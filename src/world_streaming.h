@@ -0,0 +1,36 @@
+// Copyright 2023 Petr Petrov. All rights reserved.
+// License: https://github.com/PetrPPetrov/gkm-local/blob/main/LICENSE
+
+#pragma once
+
+#include <cstdint>
+#include <atomic>
+
+// World streaming keeps world tiles around the player resident.
+// The streaming thread watches the player coordinates, requests missing tiles inside the load radius nearest first
+// and evicts tiles outside the unload radius. Tiles are generated or loaded by streaming workers.
+// Tiles changed by block operations are not evicted until they are saved.
+
+struct WorldStreamingSettings {
+    // Radii in world tiles around the tile of the player, the unload radius is not less than the load radius.
+    std::atomic<std::int32_t> load_radius = 3;
+    std::atomic<std::int32_t> unload_radius = 5;
+    // Resident tiles above this size are evicted if they are outside the load radius, and no more tiles are requested.
+    std::atomic<std::int64_t> memory_budget = 64 * 1024 * 1024;
+};
+
+struct WorldStreamingStatistics {
+    std::atomic<std::uint32_t> resident_tiles = 0;
+    std::atomic<std::uint32_t> modified_tiles = 0;
+    std::atomic<std::int64_t> resident_bytes = 0;
+    // Requested tiles which are not resident yet.
+    std::atomic<std::uint32_t> pending_tiles = 0;
+    std::atomic<std::uint64_t> loaded_tiles = 0;
+    std::atomic<std::uint64_t> evicted_tiles = 0;
+};
+
+extern WorldStreamingSettings g_world_streaming_settings;
+extern WorldStreamingStatistics g_world_streaming_statistics;
+
+void startWorldStreamingThreads();
+void finishWorldStreamingThreads();